@@ -0,0 +1,447 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+// Microbenchmarks for the components of the sampling hot path. This is built
+// as the benchmarks._micro extension when ECHION_BUILD_BENCHMARKS is set (see
+// setup.py), and run with
+//
+//   python -m benchmarks.micro [FILTER]
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#if PY_VERSION_HEX >= 0x030c0000
+// https://github.com/python/cpython/issues/108216#issuecomment-1696565797
+#undef _PyGC_FINALIZED
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <echion/cache.h>
+#include <echion/frame.h>
+#include <echion/mirrors.h>
+#include <echion/render.h>
+#include <echion/stacks.h>
+#include <echion/strings.h>
+#include <echion/tick_reads.h>
+#include <echion/vm.h>
+
+// ----------------------------------------------------------------------------
+// Keep the compiler from optimising away the computation of a value.
+template <typename T>
+static inline void keep(T const& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// ----------------------------------------------------------------------------
+class Harness
+{
+public:
+    Harness(std::string filter, double min_time, PyObject* results)
+        : filter(std::move(filter)), min_time(min_time), results(results)
+    {
+    }
+
+    // ------------------------------------------------------------------------
+    // Run the benchmark, that is the given number of iterations of the code
+    // under test, with enough iterations to last at least min_time seconds,
+    // and report the time per iteration.
+    void run(const std::string& name, const std::function<void(size_t)>& benchmark)
+    {
+        if (name.find(filter) == std::string::npos)
+            return;
+
+        size_t iterations = 1;
+        double elapsed = 0;
+        for (;;)
+        {
+            auto start = std::chrono::steady_clock::now();
+            benchmark(iterations);
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                          .count();
+
+            if (elapsed >= min_time)
+                break;
+
+            // Aim a bit past the minimum time, growing at most tenfold.
+            auto factor = elapsed > 0 ? 1.2 * min_time / elapsed : 10.0;
+            iterations *= std::clamp(factor, 2.0, 10.0);
+        }
+
+        auto ns = elapsed * 1e9 / iterations;
+
+        std::cout << std::left << std::setw(48) << name << std::right << std::setw(12)
+                  << std::fixed << std::setprecision(1) << ns << " ns" << std::setw(14)
+                  << iterations << std::endl;
+
+        PyObject* value = PyFloat_FromDouble(ns);
+        if (value != nullptr)
+        {
+            PyDict_SetItemString(results, name.c_str(), value);
+            Py_DECREF(value);
+        }
+    }
+
+private:
+    std::string filter;
+    double min_time;
+    PyObject* results;
+};
+
+// ----------------------------------------------------------------------------
+static void bench_copy_memory(Harness& harness)
+{
+    struct Backend
+    {
+        const char* name;
+        decltype(safe_copy) copy;
+        bool available;
+    };
+
+    std::vector<Backend> backends = {
+#if defined PL_LINUX
+        {"process_vm_readv", process_vm_readv, true},
+        {"vmreader", vmreader_safe_copy, read_process_vm_init()},
+#elif defined PL_DARWIN
+        {"mach_vm_read_overwrite", mach_vm_read_overwrite, true},
+#endif
+        {"memcpy", safe_memcpy_wrapper, init_segv_catcher() == 0},
+    };
+
+    std::vector<char> source(1 << 16, 'e');
+    std::vector<char> destination(source.size());
+
+    auto default_copy = safe_copy;
+
+    for (auto& backend : backends)
+    {
+        if (!backend.available)
+            continue;
+
+        safe_copy = backend.copy;
+
+        for (size_t size : {64, 4096, 65536})
+        {
+            harness.run(std::string("copy_memory/") + backend.name + "/" + std::to_string(size),
+                        [&](size_t n) {
+                            for (size_t i = 0; i < n; i++)
+                                keep(copy_generic(source.data(), destination.data(), size));
+                        });
+
+            harness.run(std::string("copy_memory_view/") + backend.name + "/" + std::to_string(size),
+                        [&](size_t n) {
+                            for (size_t i = 0; i < n; i++)
+                                keep(copy_view(source.data(), size));
+                        });
+        }
+    }
+
+    // A stack walk makes many small reads, which can run as a batch.
+    for (auto& backend : backends)
+    {
+        if (!backend.available)
+            continue;
+
+        safe_copy = backend.copy;
+
+        auto reads = [&]() {
+            for (size_t k = 0; k < 16; k++)
+                keep(copy_generic(source.data() + k * 64, destination.data() + k * 64, 64));
+        };
+
+        harness.run(std::string("copy_memory/") + backend.name + "/16x64", [&](size_t n) {
+            for (size_t i = 0; i < n; i++)
+                reads();
+        });
+
+        harness.run(std::string("copy_memory_batch/") + backend.name + "/16x64", [&](size_t n) {
+            for (size_t i = 0; i < n; i++)
+                keep(copy_memory_batch(reads));
+        });
+    }
+
+    // Stale pointers lead to reads of memory that is no longer readable.
+    auto* unreadable = mmap(nullptr, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unreadable != MAP_FAILED)
+    {
+        for (auto& backend : backends)
+        {
+            if (!backend.available)
+                continue;
+
+            safe_copy = backend.copy;
+
+            harness.run(std::string("copy_memory/") + backend.name + "/unreadable", [&](size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    keep(copy_generic(unreadable, destination.data(), 64));
+            });
+
+            // A stack walk that runs into a stale frame pointer.
+            auto reads = [&]() {
+                for (size_t k = 0; k < 15; k++)
+                    keep(copy_generic(source.data() + k * 64, destination.data() + k * 64, 64));
+                keep(copy_generic(unreadable, destination.data(), 64));
+            };
+
+            harness.run(std::string("copy_memory_batch/") + backend.name + "/16x64/unreadable",
+                        [&](size_t n) {
+                            for (size_t i = 0; i < n; i++)
+                                keep(copy_memory_batch(reads));
+                        });
+        }
+
+        munmap(unreadable, 4096);
+    }
+
+    safe_copy = default_copy;
+}
+
+// ----------------------------------------------------------------------------
+static void bench_lru_cache(Harness& harness)
+{
+    constexpr size_t capacity = 1024;
+
+    LRUCache<uintptr_t, Frame> cache(capacity);
+    for (uintptr_t k = 0; k < capacity; k++)
+        cache.store(k, std::make_unique<Frame>(StringTable::UNKNOWN));
+
+    harness.run("LRUCache::lookup/hit", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            keep(cache.lookup((i * 7) % capacity));
+    });
+
+    harness.run("LRUCache::lookup/miss", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            keep(cache.lookup(capacity + i));
+    });
+
+    // Every store of a new key evicts the least recently used one.
+    uintptr_t next = capacity;
+    harness.run("LRUCache::store", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            cache.store(next++, std::make_unique<Frame>(StringTable::UNKNOWN));
+    });
+}
+
+// ----------------------------------------------------------------------------
+static void bench_string_table(Harness& harness, PyObject* strings)
+{
+    std::vector<PyObject*> objects;
+    for (Py_ssize_t i = 0; i < PyList_Size(strings); i++)
+        objects.push_back(PyList_GetItem(strings, i));
+
+    if (objects.empty())
+        return;
+
+    harness.run("StringTable::key/hit", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            keep(string_table.key(objects[i % objects.size()]));
+    });
+
+    // A new cache epoch makes every string be read again on its first hit.
+    harness.run("StringTable::key/revalidate", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (i % objects.size() == 0)
+                cache_epoch++;
+            keep(string_table.key(objects[i % objects.size()]));
+        }
+    });
+}
+
+// ----------------------------------------------------------------------------
+static void bench_frame(Harness& harness, PyObject* codes)
+{
+    std::vector<std::pair<PyCodeObject*, int>> locations;
+    for (Py_ssize_t i = 0; i < PyList_Size(codes); i++)
+    {
+        auto* code = reinterpret_cast<PyCodeObject*>(PyList_GetItem(codes, i));
+        if (!PyCode_Check(code))
+            continue;
+
+#if PY_VERSION_HEX >= 0x030b0000
+        auto size = static_cast<int>(Py_SIZE(code));
+#else
+        auto size = static_cast<int>(PyBytes_Size(code->co_code) / sizeof(_Py_CODEUNIT));
+#endif
+        // A few locations spread over the whole code object
+        for (int lasti = 0; lasti < size; lasti += std::max(1, size / 8))
+            locations.emplace_back(code, lasti);
+    }
+
+    if (locations.empty())
+        return;
+
+    harness.run("Frame::create", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+            auto& [code, lasti] = locations[i % locations.size()];
+            keep(Frame::create(code, lasti));
+        }
+    });
+}
+
+// ----------------------------------------------------------------------------
+static void bench_frame_stack(Harness& harness)
+{
+    std::vector<Frame> frames;
+    for (uintptr_t k = 1; k <= 256; k++)
+    {
+        frames.emplace_back(StringTable::UNKNOWN);
+        frames.back().cache_key = k * 0x9e3779b97f4a7c15ULL;
+    }
+
+    for (size_t depth : {16, 64, 256})
+    {
+        FrameStack stack;
+        for (size_t i = 0; i < depth; i++)
+            stack.push_back(std::ref(frames[i]));
+
+        harness.run("FrameStack::key/" + std::to_string(depth), [&](size_t n) {
+            for (size_t i = 0; i < n; i++)
+                keep(stack.key());
+        });
+    }
+}
+
+// ----------------------------------------------------------------------------
+static void bench_mirror_set(Harness& harness, PyObject* sets)
+{
+    for (Py_ssize_t i = 0; i < PyList_Size(sets); i++)
+    {
+        auto* set = PyList_GetItem(sets, i);
+
+        harness.run("MirrorSet::create/" + std::to_string(PySet_Size(set)), [&](size_t n) {
+            for (size_t i = 0; i < n; i++)
+                keep(MirrorSet::create(set));
+        });
+
+        // Threads that run an event loop read the same set within a tick.
+        TickReadScope reads;
+        harness.run("MirrorSet::create/tick/" + std::to_string(PySet_Size(set)), [&](size_t n) {
+            for (size_t i = 0; i < n; i++)
+                keep(MirrorSet::create(set));
+        });
+    }
+}
+
+// ----------------------------------------------------------------------------
+static void bench_mojo_renderer(Harness& harness)
+{
+    auto* output = std::getenv("ECHION_OUTPUT");
+    std::string previous = output != nullptr ? output : "";
+
+    setenv("ECHION_OUTPUT", "/dev/null", 1);
+
+    MojoRenderer renderer;
+    auto open_success = renderer.open();
+
+    if (previous.empty())
+        unsetenv("ECHION_OUTPUT");
+    else
+        setenv("ECHION_OUTPUT", previous.c_str(), 1);
+
+    if (!open_success)
+        return;
+
+    std::vector<Frame> frames;
+    for (uintptr_t k = 1; k <= 64; k++)
+    {
+        frames.emplace_back(StringTable::UNKNOWN);
+        frames.back().cache_key = k << 20;
+    }
+
+    FrameStack stack;
+    for (auto& frame : frames)
+        stack.push_back(std::ref(frame));
+
+    std::string thread_name = "MainThread";
+
+    harness.run("MojoRenderer/stack/64", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+        {
+            renderer.render_stack_begin(1234, 0, thread_name);
+            renderer.render_stack(stack);
+            renderer.render_stack_end(MetricType::Time, 1000 + i % 1000);
+        }
+    });
+
+    harness.run("MojoRenderer/string", [&](size_t n) {
+        for (size_t i = 0; i < n; i++)
+            renderer.string(i, thread_name);
+    });
+
+    renderer.close();
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* run(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    const char* filter = "";
+    double min_time = 0.2;
+    PyObject* strings = nullptr;
+    PyObject* codes = nullptr;
+    PyObject* sets = nullptr;
+
+    if (!PyArg_ParseTuple(args, "O!O!O!|sd", &PyList_Type, &strings, &PyList_Type, &codes,
+                          &PyList_Type, &sets, &filter, &min_time))
+        return NULL;
+
+    PyObject* results = PyDict_New();
+    if (results == NULL)
+        return NULL;
+
+    pid = getpid();
+
+    Harness harness(filter, min_time, results);
+
+    std::cout << std::left << std::setw(48) << "benchmark" << std::right << std::setw(15)
+              << "time/op" << std::setw(14) << "iterations" << std::endl;
+
+    bench_copy_memory(harness);
+    bench_lru_cache(harness);
+    bench_string_table(harness, strings);
+    bench_frame(harness, codes);
+    bench_frame_stack(harness);
+    bench_mirror_set(harness, sets);
+    bench_mojo_renderer(harness);
+
+    return results;
+}
+
+// ----------------------------------------------------------------------------
+static PyMethodDef micro_methods[] = {
+    {"run", run, METH_VARARGS, "Run the microbenchmarks"},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+// ----------------------------------------------------------------------------
+static struct PyModuleDef micromodule = {
+    PyModuleDef_HEAD_INIT,
+    "_micro", /* name of module */
+    NULL,     /* module documentation, may be NULL */
+    -1,       /* size of per-interpreter state of the module,
+                 or -1 if the module keeps state in global variables. */
+    micro_methods,
+    nullptr, /* m_traverse */
+    nullptr, /* m_clear */
+    nullptr, /* m_free */
+    nullptr, /* m_is_preinitialised */
+};
+
+// ----------------------------------------------------------------------------
+PyMODINIT_FUNC PyInit__micro(void)
+{
+    return PyModule_Create(&micromodule);
+}
@@ -0,0 +1,64 @@
+# This file is part of "echion" which is released under MIT.
+#
+# Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+# Runs the C++ microbenchmarks of the sampling hot path, on code objects and
+# strings taken from real modules. The benchmarks._micro extension is only
+# built when ECHION_BUILD_BENCHMARKS is set, e.g.
+#
+#   ECHION_BUILD_BENCHMARKS=1 python setup.py build_ext --inplace
+#   python -m benchmarks.micro
+
+import argparse
+import asyncio
+import json
+import threading
+import types
+import typing as t
+from pathlib import Path
+
+
+def code_objects(*modules: types.ModuleType) -> t.List[types.CodeType]:
+    codes = []
+
+    def collect(code: types.CodeType) -> None:
+        codes.append(code)
+        for const in code.co_consts:
+            if isinstance(const, types.CodeType):
+                collect(const)
+
+    for module in modules:
+        collect(compile(Path(module.__file__).read_text(), module.__file__, "exec"))
+
+    return codes
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Echion microbenchmarks")
+    parser.add_argument("filter", nargs="?", default="", help="run matching benchmarks")
+    parser.add_argument(
+        "--min-time", type=float, default=0.2, help="minimum time per benchmark (s)"
+    )
+    parser.add_argument("-o", "--output", type=Path, help="save the results as JSON")
+    args = parser.parse_args()
+
+    try:
+        from benchmarks import _micro
+    except ImportError:
+        raise SystemExit(
+            "The microbenchmarks are not built. "
+            "Build them with ECHION_BUILD_BENCHMARKS=1 python setup.py build_ext --inplace"
+        )
+
+    codes = code_objects(threading, asyncio.base_events, json.decoder)
+    strings = [_.co_name for _ in codes] + [_.co_filename for _ in codes]
+    sets = [set(range(64)), set(range(1024))]
+
+    results = _micro.run(strings, codes, sets, args.filter, args.min_time)
+
+    if args.output is not None:
+        args.output.write_text(json.dumps(results, indent=2))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,267 @@
+# This file is part of "echion" which is released under MIT.
+#
+# Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+# Measures the overhead of the sampler on the benchmark workloads. Every
+# configuration of a workload is run without echion first, and then under each
+# combination of sampling mode and safe copy backend. We report
+#
+#   - the slowdown of the target, from the duration of the work it does;
+#   - the CPU time that echion adds to the process while the target works, per
+#     nominal sampler tick, that is per sampling interval of wall time.
+#
+# Both are measured by the workloads themselves, so they do not include the
+# startup and shutdown costs of the interpreter and of echion.
+#
+#   python -m benchmarks.run -o results.json
+#   python -m benchmarks.run --compare results.json
+
+import argparse
+import json
+import os
+import statistics
+import sys
+import tempfile
+import typing as t
+from itertools import product
+from pathlib import Path
+from subprocess import PIPE
+from subprocess import TimeoutExpired
+from subprocess import run
+
+
+MODES = {
+    "wall": [],
+    "cpu": ["--cpu"],
+    "memory": ["--memory"],
+    "native": ["--native"],
+}
+
+# The environment variables that select each safe copy backend.
+BACKENDS = {
+    "readv": {},
+    "writev": {"ECHION_ALT_VM_READ_FORCE": "1"},
+    "memcpy": {"ECHION_USE_FAST_COPY_MEMORY": "1"},
+}
+
+# The parameters that each workload takes.
+PARAMETERS = {
+    "cpu": ("threads", "depth"),
+    "async_tasks": ("tasks", "depth"),
+    "gevent": ("tasks", "depth"),
+    "mem": ("threads", "depth"),
+}
+
+
+def csv(cast: t.Callable[[str], t.Any]) -> t.Callable[[str], t.List[t.Any]]:
+    return lambda v: [cast(_) for _ in v.split(",") if _]
+
+
+def measure(
+    command: t.List[str], env: t.Dict[str, str], timeout: float
+) -> t.Dict[str, float]:
+    try:
+        result = run(command, stdout=PIPE, stderr=PIPE, env=env, timeout=timeout)
+    except TimeoutExpired as e:
+        raise RuntimeError(f"{' '.join(command)} timed out") from e
+
+    if result.returncode != 0:
+        raise RuntimeError(
+            f"{' '.join(command)} failed with exit code {result.returncode}\n"
+            f"{result.stderr.decode()}"
+        )
+
+    return json.loads(result.stdout.decode().strip().splitlines()[-1])
+
+
+def bench(
+    command: t.List[str], env: t.Dict[str, str], args: argparse.Namespace
+) -> t.List[t.Dict[str, float]]:
+    for _ in range(args.warmups):
+        measure(command, env, args.timeout)
+
+    return [measure(command, env, args.timeout) for _ in range(args.runs)]
+
+
+def mean(samples: t.List[t.Dict[str, float]], metric: str) -> float:
+    return statistics.mean(_[metric] for _ in samples)
+
+
+def stdev(samples: t.List[t.Dict[str, float]], metric: str) -> float:
+    return statistics.stdev(_[metric] for _ in samples) if len(samples) > 1 else 0.0
+
+
+def configurations(
+    args: argparse.Namespace,
+) -> t.Iterator[t.Tuple[str, t.Dict[str, int]]]:
+    for workload in args.workloads:
+        names = PARAMETERS[workload]
+        for values in product(*(getattr(args, _) for _ in names)):
+            yield workload, dict(zip(names, values))
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Echion overhead benchmarks")
+    parser.add_argument(
+        "--workloads", type=csv(str), default=list(PARAMETERS), help="workloads to run"
+    )
+    parser.add_argument(
+        "--modes", type=csv(str), default=list(MODES), help="sampling modes"
+    )
+    parser.add_argument(
+        "--backends",
+        type=csv(str),
+        default=list(BACKENDS) if sys.platform == "linux" else ["readv", "memcpy"],
+        help="safe copy backends",
+    )
+    parser.add_argument("--threads", type=csv(int), default=[1, 4])
+    parser.add_argument("--depth", type=csv(int), default=[8, 64])
+    parser.add_argument("--tasks", type=csv(int), default=[1, 64])
+    parser.add_argument("--scale", type=float, default=1.0, help="workload size")
+    parser.add_argument(
+        "-i", "--interval", type=int, default=1000, help="sampling interval (us)"
+    )
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--warmups", type=int, default=1)
+    parser.add_argument(
+        "--timeout", type=float, default=120, help="timeout of each run (s)"
+    )
+    parser.add_argument("-o", "--output", type=Path, help="save the results as JSON")
+    parser.add_argument(
+        "--compare", type=Path, help="compare against saved results as JSON"
+    )
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.1,
+        help="relative increase in slowdown that counts as a regression",
+    )
+    args = parser.parse_args()
+
+    for name, choices in (
+        ("workloads", PARAMETERS),
+        ("modes", MODES),
+        ("backends", BACKENDS),
+    ):
+        for value in getattr(args, name):
+            if value not in choices:
+                parser.error(f"invalid {name[:-1]}: {value}")
+
+    baseline = json.loads(args.compare.read_text()) if args.compare else {}
+    results: t.Dict[str, t.Any] = {}
+    regressions = []
+    failures = []
+
+    print(
+        f"{'benchmark':<56} {'slowdown':>14} {'cpu/tick (us)':>14}"
+        + (f" {'vs baseline':>12}" if baseline else "")
+    )
+
+    with tempfile.TemporaryDirectory() as tmp:
+        output = str(Path(tmp) / "bench.mojo")
+
+        for workload, parameters in configurations(args):
+            if workload == "gevent":
+                try:
+                    import gevent  # noqa: F401
+                except ImportError:
+                    continue
+
+            target = [
+                sys.executable,
+                "-m",
+                "benchmarks.workloads",
+                workload,
+                f"--scale={args.scale}",
+                *(f"--{k}={v}" for k, v in parameters.items()),
+            ]
+            label = workload + "".join(f"-{k}{v}" for k, v in parameters.items())
+
+            env = dict(os.environ)
+            reference = bench(target, env, args)
+
+            for mode, backend in product(args.modes, args.backends):
+                command = [
+                    sys.executable,
+                    "-m",
+                    "echion",
+                    "-i",
+                    str(args.interval),
+                    *MODES[mode],
+                    "-o",
+                    output,
+                    *target,
+                ]
+                key = f"{label}/{mode}/{backend}"
+
+                try:
+                    samples = bench(command, {**env, **BACKENDS[backend]}, args)
+                except RuntimeError as e:
+                    # Report the failure and carry on with the other benchmarks.
+                    print(f"{key:<56} {'failed':>14}", flush=True)
+                    print(e, file=sys.stderr)
+                    failures.append(key)
+                    continue
+
+                slowdown = mean(samples, "elapsed") / mean(reference, "elapsed") - 1
+                # Memory mode does not sample on a timer.
+                ticks = mean(samples, "elapsed") * 1e6 / args.interval
+                cpu_per_tick = (
+                    (mean(samples, "cpu") - mean(reference, "cpu")) * 1e6 / ticks
+                    if mode != "memory"
+                    else None
+                )
+
+                results[key] = {
+                    "workload": workload,
+                    "parameters": parameters,
+                    "mode": mode,
+                    "backend": backend,
+                    "interval": args.interval,
+                    "reference": reference,
+                    "samples": samples,
+                    "slowdown": slowdown,
+                    "slowdown_stdev": stdev(samples, "elapsed")
+                    / mean(reference, "elapsed"),
+                    "cpu_per_tick": cpu_per_tick,
+                }
+
+                line = (
+                    f"{key:<56} {slowdown:>+13.1%} "
+                    + (
+                        f"{cpu_per_tick:>14.1f}"
+                        if cpu_per_tick is not None
+                        else f"{'-':>14}"
+                    )
+                )
+
+                if key in baseline:
+                    # Compare the slowdowns, which are relative to the reference
+                    # runs of the same session, and so are more stable across
+                    # machines than the durations.
+                    delta = slowdown - baseline[key]["slowdown"]
+                    line += f" {delta:>+12.1%}"
+                    if delta > args.threshold:
+                        regressions.append(key)
+
+                print(line, flush=True)
+
+    if args.output is not None:
+        args.output.write_text(json.dumps(results, indent=2))
+
+    if failures:
+        print(f"\n{len(failures)} failure(s):")
+        for key in failures:
+            print(f"  {key}")
+
+    if regressions:
+        print(f"\n{len(regressions)} regression(s) above {args.threshold:.0%}:")
+        for key in regressions:
+            print(f"  {key}")
+
+    if failures or regressions:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
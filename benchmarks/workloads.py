@@ -0,0 +1,162 @@
+# This file is part of "echion" which is released under MIT.
+#
+# Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+# Parametric versions of the test targets, for the benchmarks. Each workload
+# does a fixed amount of work, so that its duration measures the throughput of
+# the target, and prints the time and the CPU time of the whole process,
+# sampler included, that it took, excluding the interpreter startup.
+#
+#   python -m benchmarks.workloads cpu --threads 4 --depth 32
+
+import argparse
+import json
+import threading
+import typing as t
+from dataclasses import dataclass
+from time import perf_counter
+from time import process_time
+
+
+def nested(depth: int, f: t.Callable[[], None]) -> None:
+    if depth <= 1:
+        return f()
+    return nested(depth - 1, f)
+
+
+# ----------------------------------------------------------------------------
+# Like tests/target_cpu.py, with the busy loop at the bottom of a deeper stack.
+
+
+def keep_cpu_busy(iterations: int) -> None:
+    a = []
+    for i in range(iterations):
+        a.append(i)
+        if len(a) >= 1000:
+            a.clear()
+
+
+def cpu(args: argparse.Namespace) -> None:
+    iterations = int(10_000_000 * args.scale)
+
+    threads = [
+        threading.Thread(
+            target=nested,
+            args=(args.depth, lambda: keep_cpu_busy(iterations // args.threads)),
+        )
+        for _ in range(args.threads - 1)
+    ]
+    for thread in threads:
+        thread.start()
+
+    nested(args.depth, lambda: keep_cpu_busy(iterations // args.threads))
+
+    for thread in threads:
+        thread.join()
+
+
+# ----------------------------------------------------------------------------
+# Like tests/target_async_tasks.py, with many chains of tasks that yield to the
+# event loop often.
+
+
+def async_tasks(args: argparse.Namespace) -> None:
+    import asyncio
+
+    iterations = int(100_000 * args.scale)
+
+    async def work() -> None:
+        for i in range(iterations // args.tasks):
+            sum(range(50))
+            await asyncio.sleep(0)
+
+    async def chain(depth: int) -> None:
+        if depth <= 1:
+            return await work()
+        await asyncio.create_task(chain(depth - 1))
+
+    async def main() -> None:
+        await asyncio.gather(*(chain(args.depth) for _ in range(args.tasks)))
+
+    asyncio.run(main())
+
+
+# ----------------------------------------------------------------------------
+# Like tests/target_gevent.py, with many greenlets that yield to the hub often.
+
+
+def gevent_(args: argparse.Namespace) -> None:
+    import gevent
+
+    iterations = int(150_000 * args.scale)
+
+    def work() -> None:
+        for i in range(iterations // args.tasks):
+            sum(range(50))
+            gevent.sleep(0)
+
+    gevent.joinall([gevent.spawn(nested, args.depth, work) for _ in range(args.tasks)])
+
+
+# ----------------------------------------------------------------------------
+# Like tests/target_mem.py, with the allocations at the bottom of a deeper
+# stack.
+
+
+@dataclass
+class Foo:
+    n: int
+
+
+def leak(iterations: int) -> None:
+    a = []
+    for i in range(iterations):
+        a.append(Foo(i))
+        if len(a) >= 1000:
+            a.clear()
+
+
+def mem(args: argparse.Namespace) -> None:
+    iterations = int(1_500_000 * args.scale)
+
+    threads = [
+        threading.Thread(
+            target=nested, args=(args.depth, lambda: leak(iterations // args.threads))
+        )
+        for _ in range(args.threads - 1)
+    ]
+    for thread in threads:
+        thread.start()
+
+    nested(args.depth, lambda: leak(iterations // args.threads))
+
+    for thread in threads:
+        thread.join()
+
+
+WORKLOADS = {
+    "cpu": cpu,
+    "async_tasks": async_tasks,
+    "gevent": gevent_,
+    "mem": mem,
+}
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Benchmark workloads")
+    parser.add_argument("workload", choices=list(WORKLOADS))
+    parser.add_argument("--threads", type=int, default=1)
+    parser.add_argument("--depth", type=int, default=8)
+    parser.add_argument("--tasks", type=int, default=1)
+    parser.add_argument("--scale", type=float, default=1.0)
+    args = parser.parse_args()
+
+    start, start_cpu = perf_counter(), process_time()
+    WORKLOADS[args.workload](args)
+    elapsed, cpu = perf_counter() - start, process_time() - start_cpu
+
+    print(json.dumps({"elapsed": elapsed, "cpu": cpu}))
+
+
+if __name__ == "__main__":
+    main()
@@ -125,6 +125,36 @@ def main() -> None:
         help="exposure time, in seconds",
         type=int,
     )
+    parser.add_argument(
+        "-g",
+        "--gc",
+        help="mark the samples taken while the garbage collector runs",
+        action="store_true",
+    )
+    parser.add_argument(
+        "--idle",
+        help="mark the wall time samples of the threads that are not running",
+        action="store_true",
+    )
+    parser.add_argument(
+        "--gil",
+        help="tag the stacks of the threads that hold, or wait for, the GIL, or sample the GIL "
+        "holder only, weighted by the number of threads that wait for it (default: none)",
+        choices=["none", "tag", "wait"],
+        default="none",
+    )
+    parser.add_argument(
+        "-b",
+        "--blocking",
+        help="tag the wall time samples of the threads that are blocked in a system call",
+        action="store_true",
+    )
+    parser.add_argument(
+        "-I",
+        "--interpreters",
+        help="comma-separated IDs of the interpreters to sample (default: all)",
+        type=str,
+    )
     parser.add_argument(
         "-m",
         "--memory",
@@ -140,10 +170,35 @@ def main() -> None:
     parser.add_argument(
         "-o",
         "--output",
-        help="output location (can use %%(pid) to insert the process ID)",
+        help="output location (can use %%(pid) to insert the process ID), or unix://PATH to "
+        "stream to a collector listening on a Unix domain socket",
         type=str,
         default="%%(pid).echion",
     )
+    parser.add_argument(
+        "--output-format",
+        help="format of the output file (default: mojo)",
+        choices=["mojo", "pprof", "collapsed"],
+        default="mojo",
+    )
+    parser.add_argument(
+        "--output-compression",
+        help="compression of the MOJO output, in independently readable frames (default: none)",
+        choices=["none", "gzip"],
+        default="none",
+    )
+    parser.add_argument(
+        "--rotate-interval",
+        help="start a new, numbered output file every given number of seconds (default: never)",
+        type=int,
+        default=0,
+    )
+    parser.add_argument(
+        "--rotate-size",
+        help="start a new, numbered output file after the given size, in MB (default: never)",
+        type=int,
+        default=0,
+    )
     parser.add_argument(
         "-p",
         "--pid",
@@ -168,6 +223,30 @@ def main() -> None:
         help="maximum number of file descriptors to use to track thread running statuses, only for Linux",
         type=int,
     )
+    parser.add_argument(
+        "--workers",
+        help="number of sampler workers that share the threads to sample (default: 1)",
+        type=int,
+        default=1,
+    )
+    parser.add_argument(
+        "--memory-budget",
+        help="memory budget for echion's own data structures, in MB (default: no limit)",
+        type=int,
+        default=0,
+    )
+    parser.add_argument(
+        "--trace",
+        help="record the phases of the recent sampler ticks and dump them to the given "
+        "location as Chrome trace-event JSON on exit (can use %%(pid) to insert the process ID)",
+        type=str,
+    )
+    parser.add_argument(
+        "--trace-size",
+        help="number of the most recent spans to keep in the trace (default: 65536)",
+        type=int,
+        default=65536,
+    )
     parser.add_argument(
         "-v",
         "--verbose",
@@ -189,16 +268,35 @@ def main() -> None:
         sys.exit(1)
 
     # TODO: Validate arguments
+    if args.gil == "wait" and (args.cpu or args.memory):
+        parser.error("the GIL wait mode samples wall time only")
+    if args.idle and (args.cpu or args.memory):
+        parser.error("idle threads are only reported in wall time mode")
+    if args.blocking and (args.cpu or args.memory):
+        parser.error("blocking calls are only reported in wall time mode")
 
     env = os.environ.copy()
 
     env["ECHION_INTERVAL"] = str(args.interval)
     env["ECHION_CPU"] = str(int(bool(args.cpu)))
     env["ECHION_MEMORY"] = str(int(bool(args.memory)))
+    env["ECHION_GC"] = str(int(bool(args.gc)))
+    env["ECHION_IDLE"] = str(int(bool(args.idle)))
+    env["ECHION_GIL"] = args.gil
+    env["ECHION_BLOCKING"] = str(int(bool(args.blocking)))
     env["ECHION_NATIVE"] = str(int(bool(args.native)))
     env["ECHION_OUTPUT"] = args.output.replace("%%(pid)", str(os.getpid()))
+    env["ECHION_OUTPUT_FORMAT"] = args.output_format
+    env["ECHION_OUTPUT_COMPRESSION"] = args.output_compression
+    env["ECHION_ROTATE_INTERVAL"] = str(args.rotate_interval)
+    env["ECHION_ROTATE_SIZE"] = str(args.rotate_size)
     env["ECHION_STEALTH"] = str(int(bool(args.stealth)))
     env["ECHION_WHERE"] = str(args.where or "")
+    env["ECHION_INTERPRETERS"] = args.interpreters or ""
+    env["ECHION_WORKERS"] = str(args.workers)
+    env["ECHION_MEMORY_BUDGET"] = str(args.memory_budget)
+    env["ECHION_TRACE"] = (args.trace or "").replace("%%(pid)", str(os.getpid()))
+    env["ECHION_TRACE_SIZE"] = str(args.trace_size if args.trace else 0)
 
     if args.pid or args.where:
         try:
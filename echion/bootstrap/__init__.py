@@ -32,8 +32,26 @@ def start():
     ec.set_interval(int(os.getenv("ECHION_INTERVAL", 1000)))
     ec.set_cpu(bool(int(os.getenv("ECHION_CPU", 0))))
     ec.set_memory(bool(int(os.getenv("ECHION_MEMORY", 0))))
+    ec.set_gc(bool(int(os.getenv("ECHION_GC", 0))))
+    ec.set_idle(bool(int(os.getenv("ECHION_IDLE", 0))))
+    ec.set_gil_mode(os.getenv("ECHION_GIL") or "none")
+    ec.set_blocking(bool(int(os.getenv("ECHION_BLOCKING", 0))))
     ec.set_native(bool(int(os.getenv("ECHION_NATIVE", 0))))
     ec.set_where(bool(int(os.getenv("ECHION_WHERE", 0) or 0)))
+    ec.set_sampler_workers(int(os.getenv("ECHION_WORKERS", 1)))
+    ec.set_memory_budget(int(os.getenv("ECHION_MEMORY_BUDGET", 0)) << 20)
+    ec.set_output_format(os.getenv("ECHION_OUTPUT_FORMAT") or "mojo")
+    ec.set_output_compression(os.getenv("ECHION_OUTPUT_COMPRESSION") or "none")
+    ec.set_output_rotation(
+        int(os.getenv("ECHION_ROTATE_INTERVAL", 0)) * 1000000,
+        int(os.getenv("ECHION_ROTATE_SIZE", 0)) << 20,
+    )
+    ec.set_trace(
+        os.getenv("ECHION_TRACE") or "", int(os.getenv("ECHION_TRACE_SIZE", 0) or 0)
+    )
+    ec.set_interpreters(
+        int(_) for _ in os.getenv("ECHION_INTERPRETERS", "").split(",") if _.strip()
+    )
 
     # Monkey-patch the standard library on import
     try:
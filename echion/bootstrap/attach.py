@@ -9,9 +9,24 @@ import typing as t
 def attach(config: t.Dict[str, str], pipe_name: t.Optional[str] = None) -> None:
     os.environ["ECHION_CPU"] = str(int(config["cpu"]))
     os.environ["ECHION_NATIVE"] = str(int(config["native"]))
+    os.environ["ECHION_GC"] = str(int(bool(config.get("gc"))))
+    os.environ["ECHION_IDLE"] = str(int(bool(config.get("idle"))))
+    os.environ["ECHION_GIL"] = config.get("gil") or "none"
+    os.environ["ECHION_BLOCKING"] = str(int(bool(config.get("blocking"))))
     os.environ["ECHION_OUTPUT"] = config["output"]
+    os.environ["ECHION_OUTPUT_FORMAT"] = config.get("output_format") or "mojo"
+    os.environ["ECHION_OUTPUT_COMPRESSION"] = config.get("output_compression") or "none"
+    os.environ["ECHION_ROTATE_INTERVAL"] = str(config.get("rotate_interval") or 0)
+    os.environ["ECHION_ROTATE_SIZE"] = str(config.get("rotate_size") or 0)
     os.environ["ECHION_STEALTH"] = str(int(config["stealth"]))
     os.environ["ECHION_WHERE"] = str(int(bool(config["where"])))
+    os.environ["ECHION_WORKERS"] = str(config.get("workers") or 1)
+    os.environ["ECHION_MEMORY_BUDGET"] = str(config.get("memory_budget") or 0)
+    os.environ["ECHION_INTERPRETERS"] = config.get("interpreters") or ""
+    os.environ["ECHION_TRACE"] = config.get("trace") or ""
+    os.environ["ECHION_TRACE_SIZE"] = str(
+        (config.get("trace_size") or 0) if config.get("trace") else 0
+    )
 
     from echion.bootstrap import start
 
@@ -2,7 +2,22 @@
 #
 # Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
 
-from echion.bootstrap import start
 
+def is_main_interpreter() -> bool:
+    try:
+        from _interpreters import get_current, get_main
+    except ImportError:
+        try:
+            from _xxsubinterpreters import get_current, get_main
+        except ImportError:
+            return True
 
-start()
+    return get_current() == get_main()
+
+
+# The sampler that runs in the main interpreter samples all the
+# sub-interpreters too, so we only need to start it once.
+if is_main_interpreter():
+    from echion.bootstrap import start
+
+    start()
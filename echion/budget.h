@@ -0,0 +1,158 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <string>
+
+#include <echion/config.h>
+#include <echion/interp.h>
+#include <echion/memory.h>
+#include <echion/render.h>
+#include <echion/stacks.h>
+#include <echion/strings.h>
+
+// ----------------------------------------------------------------------------
+// Keeps the memory used by echion's own data structures within the configured
+// budget. The sampler estimates the footprint of each structure periodically
+// and, if their total is over budget, evicts data from them, starting with the
+// evictions that lose no information. Every eviction is reported with a
+// metadata event, so that consumers can tell when the profile was affected,
+// followed by the footprint that the evictions left.
+//
+// The frame caches are bounded by CACHE_MAX_ENTRIES, and the task links are
+// pruned on every sample, so they are accounted for but never evicted. When
+// they alone are over budget, evictions cannot help, so we make none.
+class MemoryBudget
+{
+public:
+    enum Item
+    {
+        STRINGS,
+        FRAMES,
+        TASKS,
+        STACKS,
+        STACK_STATS,
+        ALLOCATIONS,
+        DEFINITIONS,
+        ITEM_COUNT,
+    };
+
+    // ------------------------------------------------------------------------
+    void update()
+    {
+        footprints[STRINGS] = string_table.footprint();
+        footprints[FRAMES] =
+            interpreter_states.sum([](auto& state) { return state.frame_cache_footprint(); });
+        footprints[TASKS] =
+            interpreter_states.sum([](auto& state) { return state.task_footprint(); });
+        footprints[STACKS] = stack_table.footprint();
+        footprints[STACK_STATS] = stack_stats.footprint();
+        footprints[ALLOCATIONS] = memory_table.footprint();
+        footprints[DEFINITIONS] = Renderer::get().footprint();
+    }
+
+    // ------------------------------------------------------------------------
+    size_t total() const
+    {
+        size_t size = 0;
+        for (auto footprint : footprints)
+            size += footprint;
+
+        return size;
+    }
+
+    // ------------------------------------------------------------------------
+    void enforce()
+    {
+        if (memory_budget == 0)
+            return;
+
+        rounds++;
+
+        update();
+        evicted = false;
+
+        if (!over() || footprints[FRAMES] + footprints[TASKS] >= memory_budget)
+            return;
+
+        // Stacks with no live allocations are of no use once we have emitted
+        // their pending stats.
+        if (memory && over())
+            evict("stacks", [] {
+                stack_stats.flush();
+                stack_stats.prune();
+            });
+
+        // Strings are emitted again the next time that we see them, and so are
+        // the frames that refer to them. The renderer drops the definitions
+        // that it keeps for new streams and chunks along with them.
+        bool strings_evicted = false;
+        if (over() && rounds - strings_round >= strings_backoff)
+        {
+            strings_round = rounds;
+            strings_evicted = true;
+
+            evict("strings", [] { string_table.clear(); });
+        }
+
+        // Finally, we stop tracking the allocations that are still live, so
+        // their deallocations will not be accounted for.
+        if (memory && over())
+            evict("allocations", [] {
+                memory_table.clear();
+                stack_stats.forget();
+                stack_stats.prune();
+            });
+
+        // Evicting the strings grows the output, so we back off for as long as
+        // that does not get us back within budget.
+        if (strings_evicted)
+            strings_backoff = over() ? std::min(2 * strings_backoff, MAX_STRINGS_BACKOFF) : 1;
+
+        // Report where the evictions left us, so that consumers can tell
+        // whether we managed to get back within budget.
+        if (evicted)
+            Renderer::get().metadata("footprint", std::to_string(total()));
+    }
+
+private:
+    std::array<size_t, ITEM_COUNT> footprints = {};
+    bool evicted = false;
+
+    // The number of calls to enforce, the call that last evicted the strings,
+    // and the number of calls to wait before we evict them again.
+    static constexpr unsigned int MAX_STRINGS_BACKOFF = 64;
+    unsigned int rounds = 0;
+    unsigned int strings_round = 0;
+    unsigned int strings_backoff = 1;
+
+    // ------------------------------------------------------------------------
+    bool over() const
+    {
+        return total() > memory_budget;
+    }
+
+    // ------------------------------------------------------------------------
+    void evict(const char* what, std::function<void()> eviction)
+    {
+        auto before = total();
+
+        eviction();
+        update();
+
+        auto after = total();
+        evicted = true;
+        Renderer::get().metadata(
+            "eviction", std::string(what) + ":" + std::to_string(before > after ? before - after : 0));
+    }
+};
+
+// We make this a reference to a heap-allocated object so that we can avoid
+// the destruction on exit. We are in charge of cleaning up the object. Note
+// that the object will leak, but this is not a problem.
+inline auto& budget = *(new MemoryBudget());
@@ -4,14 +4,25 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <list>
 #include <memory>
 #include <unordered_map>
 
 #include <echion/errors.h>
+#include <echion/footprint.h>
 
 #define CACHE_MAX_ENTRIES 2048
+#define CACHE_VALIDATION_INTERVAL 100000  // 100 ms
+
+// Cached data is often keyed by the address of an object in the target, which
+// can be reused once the object is freed. Cache entries remember the epoch in
+// which they were last checked against the target, and are checked again on
+// their first hit in a new epoch. The sampler starts a new epoch every
+// CACHE_VALIDATION_INTERVAL microseconds.
+inline std::atomic<uint32_t> cache_epoch = 1;
 
 template <typename K, typename V>
 class LRUCache
@@ -23,6 +34,11 @@ public:
 
     void store(const K& k, std::unique_ptr<V> v);
 
+    size_t footprint() const
+    {
+        return list_footprint(items) + hash_footprint(index) + items.size() * sizeof(V);
+    }
+
 private:
     size_t capacity;
     std::list<std::pair<K, std::unique_ptr<V>>> items;
@@ -7,7 +7,10 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <unordered_set>
 
 // Sampling interval
 inline unsigned int interval = 1000;
@@ -22,6 +25,27 @@ inline bool ignore_non_running_threads = true;
 // Memory events
 inline int memory = 0;
 
+// Mark the samples that are taken while the cyclic garbage collector runs
+inline int gc = 0;
+
+// Mark the samples of the threads that are not running
+inline int idle = 0;
+
+// Sampling of the GIL: either tag the stacks of the threads that hold, or wait
+// for, the GIL, or only sample the GIL holder, weighted by the number of the
+// threads that wait for it
+enum class GilMode
+{
+    NONE,
+    TAG,
+    WAIT,
+};
+inline GilMode gil_mode = GilMode::NONE;
+
+// Tag the wall time samples of the threads that are blocked in a system call
+// with the name of the call
+inline int blocking = 0;
+
 // Native stack sampling
 inline int native = 0;
 
@@ -34,6 +58,33 @@ inline unsigned int max_frames = 2048;
 // Pipe name (where mode IPC)
 inline std::string pipe_name;
 
+// IDs of the interpreters to sample. All interpreters are sampled if empty.
+inline std::unordered_set<int64_t> interpreter_ids;
+
+// Number of sampler workers that share the threads to sample in each tick
+inline unsigned int sampler_workers = 1;
+
+// Memory budget for echion's own data structures, in bytes (0 for no limit)
+inline size_t memory_budget = 0;
+
+// Compression of the MOJO output
+enum class Compression
+{
+    NONE,
+    GZIP,
+};
+inline Compression output_compression = Compression::NONE;
+
+// Rotation of the output file to a new chunk, after an interval in microseconds
+// and after a size in bytes (0 for no rotation)
+inline unsigned long output_rotation_interval = 0;
+inline size_t output_rotation_size = 0;
+
+// Trace of the phases of the sampler ticks, as the number of most recent spans
+// to keep (0 for no tracing), and the file to dump them to on stop
+inline size_t trace_size = 0;
+inline std::string trace_path;
+
 // ----------------------------------------------------------------------------
 static PyObject* set_interval(PyObject* Py_UNUSED(m), PyObject* args)
 {
@@ -82,6 +133,64 @@ static PyObject* set_memory(PyObject* Py_UNUSED(m), PyObject* args)
     Py_RETURN_NONE;
 }
 
+// ----------------------------------------------------------------------------
+static PyObject* set_gc(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    int new_gc;
+    if (!PyArg_ParseTuple(args, "p", &new_gc))
+        return NULL;
+
+    gc = new_gc;
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_idle(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    int new_idle;
+    if (!PyArg_ParseTuple(args, "p", &new_idle))
+        return NULL;
+
+    idle = new_idle;
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_gil_mode(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    const char* mode;
+    if (!PyArg_ParseTuple(args, "s", &mode))
+        return NULL;
+
+    if (std::strcmp(mode, "none") == 0)
+        gil_mode = GilMode::NONE;
+    else if (std::strcmp(mode, "tag") == 0)
+        gil_mode = GilMode::TAG;
+    else if (std::strcmp(mode, "wait") == 0)
+        gil_mode = GilMode::WAIT;
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Unknown GIL mode: %s", mode);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_blocking(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    int new_blocking;
+    if (!PyArg_ParseTuple(args, "p", &new_blocking))
+        return NULL;
+
+    blocking = new_blocking;
+
+    Py_RETURN_NONE;
+}
+
 // ----------------------------------------------------------------------------
 static PyObject* set_native(PyObject* Py_UNUSED(m), PyObject* args)
 {
@@ -135,3 +244,115 @@ static PyObject* set_max_frames(PyObject* Py_UNUSED(m), PyObject* args)
 
     Py_RETURN_NONE;
 }
+
+// ----------------------------------------------------------------------------
+static PyObject* set_interpreters(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    PyObject* ids;
+    if (!PyArg_ParseTuple(args, "O", &ids))
+        return NULL;
+
+    PyObject* iter = PyObject_GetIter(ids);
+    if (iter == NULL)
+        return NULL;
+
+    std::unordered_set<int64_t> new_interpreter_ids;
+    for (PyObject* item = PyIter_Next(iter); item != NULL; item = PyIter_Next(iter))
+    {
+        auto id = PyLong_AsLongLong(item);
+        Py_DECREF(item);
+        if (id == -1 && PyErr_Occurred())
+        {
+            Py_DECREF(iter);
+            return NULL;
+        }
+
+        new_interpreter_ids.insert(id);
+    }
+    Py_DECREF(iter);
+
+    if (PyErr_Occurred())
+        return NULL;
+
+    interpreter_ids = std::move(new_interpreter_ids);
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_sampler_workers(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    unsigned int new_sampler_workers;
+    if (!PyArg_ParseTuple(args, "I", &new_sampler_workers))
+        return NULL;
+
+    if (new_sampler_workers == 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "The number of sampler workers must be positive");
+        return NULL;
+    }
+
+    sampler_workers = new_sampler_workers;
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_memory_budget(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    unsigned long long new_memory_budget;
+    if (!PyArg_ParseTuple(args, "K", &new_memory_budget))
+        return NULL;
+
+    memory_budget = new_memory_budget;
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_output_compression(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    const char* compression;
+    if (!PyArg_ParseTuple(args, "s", &compression))
+        return NULL;
+
+    if (std::strcmp(compression, "none") == 0)
+        output_compression = Compression::NONE;
+    else if (std::strcmp(compression, "gzip") == 0)
+        output_compression = Compression::GZIP;
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Unknown output compression: %s", compression);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_output_rotation(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    unsigned long new_interval;
+    unsigned long long new_size;
+    if (!PyArg_ParseTuple(args, "kK", &new_interval, &new_size))
+        return NULL;
+
+    output_rotation_interval = new_interval;
+    output_rotation_size = new_size;
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_trace(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    const char* new_path;
+    unsigned long long new_size;
+    if (!PyArg_ParseTuple(args, "sK", &new_path, &new_size))
+        return NULL;
+
+    trace_path = std::string(new_path);
+    trace_size = new_size;
+
+    Py_RETURN_NONE;
+}
@@ -17,6 +17,7 @@ def untrack_thread(thread_id: int) -> None: ...
 # Asyncio support
 def track_asyncio_loop(thread_id: int, loop: BaseEventLoop) -> None: ...
 def init() -> None: ...
+def dump_trace(path: str) -> None: ...
 def init_asyncio(
     threads: list, scheduled_tasks: set, eager_tasks: set | None
 ) -> None: ...
@@ -29,12 +30,28 @@ def track_greenlet(
 def untrack_greenlet(greenlet_id: int) -> None: ...
 def link_greenlets(greenlet_id: int, parent_id: int) -> None: ...
 def update_greenlet_frame(greenlet_id: int, frame: FrameType | bool | None) -> None: ...
+def greenlet_tracer(event: str, args: t.Any) -> None: ...
+def init_greenlets(
+    track_callback: t.Callable[[t.Any], None] | None,
+    original_tracer: t.Callable[[str, t.Any], None] | None,
+) -> None: ...
 
 # Configuration interface
 def set_interval(interval: int) -> None: ...
 def set_cpu(cpu: bool) -> None: ...
 def set_memory(memory: bool) -> None: ...
+def set_gc(gc: bool) -> None: ...
+def set_idle(idle: bool) -> None: ...
+def set_gil_mode(mode: str) -> None: ...
+def set_blocking(blocking: bool) -> None: ...
 def set_native(native: bool) -> None: ...
 def set_where(where: bool) -> None: ...
 def set_pipe_name(name: str) -> None: ...
 def set_max_frames(max_frames: int) -> None: ...
+def set_interpreters(interpreter_ids: t.Iterable[int]) -> None: ...
+def set_sampler_workers(workers: int) -> None: ...
+def set_memory_budget(budget: int) -> None: ...
+def set_output_format(format: str) -> None: ...
+def set_output_compression(compression: str) -> None: ...
+def set_output_rotation(interval: int, size: int) -> None: ...
+def set_trace(path: str, size: int) -> None: ...
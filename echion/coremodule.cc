@@ -10,6 +10,7 @@
 #endif
 
 #include <condition_variable>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -25,6 +26,7 @@
 #include <pthread.h>
 #endif
 
+#include <echion/budget.h>
 #include <echion/config.h>
 #include <echion/greenlets.h>
 #include <echion/interp.h>
@@ -34,7 +36,10 @@
 #include <echion/stacks.h>
 #include <echion/state.h>
 #include <echion/threads.h>
+#include <echion/tick_reads.h>
 #include <echion/timing.h>
+#include <echion/trace.h>
+#include <echion/workers.h>
 
 // ----------------------------------------------------------------------------
 static void do_where(std::ostream& stream)
@@ -104,10 +109,20 @@ static void teardown_where()
     }
 }
 
+// ----------------------------------------------------------------------------
+// Native stacks are unwound by a signal handler, one thread at a time, so there
+// is nothing to gain from more than one sampler worker in that case.
+static inline size_t n_sampler_workers()
+{
+    return (native || memory || where) ? 1 : sampler_workers;
+}
+
 // ----------------------------------------------------------------------------
 static inline void _start()
 {
-    init_frame_cache(CACHE_MAX_ENTRIES * (1 + native));
+    interpreter_states.init_frame_caches(CACHE_MAX_ENTRIES * (1 + native), n_sampler_workers());
+
+    tracer.reset(where ? 0 : trace_size);
 
     auto open_success = Renderer::get().open();
     if (!open_success)
@@ -152,6 +167,8 @@ static inline void _start()
     }
     Renderer::get().metadata("interval", std::to_string(interval));
     Renderer::get().metadata("sampler", "echion");
+    if (gil_mode != GilMode::NONE)
+        Renderer::get().metadata("gil", gil_mode == GilMode::TAG ? "tag" : "wait");
 
     // DEV: Workaround for the austin-python library: we send an empty sample
     // to set the PID. We also map the key value 0 to the empty string, to
@@ -160,6 +177,11 @@ static inline void _start()
     Renderer::get().string(0, "");
     Renderer::get().string(1, "<invalid>");
     Renderer::get().string(2, "<unknown>");
+    if (gil_mode == GilMode::TAG)
+    {
+        Renderer::get().string(StringTable::GIL_HELD, ":GIL held:");
+        Renderer::get().string(StringTable::GIL_WAIT, ":GIL wait:");
+    }
     Renderer::get().render_stack_end(MetricType::Time, 0);
 
     if (memory)
@@ -172,14 +194,10 @@ static inline void _stop()
     if (memory)
         teardown_memory();
 
-    // Clean up the thread info map. When not running async, we need to guard
-    // the map lock because we are not in control of the sampling thread.
-    {
-        const std::lock_guard<std::mutex> guard(thread_info_map_lock);
-
-        thread_info_map.clear();
-        string_table.clear();
-    }
+    // Clean up the thread registry. When not running async, the application
+    // threads might still be tracking threads, which the registry handles.
+    thread_registry.clear();
+    string_table.clear();
 
     teardown_where();
 
@@ -191,7 +209,12 @@ static inline void _stop()
 
     Renderer::get().close();
 
-    reset_frame_cache();
+    interpreter_states.reset_frame_caches();
+
+    // Keep the spans around, so that they can still be dumped on demand.
+    tracer.enabled = false;
+    if (!trace_path.empty() && !tracer.dump(trace_path))
+        std::cerr << "Failed to write the trace to " << trace_path << std::endl;
 }
 
 // ----------------------------------------------------------------------------
@@ -203,20 +226,63 @@ static inline void _sampler()
 
     last_time = gettime();
 
+    // With more than one worker, we first collect all the threads to sample
+    // and then let the workers share them.
+    std::unique_ptr<SamplerWorkers> workers = nullptr;
+    std::vector<SampleJob> jobs;
+    if (n_sampler_workers() > 1)
+        workers = std::make_unique<SamplerWorkers>(n_sampler_workers());
+
+    microsecond_t last_validation = last_time;
+
     while (running)
     {
         microsecond_t now = gettime();
         microsecond_t end_time = now + interval;
 
+        TraceScope trace(Tracer::TICK);
+
+        // Free the thread registry snapshots that the last tick kept alive.
+        thread_registry.reclaim();
+
+        // Have the caches check their entries against the target again, and
+        // keep our own memory usage within budget.
+        if (now - last_validation >= CACHE_VALIDATION_INTERVAL)
+        {
+            cache_epoch++;
+            last_validation = now;
+
+            budget.enforce();
+        }
+
+        if (!memory && (gil_mode != GilMode::NONE || (blocking && !cpu)))
+            update_kernel_states();
+
         if (memory)
         {
             if (rss_tracker.check())
                 stack_stats.flush();
         }
+        else if (workers != nullptr)
+        {
+            microsecond_t wall_time = now - last_time;
+
+            jobs.clear();
+            for_each_interp([&](InterpreterInfo& interp) -> void {
+                auto state = interpreter_states.get(interp.id);
+                for_each_thread(interp, [&](PyThreadState* tstate, ThreadInfo& thread) {
+                    jobs.emplace_back(state, interp.id, thread.shared_from_this(), tstate);
+                });
+            });
+
+            workers->sample(jobs, wall_time);
+        }
         else
         {
             microsecond_t wall_time = now - last_time;
 
+            TickReadScope reads;
+
             for_each_interp([=](InterpreterInfo& interp) -> void {
                 for_each_thread(interp, [=](PyThreadState* tstate, ThreadInfo& thread) {
                     auto sample_success = thread.sample(interp.id, tstate, wall_time);
@@ -228,6 +294,8 @@ static inline void _sampler()
             });
         }
 
+        trace.end();
+
         std::this_thread::sleep_for(std::chrono::microseconds(end_time - now));
         last_time = now;
     }
@@ -272,9 +340,23 @@ static PyObject* start(PyObject* Py_UNUSED(m), PyObject* Py_UNUSED(args))
         // of starting the sampler.
         running = 1;
 
+        {
+            std::lock_guard<std::mutex> guard(sampler_lock);
+
+            sampler_pid = getpid();
+            sampler_done = false;
+        }
+
         // Run the sampler without the GIL
         Py_BEGIN_ALLOW_THREADS;
         sampler();
+
+        {
+            std::lock_guard<std::mutex> guard(sampler_lock);
+
+            sampler_done = true;
+        }
+        sampler_cv.notify_all();
         Py_END_ALLOW_THREADS;
     }
 
@@ -293,6 +375,36 @@ static PyObject* stop(PyObject* Py_UNUSED(m), PyObject* Py_UNUSED(args))
         sampler_thread = nullptr;
     }
 
+    // Wait for a sampler that runs on a thread of the caller to be torn down.
+    // After a fork, the sampler is not running in the child.
+    Py_BEGIN_ALLOW_THREADS;
+    {
+        std::unique_lock<std::mutex> guard(sampler_lock);
+        sampler_cv.wait(guard, []() { return sampler_done || sampler_pid != getpid(); });
+    }
+    Py_END_ALLOW_THREADS;
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* dump_trace(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    const char* path;
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+
+    bool dump_success;
+    Py_BEGIN_ALLOW_THREADS;
+    dump_success = tracer.dump(path);
+    Py_END_ALLOW_THREADS;
+
+    if (!dump_success)
+    {
+        PyErr_Format(PyExc_RuntimeError, "Failed to write the trace to %s", path);
+        return NULL;
+    }
+
     Py_RETURN_NONE;
 }
 
@@ -306,28 +418,16 @@ static PyObject* track_thread(PyObject* Py_UNUSED(m), PyObject* args)
     if (!PyArg_ParseTuple(args, "lsi", &thread_id, &thread_name, &native_id))
         return NULL;
 
+    auto maybe_thread_info = ThreadInfo::create(thread_id, native_id, thread_name);
+    if (!maybe_thread_info)
     {
-        const std::lock_guard<std::mutex> guard(thread_info_map_lock);
-
-        auto maybe_thread_info = ThreadInfo::create(thread_id, native_id, thread_name);
-        if (!maybe_thread_info)
-        {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to track thread");
-            return nullptr;
-        }
-
-        auto entry = thread_info_map.find(thread_id);
-        if (entry != thread_info_map.end())
-        {
-            // Thread is already tracked so we update its info
-            entry->second = std::move(*maybe_thread_info);
-        }
-        else
-        {
-            thread_info_map.emplace(thread_id, std::move(*maybe_thread_info));
-        }
+        PyErr_SetString(PyExc_RuntimeError, "Failed to track thread");
+        return nullptr;
     }
 
+    // If the thread is already tracked, this updates its info.
+    thread_registry.track(thread_id, std::move(*maybe_thread_info));
+
     Py_RETURN_NONE;
 }
 
@@ -338,11 +438,7 @@ static PyObject* untrack_thread(PyObject* Py_UNUSED(m), PyObject* args)
     if (!PyArg_ParseTuple(args, "l", &thread_id))
         return NULL;
 
-    {
-        const std::lock_guard<std::mutex> guard(thread_info_map_lock);
-
-        thread_info_map.erase(thread_id);
-    }
+    thread_registry.untrack(thread_id);
 
     Py_RETURN_NONE;
 }
@@ -365,13 +461,10 @@ static PyObject* track_asyncio_loop(PyObject* Py_UNUSED(m), PyObject* args)
         return NULL;
 
     {
-        std::lock_guard<std::mutex> guard(thread_info_map_lock);
+        auto threads = thread_registry.read();
 
-        if (thread_info_map.find(thread_id) != thread_info_map.end())
-        {
-            thread_info_map.find(thread_id)->second->asyncio_loop =
-                (loop != Py_None) ? reinterpret_cast<uintptr_t>(loop) : 0;
-        }
+        if (auto* thread_info = threads->find(thread_id))
+            thread_info->asyncio_loop = (loop != Py_None) ? reinterpret_cast<uintptr_t>(loop) : 0;
     }
 
     Py_RETURN_NONE;
@@ -380,12 +473,17 @@ static PyObject* track_asyncio_loop(PyObject* Py_UNUSED(m), PyObject* args)
 // ----------------------------------------------------------------------------
 static PyObject* init_asyncio(PyObject* Py_UNUSED(m), PyObject* args)
 {
-    if (!PyArg_ParseTuple(args, "OOO", &asyncio_current_tasks, &asyncio_scheduled_tasks,
-                          &asyncio_eager_tasks))
+    PyObject *current_tasks, *scheduled_tasks, *eager_tasks;
+
+    if (!PyArg_ParseTuple(args, "OOO", &current_tasks, &scheduled_tasks, &eager_tasks))
         return NULL;
 
-    if (asyncio_eager_tasks == Py_None)
-        asyncio_eager_tasks = NULL;
+    // The asyncio state belongs to the interpreter that initialises it.
+    auto state = interpreter_states.current();
+
+    state->asyncio_current_tasks = current_tasks;
+    state->asyncio_scheduled_tasks = scheduled_tasks;
+    state->asyncio_eager_tasks = (eager_tasks != Py_None) ? eager_tasks : NULL;
 
     Py_RETURN_NONE;
 }
@@ -411,15 +509,23 @@ static PyObject* track_greenlet(PyObject* Py_UNUSED(m), PyObject* args)
     }
     greenlet_name = *maybe_greenlet_name;
 
+    // Dropping a GreenletInfo releases its frame, which can run finalizers that
+    // call back into us. We therefore let any replaced one go only after the
+    // lock has been released.
+    std::unique_ptr<GreenletInfo> replaced;
+
     {
         const std::lock_guard<std::mutex> guard(greenlet_info_map_lock);
 
         auto entry = greenlet_info_map.find(greenlet_id);
         if (entry != greenlet_info_map.end())
+        {
             // Greenlet is already tracked so we update its info. This should
             // never happen, as a greenlet should be tracked only once, so we
             // use this as a safety net.
+            replaced = std::move(entry->second);
             entry->second = std::make_unique<GreenletInfo>(greenlet_id, frame, greenlet_name);
+        }
         else
             greenlet_info_map.emplace(
                 greenlet_id, std::make_unique<GreenletInfo>(greenlet_id, frame, greenlet_name));
@@ -439,12 +545,30 @@ static PyObject* untrack_greenlet(PyObject* Py_UNUSED(m), PyObject* args)
     if (!PyArg_ParseTuple(args, "l", &greenlet_id))
         return NULL;
 
+    // As in track_greenlet, the info must outlive the lock.
+    std::unique_ptr<GreenletInfo> untracked;
+
     {
         const std::lock_guard<std::mutex> guard(greenlet_info_map_lock);
 
-        greenlet_info_map.erase(greenlet_id);
-        greenlet_parent_map.erase(greenlet_id);
+        auto entry = greenlet_info_map.find(greenlet_id);
+        if (entry != greenlet_info_map.end())
+        {
+            untracked = std::move(entry->second);
+            greenlet_info_map.erase(entry);
+        }
+        greenlet_parent_count.erase(greenlet_id);
         greenlet_thread_map.erase(greenlet_id);
+
+        auto parent = greenlet_parent_map.find(greenlet_id);
+        if (parent != greenlet_parent_map.end())
+        {
+            auto count = greenlet_parent_count.find(parent->second);
+            if (count != greenlet_parent_count.end() && --count->second == 0)
+                greenlet_parent_count.erase(count);
+
+            greenlet_parent_map.erase(parent);
+        }
     }
     Py_RETURN_NONE;
 }
@@ -461,11 +585,22 @@ static PyObject* link_greenlets(PyObject* Py_UNUSED(m), PyObject* args)
         std::lock_guard<std::mutex> guard(greenlet_info_map_lock);
 
         greenlet_parent_map[child] = parent;
+        greenlet_parent_count[parent]++;
     }
 
     Py_RETURN_NONE;
 }
 
+// ----------------------------------------------------------------------------
+static inline void set_greenlet_frame(GreenletInfo::ID greenlet_id, PyObject* frame)
+{
+    // We hold the GIL, so the greenlet map cannot change under our feet and
+    // we don't need to take its lock. The frame slot itself is atomic.
+    auto entry = greenlet_info_map.find(greenlet_id);
+    if (entry != greenlet_info_map.end())
+        entry->second->update_frame(frame);
+}
+
 // ----------------------------------------------------------------------------
 static PyObject* update_greenlet_frame(PyObject* Py_UNUSED(m), PyObject* args)
 {
@@ -475,17 +610,113 @@ static PyObject* update_greenlet_frame(PyObject* Py_UNUSED(m), PyObject* args)
     if (!PyArg_ParseTuple(args, "lO", &greenlet_id, &frame))
         return NULL;
 
+    set_greenlet_frame(greenlet_id, frame);
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static inline Result<void> ensure_greenlet_tracked(PyObject* greenlet)
+{
+    if (greenlet_info_map.find(reinterpret_cast<GreenletInfo::ID>(greenlet)) !=
+            greenlet_info_map.end() ||
+        greenlet_track_callback == NULL)
+        return Result<void>::ok();
+
+    // This is likely the hub, or a greenlet that was not spawned via gevent.
+    // We take this chance to track it from Python.
+    PyObject* result = PyObject_CallFunctionObjArgs(greenlet_track_callback, greenlet, NULL);
+    if (result == NULL)
+        return ErrorKind::GreenletError;
+
+    Py_DECREF(result);
+
+    return Result<void>::ok();
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* greenlet_frame(PyObject* greenlet)
+{
+    static PyObject* gr_frame = PyUnicode_InternFromString("gr_frame");
+
+    return PyObject_GetAttr(greenlet, gr_frame);
+}
+
+// ----------------------------------------------------------------------------
+// This is meant to be installed with greenlet.settrace. It runs in the context
+// of the target greenlet on every switch, so we keep the common case of two
+// tracked greenlets entirely native.
+static PyObject* greenlet_tracer(PyObject* Py_UNUSED(m), PyObject* const* args, Py_ssize_t nargs)
+{
+    if (nargs != 2)
     {
-        std::lock_guard<std::mutex> guard(greenlet_info_map_lock);
+        PyErr_SetString(PyExc_TypeError, "greenlet_tracer expects 2 arguments");
+        return NULL;
+    }
 
-        auto entry = greenlet_info_map.find(greenlet_id);
-        if (entry != greenlet_info_map.end())
+    PyObject* event = args[0];
+    PyObject* event_args = args[1];
+
+    if (PyUnicode_Check(event) && PyTuple_Check(event_args) && PyTuple_GET_SIZE(event_args) == 2 &&
+        (PyUnicode_CompareWithASCIIString(event, "switch") == 0 ||
+         PyUnicode_CompareWithASCIIString(event, "throw") == 0))
+    {
+        PyObject* origin = PyTuple_GET_ITEM(event_args, 0);
+        PyObject* target = PyTuple_GET_ITEM(event_args, 1);
+
+        if (!ensure_greenlet_tracked(origin) || !ensure_greenlet_tracked(target))
+            return NULL;
+
+        // If the frame is being set to None, it means the greenlet is likely
+        // finished. We use the sentinel again to signal this.
+        PyObject* origin_frame = greenlet_frame(origin);
+        if (origin_frame == NULL)
+            return NULL;
+
+        set_greenlet_frame(reinterpret_cast<GreenletInfo::ID>(origin),
+                           origin_frame == Py_None ? FRAME_NOT_SET : origin_frame);
+        Py_DECREF(origin_frame);
+
+        // We don't want to wipe the frame of a parent greenlet because we need
+        // to unwind it. We definitely know it is still running so if we allow
+        // the tracer to set its tracked frame to None, we won't be able to
+        // unwind the full stack.
+        auto target_id = reinterpret_cast<GreenletInfo::ID>(target);
+        if (greenlet_parent_count.find(target_id) == greenlet_parent_count.end())
         {
-            // Update the frame of the greenlet
-            entry->second->frame = frame;
+            PyObject* target_frame = greenlet_frame(target);  // this *is* None
+            if (target_frame == NULL)
+                return NULL;
+
+            set_greenlet_frame(target_id, target_frame);
+            Py_DECREF(target_frame);
         }
     }
 
+    if (greenlet_original_tracer != NULL)
+        return PyObject_CallFunctionObjArgs(greenlet_original_tracer, event, event_args, NULL);
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* init_greenlets(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    PyObject* track_callback;
+    PyObject* original_tracer;
+
+    if (!PyArg_ParseTuple(args, "OO", &track_callback, &original_tracer))
+        return NULL;
+
+    Py_XDECREF(greenlet_track_callback);
+    Py_XDECREF(greenlet_original_tracer);
+
+    greenlet_track_callback = (track_callback != Py_None) ? track_callback : NULL;
+    greenlet_original_tracer = (original_tracer != Py_None) ? original_tracer : NULL;
+
+    Py_XINCREF(greenlet_track_callback);
+    Py_XINCREF(greenlet_original_tracer);
+
     Py_RETURN_NONE;
 }
 
@@ -498,9 +729,39 @@ static PyObject* link_tasks(PyObject* Py_UNUSED(m), PyObject* args)
         return NULL;
 
     {
-        std::lock_guard<std::mutex> guard(task_link_map_lock);
+        auto state = interpreter_states.current();
 
-        task_link_map[child] = parent;
+        std::lock_guard<std::mutex> guard(state->task_link_map_lock);
+
+        state->task_link_map[child] = parent;
+    }
+
+    Py_RETURN_NONE;
+}
+
+// ----------------------------------------------------------------------------
+static PyObject* set_output_format(PyObject* Py_UNUSED(m), PyObject* args)
+{
+    const char* format;
+    if (!PyArg_ParseTuple(args, "s", &format))
+        return NULL;
+
+    if (running)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Cannot change the output format while sampling");
+        return NULL;
+    }
+
+    if (std::strcmp(format, "mojo") == 0)
+        Renderer::get().set_default_renderer(std::make_shared<MojoRenderer>());
+    else if (std::strcmp(format, "pprof") == 0)
+        Renderer::get().set_default_renderer(std::make_shared<PprofRenderer>());
+    else if (std::strcmp(format, "collapsed") == 0)
+        Renderer::get().set_default_renderer(std::make_shared<CollapsedRenderer>());
+    else
+    {
+        PyErr_Format(PyExc_ValueError, "Unknown output format: %s", format);
+        return NULL;
     }
 
     Py_RETURN_NONE;
@@ -514,6 +775,7 @@ static PyMethodDef echion_core_methods[] = {
     {"track_thread", track_thread, METH_VARARGS, "Map the name of a thread with its identifier"},
     {"untrack_thread", untrack_thread, METH_VARARGS, "Untrack a terminated thread"},
     {"init", init, METH_NOARGS, "Initialize the stack sampler (usually after a fork)"},
+    {"dump_trace", dump_trace, METH_VARARGS, "Dump the trace of the sampler ticks"},
     // Task support
     {"track_asyncio_loop", track_asyncio_loop, METH_VARARGS,
      "Map the name of a task with its identifier"},
@@ -525,14 +787,31 @@ static PyMethodDef echion_core_methods[] = {
     {"link_greenlets", link_greenlets, METH_VARARGS, "Link two greenlets"},
     {"update_greenlet_frame", update_greenlet_frame, METH_VARARGS,
      "Update the frame of a greenlet"},
+    {"greenlet_tracer", (PyCFunction)(void (*)(void))greenlet_tracer, METH_FASTCALL,
+     "Greenlet tracer that keeps track of greenlet frames on switches"},
+    {"init_greenlets", init_greenlets, METH_VARARGS, "Initialise greenlet tracking"},
     // Configuration interface
     {"set_interval", set_interval, METH_VARARGS, "Set the sampling interval"},
     {"set_cpu", set_cpu, METH_VARARGS, "Set whether to use CPU time instead of wall time"},
     {"set_memory", set_memory, METH_VARARGS, "Set whether to sample memory usage"},
+    {"set_gc", set_gc, METH_VARARGS, "Set whether to mark the samples taken during garbage collection"},
+    {"set_idle", set_idle, METH_VARARGS, "Set whether to mark the samples of idle threads"},
+    {"set_gil_mode", set_gil_mode, METH_VARARGS, "Set how to sample the GIL"},
+    {"set_blocking", set_blocking, METH_VARARGS, "Set whether to tag the samples of blocked threads"},
     {"set_native", set_native, METH_VARARGS, "Set whether to sample the native stacks"},
     {"set_where", set_where, METH_VARARGS, "Set whether to use where mode"},
     {"set_pipe_name", set_pipe_name, METH_VARARGS, "Set the pipe name"},
     {"set_max_frames", set_max_frames, METH_VARARGS, "Set the max number of frames to unwind"},
+    {"set_interpreters", set_interpreters, METH_VARARGS, "Set the IDs of the interpreters to sample"},
+    {"set_sampler_workers", set_sampler_workers, METH_VARARGS, "Set the number of sampler workers"},
+    {"set_memory_budget", set_memory_budget, METH_VARARGS,
+     "Set the memory budget for the internal data structures"},
+    {"set_output_format", set_output_format, METH_VARARGS, "Set the format of the output file"},
+    {"set_output_compression", set_output_compression, METH_VARARGS,
+     "Set the compression of the MOJO output"},
+    {"set_output_rotation", set_output_rotation, METH_VARARGS,
+     "Set the interval and the size after which the output file is rotated"},
+    {"set_trace", set_trace, METH_VARARGS, "Set the size of the trace and where to dump it"},
     // Sentinel
     {NULL, NULL, 0, NULL}};
 
@@ -1,3 +1,4 @@
+#include <echion/cache.h>
 #include <echion/danger.h>
 #include <echion/state.h>
 
@@ -6,6 +7,8 @@
 #include <cerrno>
 #include <csetjmp>
 #include <cstdio>
+#include <fcntl.h>
+#include <new>
 #include <sys/mman.h>
 #include <signal.h>
 #include <string.h>
@@ -29,14 +32,211 @@ static const size_t page_size = []() -> size_t {
     return v;
 }();
 
+// Page sizes are powers of two
+static const size_t page_shift = __builtin_ctzll(page_size);
+
 struct sigaction g_old_segv;
 struct sigaction g_old_bus;
 
 thread_local ThreadAltStack t_altstack;
 
-// We "arm" by publishing a valid jmp env for this thread.
-thread_local sigjmp_buf t_jmpenv;
-thread_local volatile sig_atomic_t t_handler_armed = 0;
+// Remembers the pages that the calling thread could not read, and the ranges
+// of the address space that are mapped readable, so that reads of stale
+// pointers fail fast instead of faulting every time. Everything we know is
+// dropped with every new cache epoch, since the mappings change over time.
+// This is only a filter: the reads that pass it are still protected by the
+// fault handler.
+class PageCache {
+public:
+    FaultedPages bad{page_shift};
+
+    void mark_bad(uintptr_t addr, uint32_t epoch) {
+        bad.mark(addr, epoch);
+    }
+
+    // Whether [addr, addr + n) is known to be unreadable.
+    bool unreadable(uintptr_t addr, size_t n, uint32_t epoch) {
+        auto end = addr + n - 1;
+
+        return unreadable(addr, epoch) ||
+               ((end >> page_shift) != (addr >> page_shift) && unreadable(end, epoch));
+    }
+
+private:
+    inline static constexpr size_t kMaxRanges = 4096;
+
+    struct Range {
+        uintptr_t start;
+        uintptr_t end;
+    } ranges[kMaxRanges];
+
+    size_t n_ranges = 0;
+    size_t last = 0;
+    uint32_t ranges_epoch = 0;
+
+    bool unreadable(uintptr_t addr, uint32_t epoch) {
+        if (bad.contain(addr, epoch)) {
+            return true;
+        }
+
+        if (!maybe_mapped(addr, epoch)) {
+            mark_bad(addr, epoch);
+            return true;
+        }
+
+        return false;
+    }
+
+    // We read the mappings again when we do not find an address in them, at
+    // most once per epoch. Any other miss is not conclusive.
+    bool maybe_mapped(uintptr_t addr, uint32_t epoch) {
+        if (find(addr)) {
+            return true;
+        }
+
+        if (ranges_epoch == epoch) {
+            return true;
+        }
+
+        ranges_epoch = epoch;
+        return !refresh() || find(addr);
+    }
+
+    bool find(uintptr_t addr) {
+        if (last < n_ranges && ranges[last].start <= addr && addr < ranges[last].end) {
+            return true;
+        }
+
+        // Find the first range that ends past the address.
+        size_t lo = 0, hi = n_ranges;
+        while (lo < hi) {
+            auto mid = (lo + hi) / 2;
+            if (ranges[mid].end <= addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo < n_ranges && ranges[lo].start <= addr) {
+            last = lo;
+            return true;
+        }
+
+        return false;
+    }
+
+    // Read the readable ranges from /proc/self/maps. We might be in a signal
+    // handler, so we parse the file as we read it, without allocating.
+    bool refresh() {
+        n_ranges = 0;
+        last = 0;
+
+#if defined PL_LINUX
+        int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        char buffer[4096];
+        uintptr_t start = 0, end = 0;
+        bool readable = false, complete = true;
+        int field = 0;  // start, end, permissions, rest of the line
+        for (;;) {
+            auto size = read(fd, buffer, sizeof(buffer));
+            if (size < 0 && errno == EINTR) {
+                continue;
+            }
+            if (size <= 0) {
+                complete = complete && size == 0;
+                break;
+            }
+
+            for (ssize_t i = 0; i < size; i++) {
+                char c = buffer[i];
+                switch (field) {
+                case 0:
+                case 1:
+                    if (c == (field ? ' ' : '-')) {
+                        field++;
+                    } else {
+                        auto& value = field ? end : start;
+                        value = value * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+                    }
+                    break;
+                case 2:
+                    readable = (c == 'r');
+                    field++;
+                    break;
+                default:
+                    if (c != '\n') {
+                        break;
+                    }
+
+                    if (readable) {
+                        if (n_ranges > 0 && ranges[n_ranges - 1].end == start) {
+                            ranges[n_ranges - 1].end = end;
+                        } else if (n_ranges < kMaxRanges) {
+                            ranges[n_ranges++] = {start, end};
+                        } else {
+                            complete = false;
+                        }
+                    }
+
+                    start = end = 0;
+                    field = 0;
+                }
+            }
+        }
+        close(fd);
+
+        if (!complete) {
+            n_ranges = 0;
+        }
+
+        return complete;
+#else
+        return false;
+#endif
+    }
+};
+
+// The cache lives in its own mapping, which we can allocate from within a
+// signal handler.
+struct ThreadPageCache {
+    PageCache* cache = nullptr;
+    bool failed = false;
+
+    PageCache* get() {
+        if (cache == nullptr && !failed) {
+            void* mem = mmap(nullptr, sizeof(PageCache), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                failed = true;
+                return nullptr;
+            }
+
+            cache = new (mem) PageCache();
+            current = cache;
+        }
+
+        return cache;
+    }
+
+    ~ThreadPageCache() {
+        if (cache == nullptr) {
+            return;
+        }
+
+        current = nullptr;
+        munmap(cache, sizeof(PageCache));
+    }
+
+    // For the fault handler, which should not touch thread-local objects that
+    // need construction.
+    static inline thread_local PageCache* current = nullptr;
+};
+
+thread_local ThreadPageCache t_page_cache;
 
 static inline void arm_fault_handler() {
     t_handler_armed = 1;
@@ -48,7 +248,7 @@ static inline void disarm_fault_handler() {
     t_handler_armed = 0;
 }
 
-static void segv_handler(int signo, siginfo_t*, void*) {
+static void segv_handler(int signo, siginfo_t* info, void*) {
     if (!t_handler_armed) {
         struct sigaction* old = (signo == SIGSEGV) ? &g_old_segv : &g_old_bus;
         // Restore the previous handler and re-raise so default/old handling occurs.
@@ -57,6 +257,12 @@ static void segv_handler(int signo, siginfo_t*, void*) {
         return;
     }
 
+    // Remember the page, so that we do not fault on it again.
+    if (auto* cache = ThreadPageCache::current) {
+        cache->mark_bad(reinterpret_cast<uintptr_t>(info->si_addr),
+                        cache_epoch.load(std::memory_order_relaxed));
+    }
+
     // Jump back to the armed site. Use 1 so sigsetjmp returns nonzero.
     siglongjmp(t_jmpenv, 1);
 }
@@ -83,6 +289,32 @@ int init_segv_catcher() {
     return 0;
 }
 
+int open_fault_batch() {
+    if (t_altstack.ensure_installed() != 0) {
+        return -1;
+    }
+
+    // The reads of the batch check the pages that we have faulted on. Without
+    // a page cache, they only have the fault handler to count on.
+    static thread_local FaultedPages none{page_shift};
+    auto* cache = ThreadPageCache::current;
+    if (cache == nullptr) {
+        cache = t_page_cache.get();
+    }
+    auto* faulted = cache != nullptr ? &cache->bad : &none;
+    faulted->epoch = cache_epoch.load(std::memory_order_relaxed);
+
+    t_fault_batch = faulted;
+    arm_fault_handler();
+
+    return 0;
+}
+
+void close_fault_batch() {
+    disarm_fault_handler();
+    t_fault_batch = nullptr;
+}
+
 #if defined PL_LINUX
 using safe_memcpy_return_t = ssize_t;
 #elif defined PL_DARWIN
@@ -90,11 +322,35 @@ using safe_memcpy_return_t = mach_vm_size_t;
 #endif
 
 safe_memcpy_return_t safe_memcpy(void* dst, const void* src, size_t n) {
+    // Within a batch, faults are handled where the batch was opened.
+    if (auto* faulted = t_fault_batch) {
+        if (faulted->contain(src, n)) {
+            errno = EFAULT;
+            return -1;
+        }
+
+        (void)memcpy(dst, src, n);
+        return static_cast<safe_memcpy_return_t>(n);
+    }
+
     if (t_altstack.ensure_installed() != 0) {
         errno = EINVAL;
         return -1;
     }
 
+    // Fail fast on the memory that we know we cannot read.
+    auto* cache = ThreadPageCache::current;
+    if (cache == nullptr) {
+        cache = t_page_cache.get();
+    }
+    if (cache != nullptr) {
+        if (n > 0 && cache->unreadable(reinterpret_cast<uintptr_t>(src), n,
+                                       cache_epoch.load(std::memory_order_relaxed))) {
+            errno = EFAULT;
+            return -1;
+        }
+    }
+
     bool t_faulted = false;
 
     auto* d = static_cast<uint8_t*>(dst);
@@ -1,6 +1,10 @@
+#pragma once
+
 #include <cassert>
+#include <csetjmp>
 #include <csignal>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
@@ -21,6 +25,97 @@
 
 int init_segv_catcher();
 
+// The fault handler is armed by publishing a valid jmp env for this thread.
+inline thread_local sigjmp_buf t_jmpenv;
+inline thread_local volatile sig_atomic_t t_handler_armed = 0;
+
+// The pages that a thread has faulted on, so that its reads of stale pointers
+// can fail fast instead of faulting every time. Pages only count as faulted
+// within the cache epoch in which we faulted on them (see cache.h).
+struct FaultedPages {
+    inline static constexpr size_t kPages = 64;
+
+    struct Entry {
+        uintptr_t page;
+        uint32_t epoch;
+    } entries[kPages];
+
+    size_t page_shift;
+
+    // The cache epoch that the current batch of reads runs in.
+    uint32_t epoch = 0;
+
+    explicit FaultedPages(size_t page_shift) : page_shift(page_shift) {
+        for (auto& entry : entries) {
+            entry = {~uintptr_t(0), 0};
+        }
+    }
+
+    void mark(uintptr_t addr, uint32_t epoch) {
+        auto page = addr >> page_shift;
+        entries[page % kPages] = {page, epoch};
+    }
+
+    bool contain(uintptr_t addr, uint32_t epoch) const {
+        auto page = addr >> page_shift;
+        auto& entry = entries[page % kPages];
+        return entry.page == page && entry.epoch == epoch;
+    }
+
+    // Whether [addr, addr + n) overlaps a page that we have faulted on.
+    bool contain(uintptr_t addr, size_t n, uint32_t epoch) const {
+        auto end = addr + n - 1;
+
+        return contain(addr, epoch) ||
+               ((end >> page_shift) != (addr >> page_shift) && contain(end, epoch));
+    }
+
+    // The same, within the current batch of reads.
+    bool contain(const void* addr, size_t n) const {
+        return n > 0 && contain(reinterpret_cast<uintptr_t>(addr), n, epoch);
+    }
+};
+
+// Whether the calling thread is within a batch of reads (see safe_memcpy_batch),
+// in which case this points to the pages that it has faulted on. The reads of
+// a batch check them directly, since looking the addresses up in the mappings
+// too would cost more than the reads themselves.
+inline thread_local FaultedPages* t_fault_batch = nullptr;
+
+int open_fault_batch();
+void close_fault_batch();
+
+// Run the given reads with the fault handler armed once for all of them,
+// rather than once per read, with copy_memory reading the memory directly in
+// between. A fault jumps straight out of the reads, abandoning them midway,
+// so they must not allocate, take locks or own objects that need destruction,
+// and their results are to be discarded. Returns whether the reads completed.
+template <typename F>
+bool safe_memcpy_batch(F&& reads)
+{
+    // Faults within a nested batch are handled by the outermost one.
+    if (t_fault_batch) {
+        reads();
+        return true;
+    }
+
+    if (open_fault_batch() != 0) {
+        return false;
+    }
+
+    if (sigsetjmp(t_jmpenv, /* save sig mask = */0) != 0) {
+        // We arrived here from siglongjmp after a fault.
+        close_fault_batch();
+        return false;
+    }
+
+    reads();
+
+    close_fault_batch();
+
+    return true;
+}
+
 #if defined PL_LINUX
 ssize_t safe_memcpy_wrapper(
     pid_t,
@@ -22,6 +22,7 @@ enum class ErrorKind
     GenInfoError,
     TaskInfoError,
     TaskInfoGeneratorError,
+    GreenletError,
     ThreadInfoError,
     CpuTimeError,
     LocationError,
@@ -0,0 +1,27 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#include <cstddef>
+
+// ----------------------------------------------------------------------------
+// Rough estimates of the memory used by the standard containers, for the
+// purpose of keeping echion's own memory usage within budget (see budget.h).
+// Hash containers allocate a node for each element, with a link to the next
+// one and the cached hash, plus an array of buckets.
+template <typename M>
+static inline size_t hash_footprint(const M& map)
+{
+    return map.size() * (sizeof(typename M::value_type) + 2 * sizeof(void*)) +
+           map.bucket_count() * sizeof(void*);
+}
+
+// ----------------------------------------------------------------------------
+// List nodes link to the previous and next ones.
+template <typename L>
+static inline size_t list_footprint(const L& list)
+{
+    return list.size() * (sizeof(typename L::value_type) + 2 * sizeof(void*));
+}
@@ -2,10 +2,11 @@
 
 #include <echion/errors.h>
 #include <echion/render.h>
+#include <echion/tick_reads.h>
 
 // ----------------------------------------------------------------------------
 #if PY_VERSION_HEX >= 0x030b0000
-static inline int _read_varint(unsigned char* table, ssize_t size, ssize_t* i)
+static inline int _read_varint(const unsigned char* table, ssize_t size, ssize_t* i)
 {
     ssize_t guard = size - 1;
     if (*i >= guard)
@@ -22,29 +23,18 @@ static inline int _read_varint(unsigned char* table, ssize_t size, ssize_t* i)
 }
 
 // ----------------------------------------------------------------------------
-static inline int _read_signed_varint(unsigned char* table, ssize_t size, ssize_t* i)
+static inline int _read_signed_varint(const unsigned char* table, ssize_t size, ssize_t* i)
 {
     int val = _read_varint(table, size, i);
     return (val & 1) ? -(val >> 1) : (val >> 1);
 }
 #endif
 
-// ----------------------------------------------------------------------------
-void init_frame_cache(size_t capacity)
-{
-    frame_cache = new LRUCache<uintptr_t, Frame>(capacity);
-}
-
-// ----------------------------------------------------------------------------
-void reset_frame_cache()
-{
-    delete frame_cache;
-    frame_cache = nullptr;
-}
-
 // ------------------------------------------------------------------------
 Frame::Frame(PyObject* frame)
 {
+    generation = string_table.generation();
+
 #if PY_VERSION_HEX >= 0x030b0000
 
 #if PY_VERSION_HEX >= 0x030d0000
@@ -75,11 +65,17 @@ Frame::Frame(PyObject* frame)
     name = string_table.key_unsafe(code->co_name);
 #endif
     filename = string_table.key_unsafe(code->co_filename);
+    token = code_token(code);
 }
 
 // ------------------------------------------------------------------------
 Result<Frame::Ptr> Frame::create(PyCodeObject* code, int lasti)
 {
+    // We take the generation before we get the string keys, in case the
+    // string table starts a new one in the meantime.
+    auto generation = string_table.generation();
+    auto epoch = cache_epoch.load(std::memory_order_relaxed);
+
     auto maybe_filename = string_table.key(code->co_filename);
     if (!maybe_filename)
     {
@@ -104,6 +100,10 @@ Result<Frame::Ptr> Frame::create(PyCodeObject* code, int lasti)
         return ErrorKind::LocationError;
     }
 
+    frame->token = code_token(code);
+    frame->generation = generation;
+    frame->epoch = epoch;
+
     return frame;
 }
 
@@ -111,6 +111,8 @@ Result<Frame::Ptr> Frame::create(PyCodeObject* code, int lasti)
 #ifndef UNWIND_NATIVE_DISABLE
 Result<Frame::Ptr> Frame::create(unw_cursor_t& cursor, unw_word_t pc)
 {
+    auto generation = string_table.generation();
+
     auto filename = string_table.key(pc);
 
     auto maybe_name = string_table.key(cursor);
@@ -119,7 +121,10 @@ Result<Frame::Ptr> Frame::create(unw_cursor_t& cursor, unw_word_t pc)
         return ErrorKind::FrameError;
     }
 
-    return std::make_unique<Frame>(filename, *maybe_name);
+    auto frame = std::make_unique<Frame>(filename, *maybe_name);
+    frame->generation = generation;
+
+    return frame;
 }
 #endif  // UNWIND_NATIVE_DISABLE
 
@@ -130,14 +135,12 @@ Result<void> Frame::infer_location(PyCodeObject* code_obj, int lasti)
     Py_ssize_t len = 0;
 
 #if PY_VERSION_HEX >= 0x030b0000
-    auto table = pybytes_to_bytes_and_size(code_obj->co_linetable, &len);
+    auto table = pybytes_view(code_obj->co_linetable, &len);
     if (table == nullptr)
     {
         return ErrorKind::LocationError;
     }
 
-    auto table_data = table.get();
-
     for (Py_ssize_t i = 0, bc = 0; i < len; i++)
     {
         bc += (table[i] & 7) + 1;
@@ -149,17 +152,17 @@ Result<void> Frame::infer_location(PyCodeObject* code_obj, int lasti)
                 break;
 
             case 14:  // Long form
-                lineno += _read_signed_varint(table_data, len, &i);
+                lineno += _read_signed_varint(table, len, &i);
 
                 this->location.line = lineno;
-                this->location.line_end = lineno + _read_varint(table_data, len, &i);
-                this->location.column = _read_varint(table_data, len, &i);
-                this->location.column_end = _read_varint(table_data, len, &i);
+                this->location.line_end = lineno + _read_varint(table, len, &i);
+                this->location.column = _read_varint(table, len, &i);
+                this->location.column_end = _read_varint(table, len, &i);
 
                 break;
 
             case 13:  // No column data
-                lineno += _read_signed_varint(table_data, len, &i);
+                lineno += _read_signed_varint(table, len, &i);
 
                 this->location.line = lineno;
                 this->location.line_end = lineno;
@@ -203,7 +206,7 @@ Result<void> Frame::infer_location(PyCodeObject* code_obj, int lasti)
     }
 
 #elif PY_VERSION_HEX >= 0x030a0000
-    auto table = pybytes_to_bytes_and_size(code_obj->co_linetable, &len);
+    auto table = pybytes_view(code_obj->co_linetable, &len);
     if (table == nullptr)
     {
         return ErrorKind::LocationError;
@@ -230,7 +233,7 @@ Result<void> Frame::infer_location(PyCodeObject* code_obj, int lasti)
     }
 
 #else
-    auto table = pybytes_to_bytes_and_size(code_obj->co_lnotab, &len);
+    auto table = pybytes_view(code_obj->co_lnotab, &len);
     if (table == nullptr)
     {
         return ErrorKind::LocationError;
@@ -265,37 +268,80 @@ Frame::Key Frame::key(PyCodeObject* code, int lasti)
 }
 
 // ----------------------------------------------------------------------------
-Frame::Key Frame::key(PyObject* frame)
+PyCodeObject* Frame::code_unsafe(PyObject* frame, int& lasti)
 {
 #if PY_VERSION_HEX >= 0x030d0000
     _PyInterpreterFrame* iframe = reinterpret_cast<_PyInterpreterFrame*>(frame);
-    const int lasti = _PyInterpreterFrame_LASTI(iframe);
-    PyCodeObject* code = reinterpret_cast<PyCodeObject*>(iframe->f_executable);
+    lasti = _PyInterpreterFrame_LASTI(iframe);
+    return reinterpret_cast<PyCodeObject*>(iframe->f_executable);
 #elif PY_VERSION_HEX >= 0x030b0000
     const _PyInterpreterFrame* iframe = reinterpret_cast<_PyInterpreterFrame*>(frame);
-    const int lasti = _PyInterpreterFrame_LASTI(iframe);
-    PyCodeObject* code = iframe->f_code;
+    lasti = _PyInterpreterFrame_LASTI(iframe);
+    return iframe->f_code;
 #else
     const PyFrameObject* py_frame = reinterpret_cast<PyFrameObject*>(frame);
-    const int lasti = py_frame->f_lasti;
-    PyCodeObject* code = py_frame->f_code;
+    lasti = py_frame->f_lasti;
+    return py_frame->f_code;
 #endif
-    return key(code, lasti);
+}
+
+// ----------------------------------------------------------------------------
+// A code object allocated at the address of one that has been freed is very
+// unlikely to also share the same name, file name and line table objects.
+uint64_t Frame::code_token(PyCodeObject* code)
+{
+#if PY_VERSION_HEX >= 0x030b0000
+    auto name = code->co_qualname;
+#else
+    auto name = code->co_name;
+#endif
+#if PY_VERSION_HEX >= 0x030a0000
+    auto table = code->co_linetable;
+#else
+    auto table = code->co_lnotab;
+#endif
+
+    uint64_t token = reinterpret_cast<uintptr_t>(code->co_filename);
+    token = (token * 0x100000001B3ULL) ^ reinterpret_cast<uintptr_t>(name);
+    token = (token * 0x100000001B3ULL) ^ reinterpret_cast<uintptr_t>(table);
+    token = (token * 0x100000001B3ULL) ^ static_cast<uint64_t>(code->co_firstlineno);
+
+    return token;
+}
+
+// ----------------------------------------------------------------------------
+// Render a new frame and add it to the cache. Stale frames are refreshed in
+// place instead, as the stacks that we are unwinding might still refer to them.
+Frame& Frame::store(Key frame_key, Frame::Ptr frame, Frame* stale)
+{
+    frame->cache_key = frame_key;
+    Renderer::get().frame(frame_key, frame->filename, frame->name, frame->location.line,
+                          frame->location.line_end, frame->location.column,
+                          frame->location.column_end);
+
+    if (stale != nullptr)
+    {
+        *stale = std::move(*frame);
+        return *stale;
+    }
+
+    auto& f = *frame;
+    frame_cache->store(frame_key, std::move(frame));
+    return f;
 }
 
 // ------------------------------------------------------------------------
 #if PY_VERSION_HEX >= 0x030b0000
-Result<std::reference_wrapper<Frame>> Frame::read(_PyInterpreterFrame* frame_addr,
-                                                  _PyInterpreterFrame** prev_addr)
+Result<Frame::Site> Frame::locate(_PyInterpreterFrame* frame_addr,
+                                  _PyInterpreterFrame** prev_addr, StackChunk* chunk)
 #else
-Result<std::reference_wrapper<Frame>> Frame::read(PyObject* frame_addr, PyObject** prev_addr)
+Result<Frame::Site> Frame::locate(PyObject* frame_addr, PyObject** prev_addr)
 #endif
 {
 #if PY_VERSION_HEX >= 0x030b0000
     _PyInterpreterFrame iframe;
     auto resolved_addr =
-        stack_chunk ? reinterpret_cast<_PyInterpreterFrame*>(stack_chunk->resolve(frame_addr))
-                    : frame_addr;
+        chunk ? reinterpret_cast<_PyInterpreterFrame*>(chunk->resolve(frame_addr)) : frame_addr;
     if (resolved_addr != frame_addr)
     {
         frame_addr = resolved_addr;
@@ -318,7 +364,7 @@ Result<std::reference_wrapper<Frame>> Frame::read(PyObject* frame_addr, PyObject
     {
         *prev_addr = frame_addr->previous;
         // This is a C frame, we just need to ignore it
-        return std::ref(C_FRAME);
+        return Site{};
     }
 
     if (frame_addr->owner != FRAME_OWNED_BY_THREAD && frame_addr->owner != FRAME_OWNED_BY_GENERATOR)
@@ -327,47 +373,31 @@ Result<std::reference_wrapper<Frame>> Frame::read(PyObject* frame_addr, PyObject
     }
 #endif  // PY_VERSION_HEX >= 0x030c0000
 
+    Site site;
+
     // We cannot use _PyInterpreterFrame_LASTI because _PyCode_CODE reads
     // from the code object.
 #if PY_VERSION_HEX >= 0x030d0000
-    const int lasti =
-        (static_cast<int>((frame_addr->instr_ptr - 1 -
-                           reinterpret_cast<_Py_CODEUNIT*>(
-                               (reinterpret_cast<PyCodeObject*>(frame_addr->f_executable)))))) -
-        offsetof(PyCodeObject, co_code_adaptive) / sizeof(_Py_CODEUNIT);
-    auto maybe_frame = Frame::get(reinterpret_cast<PyCodeObject*>(frame_addr->f_executable), lasti);
-    if (!maybe_frame)
-    {
-        return ErrorKind::FrameError;
-    }
-
-    auto& frame = maybe_frame->get();
+    site.code = reinterpret_cast<PyCodeObject*>(frame_addr->f_executable);
+    site.lasti = (static_cast<int>((frame_addr->instr_ptr - 1 -
+                                    reinterpret_cast<_Py_CODEUNIT*>(site.code)))) -
+                 offsetof(PyCodeObject, co_code_adaptive) / sizeof(_Py_CODEUNIT);
 #else
-    const int lasti = (static_cast<int>((frame_addr->prev_instr -
-                                         reinterpret_cast<_Py_CODEUNIT*>((frame_addr->f_code))))) -
-                      offsetof(PyCodeObject, co_code_adaptive) / sizeof(_Py_CODEUNIT);
-    auto maybe_frame = Frame::get(frame_addr->f_code, lasti);
-    if (!maybe_frame)
-    {
-        return ErrorKind::FrameError;
-    }
-
-    auto& frame = maybe_frame->get();
+    site.code = frame_addr->f_code;
+    site.lasti = (static_cast<int>((frame_addr->prev_instr -
+                                    reinterpret_cast<_Py_CODEUNIT*>((frame_addr->f_code))))) -
+                 offsetof(PyCodeObject, co_code_adaptive) / sizeof(_Py_CODEUNIT);
 #endif  // PY_VERSION_HEX >= 0x030d0000
-    if (&frame != &INVALID_FRAME)
-    {
+
 #if PY_VERSION_HEX >= 0x030c0000
-        frame.is_entry = (frame_addr->owner == FRAME_OWNED_BY_CSTACK);  // Shim frame
+    site.is_entry = (frame_addr->owner == FRAME_OWNED_BY_CSTACK);  // Shim frame
 #else   // PY_VERSION_HEX < 0x030c0000
-        frame.is_entry = frame_addr->is_entry;
+    site.is_entry = frame_addr->is_entry;
 #endif  // PY_VERSION_HEX >= 0x030c0000
-    }
 
-    *prev_addr = &frame == &INVALID_FRAME ? NULL : frame_addr->previous;
+    *prev_addr = frame_addr->previous;
 
 #else   // PY_VERSION_HEX < 0x030b0000
-    // Unwind the stack from leaf to root and store it in a stack. This way we
-    // can print it from root to leaf.
     PyFrameObject py_frame;
 
     if (copy_type(frame_addr, py_frame))
@@ -375,14 +405,31 @@ Result<std::reference_wrapper<Frame>> Frame::read(PyObject* frame_addr, PyObject
         return ErrorKind::FrameError;
     }
 
-    auto maybe_frame = Frame::get(py_frame.f_code, py_frame.f_lasti);
+    Site site;
+    site.code = py_frame.f_code;
+    site.lasti = py_frame.f_lasti;
+
+    *prev_addr = reinterpret_cast<PyObject*>(py_frame.f_back);
+#endif  // PY_VERSION_HEX >= 0x030b0000
+
+    return site;
+}
+
+// ----------------------------------------------------------------------------
+Result<std::reference_wrapper<Frame>> Frame::get(const Site& site)
+{
+    auto maybe_frame = Frame::get(site.code, site.lasti);
     if (!maybe_frame)
     {
         return ErrorKind::FrameError;
     }
 
     auto& frame = maybe_frame->get();
-    *prev_addr = (&frame == &INVALID_FRAME) ? NULL : reinterpret_cast<PyObject*>(py_frame.f_back);
+#if PY_VERSION_HEX >= 0x030b0000
+    if (&frame != &INVALID_FRAME)
+    {
+        frame.is_entry = site.is_entry;
+    }
 #endif  // PY_VERSION_HEX >= 0x030b0000
 
     return std::ref(frame);
@@ -392,54 +439,66 @@ Result<std::reference_wrapper<Frame>> Frame::read(PyObject* frame_addr, PyObject
 Result<std::reference_wrapper<Frame>> Frame::get(PyCodeObject* code_addr, int lasti)
 {
     auto frame_key = Frame::key(code_addr, lasti);
+    auto epoch = cache_epoch.load(std::memory_order_relaxed);
 
+    Frame* stale = nullptr;
     auto maybe_frame = frame_cache->lookup(frame_key);
     if (maybe_frame)
     {
-        return *maybe_frame;
+        auto& frame = maybe_frame->get();
+        if (frame.generation == string_table.generation() && frame.epoch == epoch)
+        {
+            return *maybe_frame;
+        }
+
+        stale = &frame;
     }
 
     PyCodeObject code;
-    if (copy_type(code_addr, code))
+    if (copy_type_tick(code_addr, code))
     {
         return std::ref(INVALID_FRAME);
     }
 
+    if (stale != nullptr && stale->generation == string_table.generation() &&
+        stale->token == code_token(&code))
+    {
+        // Still the same code object.
+        stale->epoch = epoch;
+        return std::ref(*stale);
+    }
+
     auto maybe_new_frame = Frame::create(&code, lasti);
     if (!maybe_new_frame)
     {
         return std::ref(INVALID_FRAME);
     }
 
-    auto new_frame = std::move(*maybe_new_frame);
-    new_frame->cache_key = frame_key;
-    auto& f = *new_frame;
-    Renderer::get().frame(frame_key, new_frame->filename, new_frame->name, new_frame->location.line,
-                          new_frame->location.line_end, new_frame->location.column,
-                          new_frame->location.column_end);
-    frame_cache->store(frame_key, std::move(new_frame));
-    return std::ref(f);
+    return std::ref(store(frame_key, std::move(*maybe_new_frame), stale));
 }
 
 // ----------------------------------------------------------------------------
 Frame& Frame::get(PyObject* frame)
 {
-    auto frame_key = Frame::key(frame);
+    int lasti = 0;
+    auto code = code_unsafe(frame, lasti);
+    auto frame_key = Frame::key(code, lasti);
 
+    // We can access the code object directly, so we check it on every hit.
+    Frame* stale = nullptr;
     auto maybe_frame = frame_cache->lookup(frame_key);
     if (maybe_frame)
     {
-        return *maybe_frame;
+        auto& cached = maybe_frame->get();
+        if (cached.generation == string_table.generation() && cached.token == code_token(code))
+        {
+            return cached;
+        }
+
+        stale = &cached;
     }
 
-    auto new_frame = std::make_unique<Frame>(frame);
-    new_frame->cache_key = frame_key;
-    auto& f = *new_frame;
-    Renderer::get().frame(frame_key, new_frame->filename, new_frame->name, new_frame->location.line,
-                          new_frame->location.line_end, new_frame->location.column,
-                          new_frame->location.column_end);
-    frame_cache->store(frame_key, std::move(new_frame));
-    return f;
+    return store(frame_key, std::make_unique<Frame>(frame), stale);
 }
 
 // ----------------------------------------------------------------------------
@@ -454,10 +513,18 @@ Result<std::reference_wrapper<Frame>> Frame::get(unw_cursor_t& cursor)
     }
 
     uintptr_t frame_key = static_cast<uintptr_t>(pc);
+
+    Frame* stale = nullptr;
     auto maybe_frame = frame_cache->lookup(frame_key);
     if (maybe_frame)
     {
-        return *maybe_frame;
+        auto& frame = maybe_frame->get();
+        if (frame.generation == string_table.generation())
+        {
+            return *maybe_frame;
+        }
+
+        stale = &frame;
     }
 
     auto maybe_new_frame = Frame::create(cursor, pc);
@@ -466,14 +533,7 @@ Result<std::reference_wrapper<Frame>> Frame::get(unw_cursor_t& cursor)
         return std::ref(UNKNOWN_FRAME);
     }
 
-    auto frame = std::move(*maybe_new_frame);
-    frame->cache_key = frame_key;
-    auto& f = *frame;
-    Renderer::get().frame(frame_key, frame->filename, frame->name, frame->location.line,
-                          frame->location.line_end, frame->location.column,
-                          frame->location.column_end);
-    frame_cache->store(frame_key, std::move(frame));
-    return std::ref(f);
+    return std::ref(store(frame_key, std::move(*maybe_new_frame), stale));
 }
 #endif  // UNWIND_NATIVE_DISABLE
 
@@ -482,18 +542,26 @@ Frame& Frame::get(StringTable::Key name)
 {
     uintptr_t frame_key = static_cast<uintptr_t>(name);
 
+    // The name might have been replaced since we cached the frame.
+    auto generation = string_table.generation();
+    auto version = string_table.version(name);
+
+    Frame* stale = nullptr;
     auto maybe_frame = frame_cache->lookup(frame_key);
     if (maybe_frame)
     {
-        return *maybe_frame;
+        auto& frame = maybe_frame->get();
+        if (frame.generation == generation && frame.token == version)
+        {
+            return frame;
+        }
+
+        stale = &frame;
     }
 
     auto frame = std::make_unique<Frame>(name);
-    frame->cache_key = frame_key;
-    auto& f = *frame;
-    Renderer::get().frame(frame_key, frame->filename, frame->name, frame->location.line,
-                          frame->location.line_end, frame->location.column,
-                          frame->location.column_end);
-    frame_cache->store(frame_key, std::move(frame));
-    return f;
+    frame->token = version;
+    frame->generation = generation;
+
+    return store(frame_key, std::move(frame), stale);
 }
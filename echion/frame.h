@@ -67,6 +67,11 @@ public:
     bool is_entry = false;
 #endif
 
+    // Used to tell whether a cached frame is still valid (see cache.h).
+    uint64_t token = 0;
+    uint64_t generation = 0;
+    uint32_t epoch = 0;
+
     // ------------------------------------------------------------------------
     Frame(StringTable::Key filename, StringTable::Key name) : filename(filename), name(name) {}
     Frame(StringTable::Key name) : name(name) {};
@@ -76,16 +81,29 @@ public:
     [[nodiscard]] static Result<Frame::Ptr> create(unw_cursor_t& cursor, unw_word_t pc);
 #endif  // UNWIND_NATIVE_DISABLE
 
+    // Where a frame is executing, as read from the frame itself. This is
+    // all that we need to look the frame up, and reading it touches none of
+    // our own data structures. The code is NULL for C frames.
+    struct Site
+    {
+        PyCodeObject* code = NULL;
+        int lasti = 0;
+#if PY_VERSION_HEX >= 0x030b0000
+        bool is_entry = false;
+#endif
+    };
+
 #if PY_VERSION_HEX >= 0x030b0000
-    [[nodiscard]] static Result<std::reference_wrapper<Frame>> read(
-        _PyInterpreterFrame* frame_addr, _PyInterpreterFrame** prev_addr);
+    [[nodiscard]] static Result<Site> locate(_PyInterpreterFrame* frame_addr,
+                                             _PyInterpreterFrame** prev_addr,
+                                             StackChunk* chunk);
 #else
-    [[nodiscard]] static Result<std::reference_wrapper<Frame>> read(PyObject* frame_addr,
-                                                                    PyObject** prev_addr);
+    [[nodiscard]] static Result<Site> locate(PyObject* frame_addr, PyObject** prev_addr);
 #endif
 
     [[nodiscard]] static Result<std::reference_wrapper<Frame>> get(PyCodeObject* code_addr,
                                                                    int lasti);
+    [[nodiscard]] static Result<std::reference_wrapper<Frame>> get(const Site& site);
     static Frame& get(PyObject* frame);
 #ifndef UNWIND_NATIVE_DISABLE
     [[nodiscard]] static Result<std::reference_wrapper<Frame>> get(unw_cursor_t& cursor);
@@ -95,15 +113,15 @@ public:
 private:
     [[nodiscard]] Result<void> inline infer_location(PyCodeObject* code, int lasti);
     static inline Key key(PyCodeObject* code, int lasti);
-    static inline Key key(PyObject* frame);
+    static inline PyCodeObject* code_unsafe(PyObject* frame, int& lasti);
+    static inline uint64_t code_token(PyCodeObject* code);
+    static Frame& store(Key frame_key, Frame::Ptr frame, Frame* stale);
 };
 
 inline auto INVALID_FRAME = Frame(StringTable::INVALID);
 inline auto UNKNOWN_FRAME = Frame(StringTable::UNKNOWN);
 inline auto C_FRAME = Frame(StringTable::C_FRAME);
 
-// We make this a raw pointer to prevent its destruction on exit, since we
-// control the lifetime of the cache.
-inline LRUCache<uintptr_t, Frame>* frame_cache = nullptr;
-void init_frame_cache(size_t capacity);
-void reset_frame_cache();
+// Each interpreter has a frame cache of its own (see interp.h). This points to
+// the cache of the interpreter that the calling thread is currently unwinding.
+inline thread_local LRUCache<uintptr_t, Frame>* frame_cache = nullptr;
@@ -8,6 +8,8 @@
 #define Py_BUILD_CORE
 
 
+#include <atomic>
+
 #include <echion/stacks.h>
 #include <echion/strings.h>
 
@@ -24,11 +26,30 @@ public:
 
     ID greenlet_id = 0;
     StringTable::Key name;
-    PyObject* frame = NULL;
+
+    // The frame slot is written on every switch by the greenlet tracer, which
+    // holds the GIL, and read by the sampler, which doesn't. The slot owns a
+    // reference to the frame object so that it stays alive until the next
+    // switch replaces it.
+    std::atomic<PyObject*> frame;
 
     GreenletInfo(ID id, PyObject* frame, StringTable::Key name)
         : greenlet_id(id), name(name), frame(frame)
     {
+        Py_INCREF(frame);
+    }
+
+    // DEV: This must be called with the GIL held.
+    ~GreenletInfo()
+    {
+        Py_DECREF(frame.load());
+    }
+
+    // DEV: This must be called with the GIL held.
+    inline void update_frame(PyObject* new_frame)
+    {
+        Py_INCREF(new_frame);
+        Py_DECREF(frame.exchange(new_frame));
     }
 
     int unwind(PyObject*, PyThreadState*, FrameStack&);
@@ -83,14 +104,27 @@ inline std::unordered_map<GreenletInfo::ID, GreenletInfo::Ptr>& greenlet_info_ma
 inline std::unordered_map<GreenletInfo::ID, GreenletInfo::ID>& greenlet_parent_map =
     *(new std::unordered_map<GreenletInfo::ID, GreenletInfo::ID>());
 
+// counts the children of each parent greenlet
+inline std::unordered_map<GreenletInfo::ID, size_t>& greenlet_parent_count =
+    *(new std::unordered_map<GreenletInfo::ID, size_t>());
+
 // maps threads to any currently active greenlets
 inline std::unordered_map<uintptr_t, GreenletInfo::ID>& greenlet_thread_map =
     *(new std::unordered_map<uintptr_t, GreenletInfo::ID>());
 
+// The maps above are only ever modified with the GIL held and the lock below
+// acquired. Code that runs with the GIL held, like the greenlet tracer, can
+// therefore read them without taking the lock.
 inline std::mutex greenlet_info_map_lock;
 
+// Python-side hooks used by the native greenlet tracer: a callable that tracks
+// a greenlet we have not seen yet and the tracer that was installed before
+// ours, if any.
+inline PyObject* greenlet_track_callback = NULL;
+inline PyObject* greenlet_original_tracer = NULL;
+
 // ----------------------------------------------------------------------------
 
-inline std::vector<std::unique_ptr<StackInfo>> current_greenlets;
+inline thread_local std::vector<std::unique_ptr<StackInfo>> current_greenlets;
 
 // ----------------------------------------------------------------------------
@@ -15,9 +15,21 @@
 #include <internal/pycore_interp.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include <echion/cache.h>
+#include <echion/config.h>
+#include <echion/footprint.h>
+#include <echion/frame.h>
 #include <echion/state.h>
+#include <echion/trace.h>
 #include <echion/vm.h>
 
 
@@ -29,28 +41,357 @@ public:
     void* next = NULL;
 };
 
+// ----------------------------------------------------------------------------
+// The state that we keep for each interpreter. Objects that live in different
+// interpreters are never looked up in the same tables, so that sub-interpreters
+// with their own GIL never contend on, nor evict entries from, each other's
+// state.
+class InterpreterState
+{
+public:
+    using Ptr = std::shared_ptr<InterpreterState>;
+
+    // The frame cache is split into shards, one for each sampler worker, so
+    // that the workers can unwind threads of the same interpreter concurrently.
+    // Each shard is unwound with its own lock held, which serialises the
+    // sampler worker that owns it with, e.g., the where thread and, in memory
+    // mode, the allocating threads, which all use the first shard.
+    class Shard
+    {
+    public:
+        std::mutex lock;
+        std::unique_ptr<LRUCache<uintptr_t, Frame>> frame_cache = nullptr;
+    };
+
+    int64_t id;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    // asyncio support
+    std::atomic<PyObject*> asyncio_current_tasks = NULL;
+    std::atomic<PyObject*> asyncio_scheduled_tasks = NULL;  // WeakSet
+    std::atomic<PyObject*> asyncio_eager_tasks = NULL;      // set
+
+    std::unordered_map<PyObject*, PyObject*> task_link_map;
+    std::mutex task_link_map_lock;
+    std::unordered_set<PyObject*> previous_task_objects;
+
+    // Whether the cyclic garbage collector is running, the address of the
+    // GIL, and the ID of the thread that holds it, which is the one that runs
+    // the collector, as of the last walk of the interpreters.
+    std::atomic<bool> gc_collecting = false;
+    std::atomic<uintptr_t> gil_addr = 0;
+    std::atomic<uintptr_t> gil_holder = 0;
+
+    InterpreterState(int64_t id, size_t n_shards, size_t frame_cache_capacity) : id(id)
+    {
+        init_shards(n_shards, frame_cache_capacity);
+    }
+
+    // Not to be called while the interpreter is being sampled.
+    void init_shards(size_t n_shards, size_t frame_cache_capacity)
+    {
+        shards.clear();
+        for (size_t i = 0; i < n_shards; i++)
+        {
+            auto shard = std::make_unique<Shard>();
+            if (frame_cache_capacity)
+                shard->frame_cache =
+                    std::make_unique<LRUCache<uintptr_t, Frame>>(frame_cache_capacity);
+            shards.push_back(std::move(shard));
+        }
+    }
+
+    size_t frame_cache_footprint()
+    {
+        size_t size = 0;
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+
+            if (shard->frame_cache != nullptr)
+                size += shard->frame_cache->footprint();
+        }
+
+        return size;
+    }
+
+    size_t task_footprint()
+    {
+        std::lock_guard<std::mutex> guard(task_link_map_lock);
+
+        return hash_footprint(task_link_map) + hash_footprint(previous_task_objects);
+    }
+
+    // The threads that wait for the GIL block on the futexes of its mutex or
+    // condition variable, which lie within the GIL structure.
+    static constexpr size_t GIL_SIZE = sizeof(struct _gil_runtime_state);
+};
+
+// ----------------------------------------------------------------------------
+class InterpreterStates
+{
+public:
+    // Get the state of the interpreter with the given ID, creating it if we
+    // have not seen the interpreter before.
+    InterpreterState::Ptr get(int64_t id)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto& state = states[id];
+        if (state == nullptr)
+            state = std::make_shared<InterpreterState>(id, n_shards, frame_cache_capacity);
+
+        return state;
+    }
+
+    // Get the state of the interpreter with the given ID, like get, but
+    // remember it in the calling thread. This keeps the paths that run on every
+    // event of the application threads, like the allocator hooks, off the lock
+    // that all the interpreters share.
+    const InterpreterState::Ptr& get_cached(int64_t id)
+    {
+        struct Cached
+        {
+            int64_t id = -1;
+            uint64_t generation = 0;
+            InterpreterState::Ptr state;
+        };
+        static thread_local Cached cached;
+
+        // We never reuse a state that has been dropped in the meantime.
+        auto current_generation = generation.load(std::memory_order_acquire);
+        if (cached.state == nullptr || cached.id != id || cached.generation != current_generation)
+        {
+            cached.state = get(id);
+            cached.id = id;
+            cached.generation = current_generation;
+        }
+
+        return cached.state;
+    }
+
+    // Get the state of the interpreter of the calling thread, which must hold
+    // the GIL.
+    InterpreterState::Ptr current()
+    {
+        return get_cached(PyThreadState_Get()->interp->id);
+    }
+
+    // Drop the state of the interpreters that no longer exist.
+    void retain(const std::vector<int64_t>& ids)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        for (auto it = states.begin(); it != states.end();)
+        {
+            if (std::find(ids.begin(), ids.end(), it->first) == ids.end())
+            {
+                it = states.erase(it);
+                generation.fetch_add(1, std::memory_order_release);
+            }
+            else
+                ++it;
+        }
+    }
+
+    // Create the frame caches, with one shard for each sampler worker. Not to
+    // be called while sampling.
+    void init_frame_caches(size_t capacity, size_t shards)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        frame_cache_capacity = capacity;
+        n_shards = shards;
+        for (auto& kv : states)
+            kv.second->init_shards(n_shards, frame_cache_capacity);
+    }
+
+    // Drop the frame caches. Not to be called while sampling.
+    void reset_frame_caches()
+    {
+        init_frame_caches(0, 1);
+    }
+
+    // Add up the given measure across all the interpreter states.
+    template <typename F>
+    size_t sum(F measure)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        size_t total = 0;
+        for (auto& kv : states)
+            total += measure(*kv.second);
+
+        return total;
+    }
+
+private:
+    std::mutex lock;
+    std::unordered_map<int64_t, InterpreterState::Ptr> states;
+    std::atomic<uint64_t> generation = 0;  // Changes when states are dropped
+    size_t frame_cache_capacity = 0;
+    size_t n_shards = 1;
+};
+
+// We make this a reference to a heap-allocated object so that we can avoid
+// the destruction on exit.
+inline InterpreterStates& interpreter_states = *(new InterpreterStates());
+
+// The state of the interpreter that the calling thread is currently unwinding.
+inline thread_local InterpreterState* current_interp = nullptr;
+
+// ----------------------------------------------------------------------------
+// Make the state of the given interpreter the current one for the calling
+// thread, for as long as the scope object is alive. Sampler workers pass their
+// index to use a frame cache shard of their own.
+class InterpreterScope
+{
+public:
+    InterpreterScope(InterpreterState::Ptr state, size_t shard = 0)
+        : state(std::move(state)),
+          shard(*this->state->shards[shard % this->state->shards.size()]),
+          guard(this->shard.lock),
+          previous_interp(current_interp),
+          previous_frame_cache(frame_cache)
+    {
+        current_interp = this->state.get();
+        frame_cache = this->shard.frame_cache.get();
+    }
+
+    ~InterpreterScope()
+    {
+        current_interp = previous_interp;
+        frame_cache = previous_frame_cache;
+    }
+
+    InterpreterScope(const InterpreterScope&) = delete;
+    InterpreterScope& operator=(const InterpreterScope&) = delete;
+
+private:
+    InterpreterState::Ptr state;
+    InterpreterState::Shard& shard;
+    std::lock_guard<std::mutex> guard;
+    InterpreterState* previous_interp;
+    LRUCache<uintptr_t, Frame>* previous_frame_cache;
+};
+
+// ----------------------------------------------------------------------------
+// Find the GIL of the given interpreter, and the ID of the thread that holds
+// it, which is 0 if the GIL is free or cannot be read.
+static void read_gil(char* interp_addr, InterpreterState& state)
+{
+    state.gil_holder = 0;
+
+#if PY_VERSION_HEX >= 0x030c0000
+    // Interpreters either have a GIL of their own or share the main one.
+    struct _gil_runtime_state* gil_addr = NULL;
+    if (copy_type(interp_addr + offsetof(PyInterpreterState, ceval.gil), gil_addr) ||
+        gil_addr == NULL)
+        return;
+#else
+    (void)interp_addr;
+    auto* gil_addr = &runtime->ceval.gil;
+#endif
+
+    state.gil_addr = reinterpret_cast<uintptr_t>(gil_addr);
+
+    struct _gil_runtime_state gil;
+    if (copy_type(gil_addr, gil))
+        return;
+
+#if PY_VERSION_HEX >= 0x030d0000
+    auto locked = gil.locked;
+    auto* holder = gil.last_holder;
+#else
+    auto locked = gil.locked._value;
+    auto* holder = reinterpret_cast<PyThreadState*>(gil.last_holder._value);
+#endif
+    if (!locked || holder == NULL)
+        return;
+
+    unsigned long thread_id = 0;
+    if (copy_type(&holder->thread_id, thread_id))
+        return;
+
+    state.gil_holder = thread_id;
+}
+
+// ----------------------------------------------------------------------------
+// Read the state of the runtime that the samples of the threads of the given
+// interpreter depend on.
+static void read_runtime_state(char* interp_addr, InterpreterState& state)
+{
+    TraceScope trace(Tracer::INTERPRETERS);
+
+    int collecting = 0;
+    if (gc)
+    {
+#if PY_VERSION_HEX >= 0x03090000
+        if (copy_type(interp_addr + offsetof(PyInterpreterState, gc.collecting), collecting))
+#else
+        // The garbage collector state is global before 3.9.
+        if (copy_type(&runtime->gc.collecting, collecting))
+#endif
+            collecting = 0;
+    }
+
+    state.gc_collecting = collecting != 0;
+
+    if (collecting || gil_mode != GilMode::NONE)
+        read_gil(interp_addr, state);
+    else
+        state.gil_holder = 0;
+}
+
+// ----------------------------------------------------------------------------
 static void for_each_interp(std::function<void(InterpreterInfo& interp)> callback)
 {
     InterpreterInfo interpreter_info = {0};
 
+    // The IDs of the interpreters that we find, which we use to drop the state
+    // of those that have been finalised since the last walk.
+    static thread_local std::vector<int64_t> interp_ids;
+    interp_ids.clear();
+
     for (char* interp_addr = reinterpret_cast<char*>(runtime->interpreters.head); interp_addr != NULL;
          interp_addr = reinterpret_cast<char*>(interpreter_info.next))
     {
-        if (copy_type(interp_addr + offsetof(PyInterpreterState, id), interpreter_info.id))
-            continue;
+        {
+            TraceScope trace(Tracer::INTERPRETERS);
+
+            // If we fail to read any of the fields we cannot tell where the
+            // next interpreter is, so we stop here.
+            if (copy_type(interp_addr + offsetof(PyInterpreterState, id), interpreter_info.id))
+                return;
 
 #if PY_VERSION_HEX >= 0x030b0000
-        if (copy_type(interp_addr + offsetof(PyInterpreterState, threads.head),
-                      interpreter_info.tstate_head))
+            if (copy_type(interp_addr + offsetof(PyInterpreterState, threads.head),
+                          interpreter_info.tstate_head))
 #else
-        if (copy_type(interp_addr + offsetof(PyInterpreterState, tstate_head),
-                      interpreter_info.tstate_head))
+            if (copy_type(interp_addr + offsetof(PyInterpreterState, tstate_head),
+                          interpreter_info.tstate_head))
 #endif
-            continue;
+                return;
 
-        if (copy_type(interp_addr + offsetof(PyInterpreterState, next), interpreter_info.next))
+            if (copy_type(interp_addr + offsetof(PyInterpreterState, next), interpreter_info.next))
+                return;
+        }
+
+        interp_ids.push_back(interpreter_info.id);
+
+        if (!interpreter_ids.empty() &&
+            interpreter_ids.find(interpreter_info.id) == interpreter_ids.end())
             continue;
 
+        auto state = interpreter_states.get(interpreter_info.id);
+        if (gc || gil_mode != GilMode::NONE)
+            read_runtime_state(interp_addr, *state);
+
+        InterpreterScope scope(std::move(state));
+
         callback(interpreter_info);
     };
+
+    interpreter_states.retain(interp_ids);
 }
@@ -0,0 +1,164 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#if defined PL_LINUX
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+// The system call that a thread is blocked in, as reported by the kernel in
+// /proc/self/task/<tid>/syscall. We keep the file open, so that reading it
+// again, e.g. on every tick, costs a single system call.
+class KernelState
+{
+public:
+    // The number of the system call that the thread is blocked in, or -1 if
+    // the thread is running, or blocked outside of a system call.
+    long syscall_nr = -1;
+    uintptr_t args[6] = {0};
+
+    KernelState() = default;
+
+    ~KernelState()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    KernelState(const KernelState&) = delete;
+    KernelState& operator=(const KernelState&) = delete;
+
+    // ------------------------------------------------------------------------
+    // Read the current state of the thread with the given native ID.
+    bool update(pid_t tid)
+    {
+        syscall_nr = -1;
+
+        if (fd < 0)
+        {
+            char path[64];
+            std::snprintf(path, sizeof(path), "/proc/self/task/%d/syscall", tid);
+
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+        }
+
+        char buffer[256];
+        auto n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+        if (n <= 0)
+            return false;
+        buffer[n] = '\0';
+
+        // The content is either "running", or "-1 <sp> <pc>" when the thread
+        // is blocked outside of a system call, or the number and the six
+        // arguments of the system call, followed by the stack and program
+        // counters.
+        if (buffer[0] == 'r')
+            return true;
+
+        char* p = buffer;
+        syscall_nr = std::strtol(p, &p, 10);
+        if (syscall_nr >= 0)
+        {
+            for (auto& arg : args)
+                arg = std::strtoull(p, &p, 16);
+        }
+
+        return true;
+    }
+
+    // ------------------------------------------------------------------------
+    // Whether the thread is waiting on a futex within the given range, e.g.
+    // the condition variable or the mutex of a lock.
+    bool waits_on(uintptr_t start, size_t size) const
+    {
+        return syscall_nr == SYS_futex && args[0] - start < size;
+    }
+
+    // ------------------------------------------------------------------------
+    // The pseudo-frame name of the system call that the thread is blocked in,
+    // or nullptr if it is not blocked in one. We only name the calls that
+    // threads commonly block in, so that the profile tells e.g. I/O from locks
+    // and sleeps apart. The names are literals, so their addresses can be used
+    // as string keys.
+    const char* blocking_call() const
+    {
+#define BLOCKING_CALL(name) \
+    case SYS_##name:        \
+        return ":" #name ":";
+
+        if (syscall_nr < 0)
+            return nullptr;
+
+        switch (syscall_nr)
+        {
+            // I/O
+            BLOCKING_CALL(read)
+            BLOCKING_CALL(write)
+            BLOCKING_CALL(readv)
+            BLOCKING_CALL(writev)
+            BLOCKING_CALL(pread64)
+            BLOCKING_CALL(pwrite64)
+            BLOCKING_CALL(openat)
+            BLOCKING_CALL(fsync)
+            BLOCKING_CALL(fdatasync)
+            BLOCKING_CALL(flock)
+#ifdef SYS_recvfrom
+            BLOCKING_CALL(recvfrom)
+            BLOCKING_CALL(recvmsg)
+            BLOCKING_CALL(sendto)
+            BLOCKING_CALL(sendmsg)
+            BLOCKING_CALL(accept4)
+            BLOCKING_CALL(connect)
+#endif
+#ifdef SYS_accept
+            BLOCKING_CALL(accept)
+#endif
+
+            // Multiplexing
+#ifdef SYS_poll
+            BLOCKING_CALL(poll)
+#endif
+#ifdef SYS_select
+            BLOCKING_CALL(select)
+#endif
+#ifdef SYS_epoll_wait
+            BLOCKING_CALL(epoll_wait)
+#endif
+            BLOCKING_CALL(ppoll)
+            BLOCKING_CALL(pselect6)
+            BLOCKING_CALL(epoll_pwait)
+
+            // Locks, sleeps and waits
+            BLOCKING_CALL(futex)
+            BLOCKING_CALL(nanosleep)
+            BLOCKING_CALL(clock_nanosleep)
+            BLOCKING_CALL(wait4)
+            BLOCKING_CALL(waitid)
+            BLOCKING_CALL(rt_sigtimedwait)
+            BLOCKING_CALL(rt_sigsuspend)
+#ifdef SYS_pause
+            BLOCKING_CALL(pause)
+#endif
+
+        default:
+            return ":syscall:";
+        }
+
+#undef BLOCKING_CALL
+    }
+
+private:
+    int fd = -1;
+};
+#endif
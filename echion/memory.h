@@ -12,6 +12,7 @@
 #include <sys/resource.h>
 
 #include <echion/config.h>
+#include <echion/footprint.h>
 #include <echion/interp.h>
 #include <echion/mojo.h>
 #include <echion/stacks.h>
@@ -62,20 +63,27 @@ public:
     size_t count;
     ssize_t size;
 
+    // The number of allocations made with this stack that are still tracked.
+    size_t live;
+
     // ------------------------------------------------------------------------
     MemoryStats(int iid, std::string thread_name, FrameStack::Key stack, size_t count, size_t size)
-        : iid(iid), thread_name(thread_name), stack(stack), count(count), size(size)
+        : iid(iid), thread_name(thread_name), stack(stack), count(count), size(size), live(count)
     {
     }
 
     // ------------------------------------------------------------------------
-    void inline render()
+    void inline render(RendererInterface& renderer)
     {
-        Renderer::get().render_stack_begin(pid, iid, thread_name);
+        auto maybe_stack = stack_table.retrieve(stack);
+        if (!maybe_stack)
+            return;
+
+        renderer.render_stack_begin(pid, iid, thread_name);
 
-        stack_table.retrieve(stack).render();
+        maybe_stack->get().render(renderer);
 
-        Renderer::get().render_stack_end(MetricType::Memory, size);
+        renderer.render_stack_end(MetricType::Memory, size);
     }
 };
 
@@ -115,6 +123,24 @@ public:
         return {};
     }
 
+    // ------------------------------------------------------------------------
+    size_t footprint()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        return hash_footprint(*this);
+    }
+
+    // ------------------------------------------------------------------------
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        // Release the buckets too.
+        std::unordered_map<void*, MemoryTableEntry> empty;
+        this->swap(empty);
+    }
+
 private:
     std::mutex lock;
 };
@@ -136,18 +162,23 @@ public:
                 // Invalid thread state, nothing we can do.
                 return;
 
-            std::lock_guard<std::mutex> ti_lock(thread_info_map_lock);
+            auto threads = thread_registry.read();
+
+            auto* thread_info = threads->find(tstate->thread_id);
+            if (thread_info == nullptr)
+                // Untracked thread, nothing we can do.
+                return;
 
             // Map the memory address with the stack so that we can account for
             // the deallocations.
             map.emplace(stack,
-                        MemoryStats(tstate->interp->id, thread_info_map[tstate->thread_id]->name,
-                                    stack, 1, size));
+                        MemoryStats(tstate->interp->id, thread_info->name, stack, 1, size));
         }
         else
         {
             stack_entry->second.count++;
             stack_entry->second.size += size;
+            stack_entry->second.live++;
         }
     }
 
@@ -159,7 +190,11 @@ public:
         auto stack_entry = map.find(entry.stack);
 
         if (stack_entry != map.end())
+        {
             stack_entry->second.size -= entry.size;
+            if (stack_entry->second.live > 0)
+                stack_entry->second.live--;
+        }
     }
 
     // ------------------------------------------------------------------------
@@ -167,11 +202,13 @@ public:
     {
         std::lock_guard<std::mutex> lock(this->lock);
 
+        auto renderer = Renderer::get().active();
+
         for (auto& entry : map)
         {
             // Emit non-trivial stack stats only
             if (entry.second.size != 0)
-                entry.second.render();
+                entry.second.render(*renderer);
 
             // Reset the stats
             entry.second.size = 0;
@@ -179,6 +216,44 @@ public:
         }
     }
 
+    // ------------------------------------------------------------------------
+    // Drop the stacks that have neither live allocations nor stats left to
+    // report, together with their entries in the stack table.
+    void prune()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        for (auto it = map.begin(); it != map.end();)
+        {
+            if (it->second.live == 0 && it->second.size == 0)
+                it = map.erase(it);
+            else
+                ++it;
+        }
+        map.rehash(0);
+
+        stack_table.retain(map);
+    }
+
+    // ------------------------------------------------------------------------
+    // Stop expecting the deallocation of the allocations made so far, e.g.
+    // once they are no longer tracked in the memory table.
+    void forget()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        for (auto& entry : map)
+            entry.second.live = 0;
+    }
+
+    // ------------------------------------------------------------------------
+    size_t footprint()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        return hash_footprint(map);
+    }
+
     // ------------------------------------------------------------------------
     void clear()
     {
@@ -203,16 +278,27 @@ inline auto& memory_table = *(new MemoryTable());
 // ----------------------------------------------------------------------------
 static inline void general_alloc(void* address, size_t size)
 {
+    // Unwinding might allocate memory itself (e.g. when we ask for the UTF-8
+    // representation of a string). These allocations are not for us to track,
+    // and we would deadlock on the lock of the interpreter state if we did.
+    static thread_local bool unwinding = false;
+    if (unwinding)
+        return;
+
     auto stack = std::make_unique<FrameStack>();
     auto* tstate = PyThreadState_Get();  // DEV: This should be called with the GIL held
 
+    InterpreterScope scope(interpreter_states.get_cached(tstate->interp->id));
+
     // DEV: We unwind the stack by reading the data out of live Python objects.
     // This works under the assumption that the objects/data structures we are
     // interested in belong to the thread whose stack we are unwinding.
     // Therefore, we expect these structures to remain valid and essentially
     // immutable for the duration of the unwinding process, which happens
     // in-line with the allocation within the calling thread.
+    unwinding = true;
     unwind_python_stack_unsafe(tstate, *stack);
+    unwinding = false;
 
     // Store the stack and get its key for reference
     // TODO: Handle collision exception
@@ -54,6 +54,7 @@ typedef PyObject* PyDictValues;
 
 #include <unordered_set>
 
+#include <echion/tick_reads.h>
 #include <echion/vm.h>
 
 constexpr ssize_t MAX_MIRROR_SIZE = 1 << 20; // 1 MiB
@@ -166,7 +167,7 @@ private:
 {
     PySetObject set;
 
-    if (copy_type(set_addr, set))
+    if (copy_type_tick(set_addr, set))
     {
         return ErrorKind::MirrorError;
     }
@@ -179,7 +180,7 @@ private:
     }
 
     auto data = std::make_unique<char[]>(table_size);
-    if (copy_generic(set.table, data.get(), table_size))
+    if (copy_generic_tick(set.table, data.get(), table_size))
     {
         return ErrorKind::MirrorError;
     }
@@ -0,0 +1,317 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// A minimal encoder of protobuf messages, with just what we need to write the
+// pprof profile.proto format.
+class ProtobufMessage
+{
+public:
+    enum WireType
+    {
+        VARINT = 0,
+        LEN = 2,
+    };
+
+    // ------------------------------------------------------------------------
+    void inline varint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(static_cast<char>(value));
+    }
+
+    // ------------------------------------------------------------------------
+    void inline tag(uint32_t field, WireType type)
+    {
+        varint((static_cast<uint64_t>(field) << 3) | type);
+    }
+
+    // ------------------------------------------------------------------------
+    // Fields with the default value are not encoded, as per proto3.
+    void inline integer(uint32_t field, int64_t value)
+    {
+        if (value == 0)
+            return;
+
+        tag(field, VARINT);
+        varint(static_cast<uint64_t>(value));
+    }
+
+    // ------------------------------------------------------------------------
+    void inline bytes(uint32_t field, std::string_view value)
+    {
+        tag(field, LEN);
+        varint(value.size());
+        buffer.append(value.data(), value.size());
+    }
+
+    // ------------------------------------------------------------------------
+    void inline message(uint32_t field, const ProtobufMessage& message)
+    {
+        bytes(field, message.buffer);
+    }
+
+    // ------------------------------------------------------------------------
+    template <typename T>
+    void packed(uint32_t field, const std::vector<T>& values)
+    {
+        if (values.empty())
+            return;
+
+        ProtobufMessage packed;
+        for (auto value : values)
+            packed.varint(static_cast<uint64_t>(value));
+
+        message(field, packed);
+    }
+
+    // ------------------------------------------------------------------------
+    const std::string& data() const
+    {
+        return buffer;
+    }
+
+private:
+    std::string buffer;
+};
+
+// ----------------------------------------------------------------------------
+// Collects the samples of a profile in the pprof format. Strings, functions and
+// locations are deduplicated, and samples with the same stack and labels are
+// aggregated, so the profile is only as big as the number of distinct stacks.
+class PprofProfile
+{
+public:
+    using Id = uint64_t;
+
+    PprofProfile()
+    {
+        clear();
+    }
+
+    // ------------------------------------------------------------------------
+    int64_t string(std::string_view value)
+    {
+        auto it = string_index.find(std::string(value));
+        if (it != string_index.end())
+            return it->second;
+
+        int64_t index = strings.size();
+        strings.emplace_back(value);
+        string_index.emplace(strings.back(), index);
+
+        return index;
+    }
+
+    // ------------------------------------------------------------------------
+    Id function(int64_t name, int64_t filename)
+    {
+        auto key = std::make_pair(name, filename);
+
+        auto it = function_index.find(key);
+        if (it != function_index.end())
+            return it->second;
+
+        Id id = functions.size() + 1;
+        functions.push_back(key);
+        function_index.emplace(key, id);
+
+        return id;
+    }
+
+    // ------------------------------------------------------------------------
+    Id location(Id function, int64_t line)
+    {
+        auto key = std::make_pair(static_cast<int64_t>(function), line);
+
+        auto it = location_index.find(key);
+        if (it != location_index.end())
+            return it->second;
+
+        Id id = locations.size() + 1;
+        locations.push_back(key);
+        location_index.emplace(key, id);
+
+        return id;
+    }
+
+    // ------------------------------------------------------------------------
+    void sample_type(std::string_view type, std::string_view unit)
+    {
+        sample_types.emplace_back(string(type), string(unit));
+    }
+
+    // ------------------------------------------------------------------------
+    // The locations go from the leaf to the root, the thread is the string
+    // index of the thread name, and the values match the sample types.
+    void sample(const std::vector<Id>& stack, int64_t thread, const std::vector<int64_t>& values)
+    {
+        auto& totals = samples[std::make_pair(stack, thread)];
+
+        totals.resize(values.size());
+        for (size_t i = 0; i < values.size(); i++)
+            totals[i] += values[i];
+    }
+
+    // ------------------------------------------------------------------------
+    void comment(std::string_view value)
+    {
+        comments.push_back(string(value));
+    }
+
+    // ------------------------------------------------------------------------
+    void period(std::string_view type, std::string_view unit, int64_t value)
+    {
+        period_type = std::make_pair(string(type), string(unit));
+        period_value = value;
+    }
+
+    // ------------------------------------------------------------------------
+    void time(int64_t start_nanos, int64_t duration_nanos)
+    {
+        time_nanos = start_nanos;
+        this->duration_nanos = duration_nanos;
+    }
+
+    // ------------------------------------------------------------------------
+    void clear()
+    {
+        strings.clear();
+        string_index.clear();
+        functions.clear();
+        function_index.clear();
+        locations.clear();
+        location_index.clear();
+        sample_types.clear();
+        samples.clear();
+        comments.clear();
+        period_type = {0, 0};
+        period_value = time_nanos = duration_nanos = 0;
+
+        // The first string of the table must be the empty string.
+        string("");
+        thread_label = string("thread");
+    }
+
+    // ------------------------------------------------------------------------
+    std::string encode() const
+    {
+        ProtobufMessage profile;
+
+        for (auto& [type, unit] : sample_types)
+            profile.message(1, value_type(type, unit));
+
+        for (auto& [key, values] : samples)
+        {
+            ProtobufMessage sample;
+            sample.packed(1, key.first);
+            sample.packed(2, values);
+
+            ProtobufMessage label;
+            label.integer(1, thread_label);
+            label.integer(2, key.second);
+            sample.message(3, label);
+
+            profile.message(2, sample);
+        }
+
+        for (size_t i = 0; i < locations.size(); i++)
+        {
+            ProtobufMessage line;
+            line.integer(1, locations[i].first);
+            line.integer(2, locations[i].second);
+
+            ProtobufMessage location;
+            location.integer(1, i + 1);
+            location.message(4, line);
+
+            profile.message(4, location);
+        }
+
+        for (size_t i = 0; i < functions.size(); i++)
+        {
+            ProtobufMessage function;
+            function.integer(1, i + 1);
+            function.integer(2, functions[i].first);
+            function.integer(3, functions[i].first);
+            function.integer(4, functions[i].second);
+
+            profile.message(5, function);
+        }
+
+        for (auto& string : strings)
+            profile.bytes(6, string);
+
+        profile.integer(9, time_nanos);
+        profile.integer(10, duration_nanos);
+        profile.message(11, value_type(period_type.first, period_type.second));
+        profile.integer(12, period_value);
+        profile.packed(13, comments);
+
+        return profile.data();
+    }
+
+private:
+    // ------------------------------------------------------------------------
+    struct PairHash
+    {
+        size_t operator()(const std::pair<int64_t, int64_t>& pair) const
+        {
+            return std::hash<int64_t>()(pair.first) ^ (std::hash<int64_t>()(pair.second) << 1);
+        }
+    };
+
+    // ------------------------------------------------------------------------
+    struct SampleHash
+    {
+        size_t operator()(const std::pair<std::vector<Id>, int64_t>& key) const
+        {
+            size_t hash = std::hash<int64_t>()(key.second);
+            for (auto id : key.first)
+                hash = hash * 31 + id;
+
+            return hash;
+        }
+    };
+
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, int64_t> string_index;
+    std::vector<std::pair<int64_t, int64_t>> functions;
+    std::unordered_map<std::pair<int64_t, int64_t>, Id, PairHash> function_index;
+    std::vector<std::pair<int64_t, int64_t>> locations;
+    std::unordered_map<std::pair<int64_t, int64_t>, Id, PairHash> location_index;
+    std::vector<std::pair<int64_t, int64_t>> sample_types;
+    std::unordered_map<std::pair<std::vector<Id>, int64_t>, std::vector<int64_t>, SampleHash>
+        samples;
+    std::vector<int64_t> comments;
+    std::pair<int64_t, int64_t> period_type;
+    int64_t period_value, time_nanos, duration_nanos;
+
+    // The label key of the thread names of the samples.
+    int64_t thread_label;
+
+    // ------------------------------------------------------------------------
+    static ProtobufMessage value_type(int64_t type, int64_t unit)
+    {
+        ProtobufMessage message;
+        message.integer(1, type);
+        message.integer(2, unit);
+
+        return message;
+    }
+};
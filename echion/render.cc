@@ -1,5 +1,12 @@
 #include <echion/frame.h>
 #include <echion/render.h>
+#include <echion/stacks.h>
+
+// ------------------------------------------------------------------------
+void RendererInterface::render_stack(FrameStack& stack)
+{
+    stack.visit([this](Frame& frame) { render_frame(frame); });
+}
 
 // ------------------------------------------------------------------------
 void WhereRenderer::render_frame(Frame& frame)
@@ -10,7 +17,7 @@ void WhereRenderer::render_frame(Frame& frame)
         std::cerr << "could not get name for render_frame" << std::endl;
         return;
     }
-    const auto& name_str = maybe_name_str->get();
+    auto name_str = std::string(*maybe_name_str);
 
 
     auto maybe_filename_str = string_table.lookup(frame.filename);
@@ -19,7 +26,7 @@ void WhereRenderer::render_frame(Frame& frame)
         std::cerr << "could not get filename for render_frame" << std::endl;
         return;
     }
-    const auto& filename_str = maybe_filename_str->get();
+    auto filename_str = std::string(*maybe_filename_str);
 
     auto line = frame.location.line;
 
@@ -42,3 +49,35 @@ void MojoRenderer::render_frame(Frame& frame)
 {
     frame_ref(frame.cache_key);
 }
+
+// ------------------------------------------------------------------------
+void MojoRenderer::render_stack(FrameStack& stack)
+{
+    auto guard = this->guard();
+
+    stack.visit([this](Frame& frame) { reference_frame(frame.cache_key); });
+}
+
+// ------------------------------------------------------------------------
+void PprofRenderer::render_frame(Frame& frame)
+{
+    frame_ref(frame.cache_key);
+}
+
+// ------------------------------------------------------------------------
+void PprofRenderer::render_stack(FrameStack& stack)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    stack.visit([this](Frame& frame) { push_location(frame.cache_key); });
+}
+
+// ------------------------------------------------------------------------
+void CollapsedRenderer::render_frame(Frame& frame)
+{
+    auto maybe_name = string_table.lookup(frame.name);
+
+    // Stacks are folded by the names that we write out, so that the frames
+    // that only differ by their line number end up on the same line.
+    push_frame(maybe_name ? *maybe_name : std::string_view("<unknown>"));
+}
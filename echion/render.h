@@ -4,22 +4,39 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <ostream>
+#include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include <echion/config.h>
 #include <echion/errors.h>
 #include <echion/mojo.h>
+#include <echion/pprof.h>
 #include <echion/timing.h>
 
 #include <Python.h>
 
-// Forward declaration
+// Forward declarations
 class Frame;
+class FrameStack;
 
 enum MetricType
 {
@@ -72,6 +89,40 @@ public:
     virtual void render_cpu_time(uint64_t cpu_time) = 0;
     virtual void render_stack_end(MetricType metric_type, uint64_t delta) = 0;
 
+    // Called after the frames of a Stack, before render_stack_end, to mark
+    // the samples taken while the thread was running the garbage collector,
+    // or while it was not running at all.
+    virtual void render_gc() {}
+    virtual void render_idle() {}
+
+    // Called with all the frames of a Stack, from the root to the leaf,
+    // between render_stack_begin and render_stack_end. By default, this calls
+    // render_frame on each frame, but renderers can serialize the whole stack
+    // in one pass instead.
+    virtual void render_stack(FrameStack& stack);
+
+    // Renderers that can take stacks from several sampler workers at once
+    // collect the events that the calling thread emits between these calls,
+    // and write them out in one go at the end of the batch. Renderers that
+    // return false are called by one worker at a time instead.
+    virtual bool begin_batch()
+    {
+        return false;
+    }
+    virtual void end_batch() {}
+
+    // Renderers that keep the strings and frames rendered so far, e.g. to
+    // start new outputs with them, drop them when the string table starts
+    // over. All the strings and frames are rendered again before they are
+    // referred to.
+    virtual void forget() {}
+
+    // The memory that the renderer uses to keep the strings and frames.
+    virtual size_t footprint()
+    {
+        return 0;
+    }
+
     // The validity of the interface is a two-step process
     // 1. If the RendererInterface has been destroyed, obviously it's invalid
     // 2. There might be state behind RendererInterface, and the lifetime of that
@@ -155,326 +206,1603 @@ public:
     }
 };
 
-class MojoRenderer : public RendererInterface
+// ----------------------------------------------------------------------------
+// Compresses a stream into frames that are gzip members of their own. The
+// concatenation of the frames is a valid gzip file, a reader can start from
+// any frame, and a truncated file can be decompressed up to its last complete
+// frame.
+class GzipFrames
 {
-    std::ofstream output;
-    std::mutex lock;
-    uint64_t metric = 0;
+public:
+    // The uncompressed data of the current frame
+    std::string buffer;
 
-    void inline event(MojoEvent event)
+    GzipFrames()
     {
-        output.put(static_cast<char>(event));
+        std::memset(&stream, 0, sizeof(stream));
     }
-    void inline string(const std::string& string)
+
+    ~GzipFrames()
     {
-        output << string << '\0';
+        if (initialized)
+            deflateEnd(&stream);
     }
-    void inline string(const char* string)
+
+    GzipFrames(const GzipFrames&) = delete;
+    GzipFrames& operator=(const GzipFrames&) = delete;
+
+    // ------------------------------------------------------------------------
+    [[nodiscard]] Result<void> open()
     {
-        output << string << '\0';
+        buffer.clear();
+
+        if (initialized)
+            return Result<void>::ok();
+
+        // Fast compression does well enough on MOJO, which is mostly frame
+        // references.
+        if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return ErrorKind::RendererError;
+
+        initialized = true;
+
+        return Result<void>::ok();
     }
-    void inline ref(mojo_ref_t value)
+
+    // ------------------------------------------------------------------------
+    // Write the current frame out if it is big enough. This must only be
+    // called on event boundaries, so that every frame starts with an event.
+    template <typename Output>
+    void inline checkpoint(Output& output)
     {
-        integer(value);
+        if (buffer.size() >= FRAME_SIZE)
+            flush(output);
     }
-    void inline integer(mojo_int_t n)
+
+    // ------------------------------------------------------------------------
+    template <typename Output>
+    void flush(Output& output)
     {
-        mojo_uint_t integer = n < 0 ? -n : n;
-        bool sign = n < 0;
+        if (buffer.empty() || !initialized)
+            return;
 
-        unsigned char byte = integer & 0x3f;
-        if (sign)
-            byte |= 0x40;
+        deflateReset(&stream);
 
-        integer >>= 6;
-        if (integer)
-            byte |= 0x80;
+        compressed.resize(deflateBound(&stream, buffer.size()));
 
-        output.put(byte);
+        stream.next_in = reinterpret_cast<Bytef*>(buffer.data());
+        stream.avail_in = buffer.size();
+        stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+        stream.avail_out = compressed.size();
 
-        while (integer)
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END)
         {
-            byte = integer & 0x7f;
-            integer >>= 7;
-            if (integer)
-                byte |= 0x80;
-            output.put(byte);
+            output.write(compressed.data(), compressed.size() - stream.avail_out);
         }
+
+        buffer.clear();
     }
 
-public:
-    MojoRenderer() = default;
+private:
+    static constexpr size_t FRAME_SIZE = 256 << 10;
 
-    [[nodiscard]] Result<void> open() override
-    {
-        output.open(std::getenv("ECHION_OUTPUT"));
-        if (!output.is_open())
-        {
-            std::cerr << "Failed to open output file " << std::getenv("ECHION_OUTPUT") << std::endl;
-            return ErrorKind::RendererError;
-        }
+    z_stream stream;
+    bool initialized = false;
+    std::string compressed;
+};
 
-        return Result<void>::ok();
-    }
+// ----------------------------------------------------------------------------
+// Streams the output to a collector that listens on a Unix domain socket. The
+// data is sent without blocking, in between samples. If the collector does not
+// keep up, or goes away, we drop the connection and the data, and try to
+// connect again later on. A new connection is a new stream, which the renderer
+// must start over with the definitions that the events to come might need.
+class UnixSocketOutput
+{
+public:
+    // The data that is yet to be sent
+    std::string buffer;
 
-    // ------------------------------------------------------------------------
-    void close() override
-    {
-        std::lock_guard<std::mutex> guard(lock);
+    // Backpressure counters
+    size_t sent_bytes = 0;
+    size_t dropped_bytes = 0;
+    size_t stalls = 0;
+    size_t reconnects = 0;
 
-        output.flush();
-        output.close();
+    ~UnixSocketOutput()
+    {
+        disconnect();
     }
 
     // ------------------------------------------------------------------------
-    void inline header() override
+    [[nodiscard]] Result<void> open(std::string_view path)
     {
-        std::lock_guard<std::mutex> guard(lock);
+        this->path = path;
+        buffer.clear();
+        sent_bytes = dropped_bytes = stalls = reconnects = 0;
 
-        output << "MOJ";
-        integer(MOJO_VERSION);
-    }
+        // A path that does not fit in a socket address will never connect.
+        struct sockaddr_un address;
+        if (path.size() >= sizeof(address.sun_path))
+            return ErrorKind::RendererError;
 
-    // ------------------------------------------------------------------------
-    void inline metadata(const std::string& label, const std::string& value) override
-    {
-        std::lock_guard<std::mutex> guard(lock);
+        // The collector might not be listening yet. We treat this as if it
+        // went away, and keep trying to connect in between samples.
+        connect();
 
-        event(MOJO_METADATA);
-        string(label);
-        string(value);
+        return Result<void>::ok();
     }
 
     // ------------------------------------------------------------------------
-    void inline stack(mojo_int_t pid, mojo_int_t iid, const std::string& thread_name)
+    void inline write(const char* data, size_t size)
     {
-        std::lock_guard<std::mutex> guard(lock);
-
-        event(MOJO_STACK);
-        integer(pid);
-        integer(iid);
-        string(thread_name);
+        buffer.append(data, size);
     }
 
     // ------------------------------------------------------------------------
-    void inline frame(mojo_ref_t key, mojo_ref_t filename, mojo_ref_t name, mojo_int_t line,
-                      mojo_int_t line_end, mojo_int_t column, mojo_int_t column_end) override
+    // Whether the next checkpoint is going to send the buffer.
+    bool inline due() const
     {
-        std::lock_guard<std::mutex> guard(lock);
-
-        event(MOJO_FRAME);
-        ref(key);
-        ref(filename);
-        ref(name);
-        integer(line);
-        integer(line_end);
-        integer(column);
-        integer(column_end);
+        return fd >= 0 && (buffer.size() >= SEND_SIZE || gettime() - last_send >= SEND_INTERVAL);
     }
 
     // ------------------------------------------------------------------------
-    void inline frame_ref(mojo_ref_t key) override
+    // Send what we can without blocking. This must only be called in between
+    // samples. Returns true when a new stream has started, in which case the
+    // caller must emit the stream preamble before anything else.
+    [[nodiscard]] bool checkpoint()
     {
-        std::lock_guard<std::mutex> guard(lock);
+        auto now = gettime();
 
-        if (key == 0)
+        if (fd < 0)
         {
-            event(MOJO_FRAME_INVALID);
+            // Whatever we collect while disconnected is lost.
+            drop();
+
+            if (now - last_attempt < RECONNECT_INTERVAL || !connect())
+                return false;
+
+            reconnects++;
+
+            return true;
         }
-        else
+
+        if (buffer.size() < SEND_SIZE && now - last_send < SEND_INTERVAL)
+            return false;
+
+        send();
+        last_send = now;
+
+        if (buffer.size() > MAX_BUFFER_SIZE)
         {
-            event(MOJO_FRAME_REF);
-            ref(key);
+            // The collector is not keeping up with us.
+            disconnect();
+            drop();
         }
+
+        return false;
     }
 
     // ------------------------------------------------------------------------
-    void inline frame_kernel(const std::string& scope) override
+    void close()
     {
-        std::lock_guard<std::mutex> guard(lock);
+        if (fd >= 0)
+        {
+            // Give the collector a last chance to receive what is left.
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 
-        event(MOJO_FRAME_KERNEL);
-        string(scope);
-    }
+            struct timeval timeout = {1, 0};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-    // ------------------------------------------------------------------------
-    void inline metric_time(mojo_int_t value)
-    {
-        std::lock_guard<std::mutex> guard(lock);
+            send();
+        }
 
-        event(MOJO_METRIC_TIME);
-        integer(value);
+        disconnect();
+        drop();
     }
 
-    // ------------------------------------------------------------------------
-    void inline metric_memory(mojo_int_t value)
-    {
-        std::lock_guard<std::mutex> guard(lock);
+private:
+    static constexpr size_t SEND_SIZE = 64 << 10;
+    static constexpr size_t MAX_BUFFER_SIZE = 8 << 20;
+    static constexpr microsecond_t SEND_INTERVAL = 100000;       // 100 ms
+    static constexpr microsecond_t RECONNECT_INTERVAL = 1000000;  // 1 s
 
-        event(MOJO_METRIC_MEMORY);
-        integer(value);
-    }
+    std::string path;
+    int fd = -1;
+    microsecond_t last_send = 0;
+    microsecond_t last_attempt = 0;
 
     // ------------------------------------------------------------------------
-    void inline string(mojo_ref_t key, const std::string& value) override
+    bool connect()
     {
-        std::lock_guard<std::mutex> guard(lock);
+        last_attempt = gettime();
 
-        event(MOJO_STRING);
-        ref(key);
-        string(value);
+        struct sockaddr_un address = {};
+        if (path.size() >= sizeof(address.sun_path))
+            return false;
+
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.data(), path.size());
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return false;
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#if defined PL_DARWIN
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+        if (::connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            disconnect();
+            return false;
+        }
+
+        return true;
     }
 
     // ------------------------------------------------------------------------
-    void inline string_ref(mojo_ref_t key) override
+    void disconnect()
     {
-        std::lock_guard<std::mutex> guard(lock);
+        if (fd < 0)
+            return;
 
-        event(MOJO_STRING_REF);
-        ref(key);
+        ::close(fd);
+        fd = -1;
     }
 
-    void render_message(std::string_view) override{};
-    void render_thread_begin(PyThreadState*, std::string_view, microsecond_t, uintptr_t,
-                             unsigned long) override {};
-    void render_task_begin(std::string, bool) override {};
-    void render_stack_begin(long long pid, long long iid, const std::string& name) override
-    {
-        stack(pid, iid, name);
-    };
-    void render_frame(Frame& frame) override;
-    void render_cpu_time(uint64_t cpu_time) override
-    {
-        metric = cpu_time;
-    };
-    void render_stack_end(MetricType metric_type, uint64_t delta) override
-    {
-        if (metric_type == MetricType::Time)
-        {
-            metric_time(cpu ? metric : delta);
-        }
-        else if (metric_type == MetricType::Memory)
-        {
-            metric_memory(delta);
-        }
-    };
-    bool is_valid() override
+    // ------------------------------------------------------------------------
+    void drop()
     {
-        return true;
+        dropped_bytes += buffer.size();
+        buffer.clear();
     }
-};
-
-class Renderer
-{
-private:
-    std::shared_ptr<RendererInterface> default_renderer = std::make_shared<MojoRenderer>();
-    std::weak_ptr<RendererInterface> currentRenderer;
 
-    std::shared_ptr<RendererInterface> getActiveRenderer()
+    // ------------------------------------------------------------------------
+    void send()
     {
-        if (auto renderer = currentRenderer.lock())
+#if defined PL_DARWIN
+        const int flags = 0;
+#else
+        const int flags = MSG_NOSIGNAL;
+#endif
+        size_t offset = 0;
+        while (offset < buffer.size())
         {
-            if (renderer->is_valid())
+            auto n = ::send(fd, buffer.data() + offset, buffer.size() - offset, flags);
+            if (n < 0)
             {
-                return renderer;
+                if (errno == EINTR)
+                    continue;
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    stalls++;
+                else
+                    disconnect();
+
+                break;
             }
+
+            offset += n;
         }
-        return default_renderer;
-    }
 
-    Renderer() = default;
-    ~Renderer() = default;
+        sent_bytes += offset;
+        buffer.erase(0, offset);
+    }
+};
 
+// ----------------------------------------------------------------------------
+// Collects the output to a file in a buffer and writes it out in large chunks,
+// without going through the iostream machinery.
+class FileOutput
+{
 public:
-    Renderer(const Renderer&) = delete;
-    Renderer& operator=(const Renderer&) = delete;
+    // The data that is yet to be written
+    std::string buffer;
 
-    static Renderer& get()
+    ~FileOutput()
     {
-        static Renderer instance;
-        return instance;
+        close();
     }
 
-    void set_renderer(std::shared_ptr<RendererInterface> renderer)
+    // ------------------------------------------------------------------------
+    [[nodiscard]] Result<void> open(const std::string& path)
     {
-        currentRenderer = renderer;
-    }
+        close();
 
-    void header()
-    {
-        getActiveRenderer()->header();
-    }
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return ErrorKind::RendererError;
 
-    void metadata(const std::string& label, const std::string& value)
-    {
-        getActiveRenderer()->metadata(label, value);
-    }
+        written = 0;
+        buffer.clear();
+        buffer.reserve(WRITE_SIZE << 1);
 
-    void string(mojo_ref_t key, const std::string& value)
-    {
-        getActiveRenderer()->string(key, value);
+        return Result<void>::ok();
     }
 
-    void frame(mojo_ref_t key, mojo_ref_t filename, mojo_ref_t name, mojo_int_t line,
-               mojo_int_t line_end, mojo_int_t column, mojo_int_t column_end)
+    // ------------------------------------------------------------------------
+    void inline write(const char* data, size_t size)
     {
-        getActiveRenderer()->frame(key, filename, name, line, line_end, column, column_end);
+        buffer.append(data, size);
+        checkpoint();
     }
 
-    void frame_ref(mojo_ref_t key)
+    // ------------------------------------------------------------------------
+    // Write the buffer out if it is big enough.
+    void inline checkpoint()
     {
-        getActiveRenderer()->frame_ref(key);
+        if (buffer.size() >= WRITE_SIZE)
+            flush();
     }
 
-    void frame_kernel(const std::string& scope)
+    // ------------------------------------------------------------------------
+    // The size of the file, including the data that is yet to be written.
+    size_t inline size() const
     {
-        getActiveRenderer()->frame_kernel(scope);
+        return written + buffer.size();
     }
 
-    void string(mojo_ref_t key, const char* value)
+    // ------------------------------------------------------------------------
+    void flush()
     {
-        getActiveRenderer()->string(key, value);
-    }
+        size_t offset = 0;
+        while (fd >= 0 && offset < buffer.size())
+        {
+            auto n = ::write(fd, buffer.data() + offset, buffer.size() - offset);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
 
-    void string_ref(mojo_ref_t key)
-    {
-        getActiveRenderer()->string_ref(key);
-    }
+                // There is nothing better we can do with the data than to
+                // drop it.
+                break;
+            }
 
-    void render_message(std::string_view msg)
-    {
-        getActiveRenderer()->render_message(msg);
-    }
+            offset += n;
+        }
 
-    [[nodiscard]] Result<void> open()
-    {
-        return getActiveRenderer()->open();
+        written += offset;
+        buffer.clear();
     }
 
+    // ------------------------------------------------------------------------
     void close()
     {
-        getActiveRenderer()->close();
-    }
+        if (fd < 0)
+            return;
 
-    void render_thread_begin(PyThreadState* tstate, std::string_view name, microsecond_t cpu_time,
-                             uintptr_t thread_id, unsigned long native_id)
-    {
-        getActiveRenderer()->render_thread_begin(tstate, name, cpu_time, thread_id, native_id);
+        flush();
+
+        ::close(fd);
+        fd = -1;
     }
 
-    void render_task_begin(std::string task_name, bool on_cpu)
+private:
+    static constexpr size_t WRITE_SIZE = 64 << 10;
+
+    int fd = -1;
+    size_t written = 0;
+};
+
+// ----------------------------------------------------------------------------
+class MojoRenderer : public RendererInterface
+{
+    FileOutput output;
+    std::mutex lock;
+
+    // With compression, events are collected into frames instead of being
+    // written to the output directly.
+    GzipFrames gzip;
+    bool compress = false;
+
+    // Output to a collector, when the output is a unix:// address
+    UnixSocketOutput socket;
+    bool stream = false;
+
+    // Rotation of the output file to numbered chunks
+    std::string path;
+    unsigned int chunk = 0;
+    bool rotate = false;
+    microsecond_t chunk_start = 0;
+    microsecond_t last_rotation_check = 0;
+
+    static constexpr microsecond_t ROTATION_CHECK_INTERVAL = 10000;  // 10 ms
+
+    // Where the events that are not part of a batch go
+    std::string* target = &output.buffer;
+
+    // The latest metadata and the definitions emitted so far, for new streams
+    // and new chunks of the output file. These start with the metadata, and
+    // only get the definitions that they refer to, so that they can be decoded
+    // on their own. Each definition is marked with the number of the last
+    // stream, or chunk, that it was emitted to.
+    struct Definitions
+    {
+        template <typename T>
+        struct Entry
+        {
+            T value;
+            unsigned int chunk;
+        };
+
+        std::mutex lock;
+        std::vector<std::pair<std::string, std::string>> metadata;
+        std::unordered_map<mojo_ref_t, Entry<std::string>> strings;
+        std::unordered_map<mojo_ref_t, Entry<std::array<mojo_int_t, 6>>> frames;
+        size_t string_bytes = 0;
+
+        // The number of streams, or chunks, started so far
+        unsigned int chunk = 0;
+
+        void clear()
+        {
+            // Swap the maps out, so that they give their buckets back too.
+            decltype(strings)().swap(strings);
+            decltype(frames)().swap(frames);
+            string_bytes = 0;
+        }
+    } definitions;
+    bool retain = false;
+
+    // The events of the current batch of the calling thread, if any, and the
+    // CPU time metric of the stack that the thread is rendering.
+    static inline thread_local std::string* batch = nullptr;
+    static inline thread_local uint64_t metric = 0;
+
+    // The frames that the current batch refers to, and the chunk that it
+    // started in, for when it ends up in a later chunk.
+    static inline thread_local std::vector<mojo_ref_t> batch_refs;
+    static inline thread_local unsigned int batch_chunk = 0;
+
+    // Events that are part of a batch are not written to the output until the
+    // batch ends, so we only need to lock when there is no batch. Compressed
+    // frames end on event boundaries, so this is also where we write them out.
+    // Streams only start over in between samples, that is on the boundaries
+    // of the events that end a sample.
+    class EventGuard
+    {
+    public:
+        EventGuard(MojoRenderer& renderer, bool sample_boundary)
+            : renderer(renderer), sample_boundary(sample_boundary),
+              guard(renderer.lock, std::defer_lock)
+        {
+            if (batch == nullptr)
+                guard.lock();
+        }
+
+        ~EventGuard()
+        {
+            if (guard.owns_lock())
+                renderer.checkpoint(sample_boundary);
+        }
+
+    private:
+        MojoRenderer& renderer;
+        bool sample_boundary;
+        std::unique_lock<std::mutex> guard;
+    };
+
+    EventGuard inline guard(bool sample_boundary = false)
+    {
+        return EventGuard(*this, sample_boundary);
+    }
+
+    void inline put(char c)
+    {
+        (batch != nullptr ? batch : target)->push_back(c);
+    }
+    void inline write(const char* data, size_t size)
+    {
+        (batch != nullptr ? batch : target)->append(data, size);
+    }
+
+    // ------------------------------------------------------------------------
+    void checkpoint(bool sample_boundary)
+    {
+        if (compress)
+        {
+            // Compressed data reaches the socket one frame at a time, so we
+            // cut the current frame short when it is time to send.
+            if (stream && sample_boundary && socket.due())
+                gzip.flush(socket);
+            else if (stream)
+                gzip.checkpoint(socket);
+            else
+                gzip.checkpoint(output);
+        }
+        else if (!stream)
+        {
+            output.checkpoint();
+        }
+
+        if (!sample_boundary)
+            return;
+
+        if (stream)
+        {
+            if (socket.checkpoint())
+                preamble();
+        }
+        else if (rotate)
+        {
+            rotate_if_due();
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    // The path of the current chunk, with its number before the extensions of
+    // the output file name, if any.
+    std::string chunk_path() const
+    {
+        auto name = path.rfind('/');
+        auto extension = path.find('.', name == std::string::npos ? 1 : name + 2);
+        auto number = "." + std::to_string(chunk);
+
+        if (extension == std::string::npos)
+            return path + number;
+
+        return path.substr(0, extension) + number + path.substr(extension);
+    }
+
+    // ------------------------------------------------------------------------
+    void rotate_if_due()
+    {
+        auto now = gettime();
+        if (now - last_rotation_check < ROTATION_CHECK_INTERVAL)
+            return;
+
+        last_rotation_check = now;
+
+        if (!(output_rotation_interval && now - chunk_start >= output_rotation_interval) &&
+            !(output_rotation_size && output.size() >= output_rotation_size))
+            return;
+
+        if (compress)
+            gzip.flush(output);
+
+        output.close();
+
+        chunk++;
+        chunk_start = now;
+
+        if (!output.open(chunk_path()))
+            std::cerr << "Failed to open output file " << chunk_path() << std::endl;
+
+        preamble();
+    }
+
+    // ------------------------------------------------------------------------
+    // Refer to a frame, with its definition first if the current stream, or
+    // chunk, does not have it yet.
+    void inline reference_frame(mojo_ref_t key)
+    {
+        if (key != 0 && retain)
+        {
+            std::lock_guard<std::mutex> guard(definitions.lock);
+
+            // A frame that we no longer know cannot be referred to.
+            if (!define_frame(key))
+                key = 0;
+            else if (batch != nullptr)
+                batch_refs.push_back(key);
+        }
+
+        if (key == 0)
+        {
+            event(MOJO_FRAME_INVALID);
+        }
+        else
+        {
+            event(MOJO_FRAME_REF);
+            ref(key);
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    void stream_stats()
+    {
+        event(MOJO_METADATA);
+        string("stream");
+        string("sent=" + std::to_string(socket.sent_bytes) +
+               ",dropped=" + std::to_string(socket.dropped_bytes) +
+               ",stalls=" + std::to_string(socket.stalls) +
+               ",reconnects=" + std::to_string(socket.reconnects));
+    }
+
+    // ------------------------------------------------------------------------
+    // Start a new stream, or chunk, with the header and the metadata. The
+    // definitions follow as the new stream, or chunk, refers to them.
+    void preamble()
+    {
+        gzip.buffer.clear();
+
+        write("MOJ", 3);
+        integer(MOJO_VERSION);
+
+        std::lock_guard<std::mutex> guard(definitions.lock);
+
+        definitions.chunk++;
+
+        for (auto& [label, value] : definitions.metadata)
+        {
+            event(MOJO_METADATA);
+            string(label);
+            string(value);
+        }
+
+        if (stream)
+            stream_stats();
+    }
+
+    // ------------------------------------------------------------------------
+    // Emit the definition of a string, unless the current stream, or chunk,
+    // already has it. Called with the definitions lock held.
+    void define_string(mojo_ref_t key)
+    {
+        auto entry = definitions.strings.find(key);
+        if (entry == definitions.strings.end() || entry->second.chunk == definitions.chunk)
+            return;
+
+        entry->second.chunk = definitions.chunk;
+
+        event(MOJO_STRING);
+        ref(key);
+        string(entry->second.value);
+    }
+
+    // ------------------------------------------------------------------------
+    // Emit the definition of a frame, and of its strings, unless the current
+    // stream, or chunk, already has them. Returns false if we do not know the
+    // frame. Called with the definitions lock held.
+    bool define_frame(mojo_ref_t key)
+    {
+        auto entry = definitions.frames.find(key);
+        if (entry == definitions.frames.end())
+            return false;
+
+        if (entry->second.chunk == definitions.chunk)
+            return true;
+
+        entry->second.chunk = definitions.chunk;
+
+        auto& frame = entry->second.value;
+        define_string(static_cast<mojo_ref_t>(frame[0]));
+        define_string(static_cast<mojo_ref_t>(frame[1]));
+
+        event(MOJO_FRAME);
+        ref(key);
+        for (auto value : frame)
+            integer(value);
+
+        return true;
+    }
+
+    void inline event(MojoEvent event)
+    {
+        put(static_cast<char>(event));
+    }
+    void inline string(const std::string& string)
+    {
+        write(string.data(), string.size());
+        put('\0');
+    }
+    void inline string(const char* string)
+    {
+        write(string, std::strlen(string));
+        put('\0');
+    }
+    void inline ref(mojo_ref_t value)
+    {
+        integer(value);
+    }
+    void inline integer(mojo_int_t n)
+    {
+        // Encode into a local buffer, so that we append to the output once per
+        // integer rather than once per byte. The first byte has 6 bits of the
+        // value, and every other byte 7, so we need at most 10 bytes.
+        char bytes[10];
+        size_t size = 0;
+
+        mojo_uint_t integer = n < 0 ? -n : n;
+
+        unsigned char byte = (integer & 0x3f) | (n < 0 ? 0x40 : 0);
+        integer >>= 6;
+
+        while (integer)
+        {
+            bytes[size++] = byte | 0x80;
+            byte = integer & 0x7f;
+            integer >>= 7;
+        }
+        bytes[size++] = byte;
+
+        write(bytes, size);
+    }
+
+public:
+    MojoRenderer() = default;
+
+    [[nodiscard]] Result<void> open() override
+    {
+        auto* output_env = std::getenv("ECHION_OUTPUT");
+        std::string_view destination = output_env != nullptr ? output_env : "";
+
+        stream = destination.rfind("unix://", 0) == 0;
+        if (stream)
+        {
+            if (!socket.open(destination.substr(7)))
+            {
+                std::cerr << "Invalid socket path " << destination << std::endl;
+                return ErrorKind::RendererError;
+            }
+        }
+        else
+        {
+            path = destination;
+            chunk = 0;
+            chunk_start = last_rotation_check = gettime();
+            rotate = output_rotation_interval || output_rotation_size;
+
+            if (!output.open(rotate ? chunk_path() : path))
+            {
+                std::cerr << "Failed to open output file " << destination << std::endl;
+                return ErrorKind::RendererError;
+            }
+        }
+
+        compress = output_compression == Compression::GZIP;
+        if (compress && !gzip.open())
+        {
+            std::cerr << "Failed to initialise the output compression" << std::endl;
+            return ErrorKind::RendererError;
+        }
+
+        target = compress ? &gzip.buffer : stream ? &socket.buffer : &output.buffer;
+
+        retain = stream || rotate;
+        {
+            std::lock_guard<std::mutex> guard(definitions.lock);
+
+            definitions.metadata.clear();
+            definitions.clear();
+            definitions.chunk = 0;
+        }
+
+        return Result<void>::ok();
+    }
+
+    // ------------------------------------------------------------------------
+    void close() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (stream)
+        {
+            stream_stats();
+
+            if (compress)
+                gzip.flush(socket);
+
+            socket.close();
+        }
+        else
+        {
+            if (compress)
+                gzip.flush(output);
+
+            output.close();
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    void inline header() override
+    {
+        auto guard = this->guard(true);
+
+        write("MOJ", 3);
+        integer(MOJO_VERSION);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline metadata(const std::string& label, const std::string& value) override
+    {
+        {
+            std::lock_guard<std::mutex> guard(definitions.lock);
+
+            // Only the latest value of each label is of use to new outputs.
+            auto entry = std::find_if(definitions.metadata.begin(), definitions.metadata.end(),
+                                      [&label](auto& item) { return item.first == label; });
+            if (entry != definitions.metadata.end())
+                entry->second = value;
+            else
+                definitions.metadata.emplace_back(label, value);
+        }
+
+        auto guard = this->guard(true);
+
+        event(MOJO_METADATA);
+        string(label);
+        string(value);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline stack(mojo_int_t pid, mojo_int_t iid, const std::string& thread_name)
+    {
+        auto guard = this->guard();
+
+        event(MOJO_STACK);
+        integer(pid);
+        integer(iid);
+        string(thread_name);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline frame(mojo_ref_t key, mojo_ref_t filename, mojo_ref_t name, mojo_int_t line,
+                      mojo_int_t line_end, mojo_int_t column, mojo_int_t column_end) override
+    {
+        auto guard = this->guard();
+
+        if (retain)
+        {
+            std::lock_guard<std::mutex> definitions_guard(definitions.lock);
+
+            definitions.frames[key] = {{static_cast<mojo_int_t>(filename),
+                                        static_cast<mojo_int_t>(name), line, line_end, column,
+                                        column_end},
+                                       definitions.chunk};
+
+            // The strings might have been emitted to an earlier chunk only.
+            define_string(filename);
+            define_string(name);
+        }
+
+        event(MOJO_FRAME);
+        ref(key);
+        ref(filename);
+        ref(name);
+        integer(line);
+        integer(line_end);
+        integer(column);
+        integer(column_end);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline frame_ref(mojo_ref_t key) override
+    {
+        auto guard = this->guard();
+
+        reference_frame(key);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline frame_kernel(const std::string& scope) override
+    {
+        auto guard = this->guard();
+
+        event(MOJO_FRAME_KERNEL);
+        string(scope);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline render_gc() override
+    {
+        auto guard = this->guard();
+
+        event(MOJO_GC);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline render_idle() override
+    {
+        auto guard = this->guard();
+
+        event(MOJO_IDLE);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline metric_time(mojo_int_t value)
+    {
+        auto guard = this->guard(true);
+
+        event(MOJO_METRIC_TIME);
+        integer(value);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline metric_memory(mojo_int_t value)
+    {
+        auto guard = this->guard(true);
+
+        event(MOJO_METRIC_MEMORY);
+        integer(value);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline string(mojo_ref_t key, const std::string& value) override
+    {
+        // The string table is shared by all the sampler workers, so strings
+        // are never batched. This way they are written out before any batch
+        // that refers to them.
+        auto* current_batch = batch;
+        batch = nullptr;
+
+        if (retain)
+        {
+            std::lock_guard<std::mutex> guard(definitions.lock);
+
+            auto& entry = definitions.strings[key];
+            definitions.string_bytes += value.size();
+            definitions.string_bytes -= entry.value.size();
+            entry = {value, definitions.chunk};
+        }
+
+        {
+            auto guard = this->guard();
+
+            event(MOJO_STRING);
+            ref(key);
+            string(value);
+        }
+
+        batch = current_batch;
+    }
+
+    // ------------------------------------------------------------------------
+    void inline string_ref(mojo_ref_t key) override
+    {
+        auto guard = this->guard();
+
+        event(MOJO_STRING_REF);
+        ref(key);
+    }
+
+    void render_message(std::string_view) override{};
+    void render_thread_begin(PyThreadState*, std::string_view, microsecond_t, uintptr_t,
+                             unsigned long) override {};
+    void render_task_begin(std::string, bool) override {};
+    void render_stack_begin(long long pid, long long iid, const std::string& name) override
+    {
+        stack(pid, iid, name);
+    };
+    void render_frame(Frame& frame) override;
+    void render_stack(FrameStack& stack) override;
+    void render_cpu_time(uint64_t cpu_time) override
+    {
+        metric = cpu_time;
+    };
+    void render_stack_end(MetricType metric_type, uint64_t delta) override
+    {
+        if (metric_type == MetricType::Time)
+        {
+            metric_time(cpu ? metric : delta);
+        }
+        else if (metric_type == MetricType::Memory)
+        {
+            metric_memory(delta);
+        }
+    };
+    bool begin_batch() override
+    {
+        static thread_local std::string buffer;
+
+        buffer.clear();
+        batch = &buffer;
+
+        if (retain)
+        {
+            std::lock_guard<std::mutex> guard(definitions.lock);
+
+            batch_refs.clear();
+            batch_chunk = definitions.chunk;
+        }
+
+        return true;
+    }
+    void end_batch() override
+    {
+        if (batch == nullptr)
+            return;
+
+        auto* buffer = batch;
+        batch = nullptr;
+
+        auto guard = this->guard(true);
+
+        // The batch has skipped the definitions that the chunk that it started
+        // in already had, so a new chunk needs them first.
+        if (retain)
+        {
+            std::lock_guard<std::mutex> definitions_guard(definitions.lock);
+
+            if (batch_chunk != definitions.chunk)
+                for (auto key : batch_refs)
+                    define_frame(key);
+        }
+
+        write(buffer->data(), buffer->size());
+    }
+    void forget() override
+    {
+        std::lock_guard<std::mutex> guard(definitions.lock);
+
+        definitions.clear();
+    }
+    size_t footprint() override
+    {
+        std::lock_guard<std::mutex> guard(definitions.lock);
+
+        return definitions.string_bytes +
+               definitions.strings.size() * (sizeof(decltype(definitions.strings)::value_type) +
+                                             sizeof(void*)) +
+               definitions.frames.size() * (sizeof(decltype(definitions.frames)::value_type) +
+                                            sizeof(void*)) +
+               (definitions.strings.bucket_count() + definitions.frames.bucket_count()) *
+                   sizeof(void*);
+    }
+    bool is_valid() override
+    {
+        return true;
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Writes a gzip-compressed pprof profile. The samples are aggregated in memory
+// by stack and thread, and the profile is written out when the renderer is
+// closed.
+class PprofRenderer : public RendererInterface
+{
+    PprofProfile profile;
+    std::mutex lock;
+    gzFile output = nullptr;
+    bool memory_profile = false;
+    std::chrono::system_clock::time_point start_time;
+
+    // The profile string of each string, and the profile location of each
+    // frame, by their key.
+    std::unordered_map<mojo_ref_t, int64_t> strings;
+    std::unordered_map<mojo_ref_t, PprofProfile::Id> locations;
+
+    // The stack that the calling thread is rendering, from the root to the
+    // leaf, with its thread name and CPU time metric.
+    static inline thread_local std::vector<PprofProfile::Id> stack;
+    static inline thread_local int64_t thread = 0;
+    static inline thread_local uint64_t metric = 0;
+
+    // ------------------------------------------------------------------------
+    int64_t inline string_of(mojo_ref_t key)
+    {
+        auto it = strings.find(key);
+        return it != strings.end() ? it->second : profile.string("<unknown>");
+    }
+
+    // ------------------------------------------------------------------------
+    PprofProfile::Id inline location_of(std::string_view name, std::string_view filename)
+    {
+        return profile.location(profile.function(profile.string(name), profile.string(filename)),
+                                0);
+    }
+
+    // ------------------------------------------------------------------------
+    void inline push_location(mojo_ref_t key)
+    {
+        auto it = key != 0 ? locations.find(key) : locations.end();
+        stack.push_back(it != locations.end() ? it->second : location_of("<invalid>", ""));
+    }
+
+    // ------------------------------------------------------------------------
+    void reset()
+    {
+        profile.clear();
+        strings.clear();
+        locations.clear();
+    }
+
+public:
+    PprofRenderer() = default;
+
+    [[nodiscard]] Result<void> open() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto* path = std::getenv("ECHION_OUTPUT");
+        output = path != nullptr ? gzopen(path, "wb") : nullptr;
+        if (output == nullptr)
+        {
+            std::cerr << "Failed to open output file " << (path != nullptr ? path : "")
+                      << std::endl;
+            return ErrorKind::RendererError;
+        }
+
+        reset();
+
+        memory_profile = memory;
+        if (memory_profile)
+        {
+            profile.sample_type("memory", "bytes");
+        }
+        else
+        {
+            profile.sample_type("samples", "count");
+            profile.sample_type(cpu ? "cpu" : "wall", "microseconds");
+        }
+        profile.period(cpu ? "cpu" : "wall", "microseconds", interval);
+
+        start_time = std::chrono::system_clock::now();
+
+        return Result<void>::ok();
+    }
+
+    // ------------------------------------------------------------------------
+    void close() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (output == nullptr)
+            return;
+
+        auto end_time = std::chrono::system_clock::now();
+        profile.time(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         start_time.time_since_epoch())
+                         .count(),
+                     std::chrono::duration_cast<std::chrono::nanoseconds>(end_time - start_time)
+                         .count());
+
+        auto data = profile.encode();
+        if (gzwrite(output, data.data(), data.size()) != static_cast<int>(data.size()))
+            std::cerr << "Failed to write the pprof profile" << std::endl;
+
+        gzclose(output);
+        output = nullptr;
+
+        reset();
+    }
+
+    // ------------------------------------------------------------------------
+    void header() override {}
+
+    // ------------------------------------------------------------------------
+    void metadata(const std::string& label, const std::string& value) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        profile.comment(label + ": " + value);
+    }
+
+    // ------------------------------------------------------------------------
+    void frame(mojo_ref_t key, mojo_ref_t filename, mojo_ref_t name, mojo_int_t line, mojo_int_t,
+               mojo_int_t, mojo_int_t) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto function = profile.function(string_of(name), string_of(filename));
+        locations[key] = profile.location(function, line);
+    }
+
+    // ------------------------------------------------------------------------
+    void frame_ref(mojo_ref_t key) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        push_location(key);
+    }
+
+    // ------------------------------------------------------------------------
+    void frame_kernel(const std::string& scope) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        stack.push_back(location_of(scope, "kernel"));
+    }
+
+    // ------------------------------------------------------------------------
+    // The garbage collector and idle threads show as leaf frames of their own.
+    void render_gc() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        stack.push_back(location_of(":GC:", ""));
+    }
+
+    void render_idle() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        stack.push_back(location_of(":IDLE:", ""));
+    }
+
+    // ------------------------------------------------------------------------
+    void string(mojo_ref_t key, const std::string& value) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        strings[key] = profile.string(value);
+    }
+
+    // ------------------------------------------------------------------------
+    void string_ref(mojo_ref_t) override {}
+
+    void render_message(std::string_view) override {}
+    void render_thread_begin(PyThreadState*, std::string_view, microsecond_t, uintptr_t,
+                             unsigned long) override {}
+    void render_task_begin(std::string, bool) override {}
+    void render_stack_begin(long long, long long, const std::string& name) override
+    {
+        stack.clear();
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        thread = profile.string(name);
+    }
+    void render_frame(Frame& frame) override;
+    void render_stack(FrameStack& stack) override;
+    void render_cpu_time(uint64_t cpu_time) override
     {
-        getActiveRenderer()->render_task_begin(task_name, on_cpu);
+        metric = cpu_time;
     }
+    void render_stack_end(MetricType metric_type, uint64_t delta) override
+    {
+        // Samples without frames, like the one that we send on start, carry no
+        // information.
+        if (stack.empty())
+            return;
 
-    void render_stack_begin(long long pid, long long iid, const std::string& thread_name)
+        std::vector<PprofProfile::Id> leaf_first(stack.rbegin(), stack.rend());
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (metric_type == MetricType::Memory && memory_profile)
+        {
+            profile.sample(leaf_first, thread, {static_cast<int64_t>(delta)});
+        }
+        else if (metric_type == MetricType::Time && !memory_profile)
+        {
+            profile.sample(leaf_first, thread,
+                           {1, static_cast<int64_t>(cpu ? metric : delta)});
+        }
+    }
+
+    bool is_valid() override
     {
-        getActiveRenderer()->render_stack_begin(pid, iid, thread_name);
+        return true;
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Writes the stacks in the collapsed format of the flame graph tools, with a
+// line for each distinct stack and its total metric. The stacks are folded in
+// memory and written out when the renderer is closed.
+class CollapsedRenderer : public RendererInterface
+{
+    struct Key
+    {
+        // The thread name, followed by the task name, if any
+        std::string prefix;
+        uint64_t stack;
+
+        bool operator==(const Key& other) const
+        {
+            return stack == other.stack && prefix == other.prefix;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<std::string>()(key.prefix) ^ key.stack;
+        }
+    };
+
+    struct Folded
+    {
+        std::string frames;
+        int64_t metric = 0;
+    };
+
+    std::ofstream output;
+    std::mutex lock;
+
+    // Stacks whose hashes collide share a key, so each key has the list of
+    // the stacks that it stands for, told apart by their frames.
+    std::unordered_map<Key, std::vector<Folded>, KeyHash> stacks;
+
+    // The stack that the calling thread is rendering, from the root to the
+    // leaf, with its key, its thread and task names, and CPU time metric.
+    static inline thread_local std::vector<std::string_view> frames;
+    static inline thread_local std::deque<std::string> kernel_frames;
+    static inline thread_local uint64_t stack_key = 0;
+    static inline thread_local std::string thread;
+    static inline thread_local std::string task;
+    static inline thread_local uint64_t metric = 0;
+
+    // ------------------------------------------------------------------------
+    // Push a frame, keyed by the name that we write out for it.
+    void push_frame(std::string_view name)
+    {
+        frames.push_back(name);
+        stack_key = (stack_key * 0x100000001B3ULL) ^ std::hash<std::string_view>()(name);
+    }
+
+    // ------------------------------------------------------------------------
+    // Whether the folded frames are those of the stack that the calling thread
+    // is rendering.
+    static bool same_frames(const std::string& folded)
+    {
+        size_t offset = 0;
+        for (auto& name : frames)
+        {
+            if (offset > 0)
+            {
+                if (offset >= folded.size() || folded[offset] != ';')
+                    return false;
+                offset++;
+            }
+
+            if (folded.compare(offset, name.size(), name) != 0)
+                return false;
+            offset += name.size();
+        }
+
+        return offset == folded.size();
+    }
+
+public:
+    CollapsedRenderer() = default;
+
+    [[nodiscard]] Result<void> open() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto* path = std::getenv("ECHION_OUTPUT");
+        if (path != nullptr)
+            output.open(path);
+        if (!output.is_open())
+        {
+            std::cerr << "Failed to open output file " << (path != nullptr ? path : "")
+                      << std::endl;
+            return ErrorKind::RendererError;
+        }
+
+        stacks.clear();
+
+        return Result<void>::ok();
+    }
+
+    // ------------------------------------------------------------------------
+    void close() override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Only positive metrics make sense in a flame graph.
+        for (auto& [key, collisions] : stacks)
+        {
+            for (auto& folded : collisions)
+            {
+                if (folded.metric <= 0)
+                    continue;
+
+                output << key.prefix;
+                if (!folded.frames.empty())
+                    output << ';' << folded.frames;
+                output << ' ' << folded.metric << '\n';
+            }
+        }
+
+        output.close();
+        stacks.clear();
+    }
+
+    void header() override {}
+    void metadata(const std::string&, const std::string&) override {}
+    void frame(mojo_ref_t, mojo_ref_t, mojo_ref_t, mojo_int_t, mojo_int_t, mojo_int_t,
+               mojo_int_t) override {}
+    void frame_ref(mojo_ref_t) override {}
+    void string(mojo_ref_t, const std::string&) override {}
+    void string_ref(mojo_ref_t) override {}
+    void render_message(std::string_view) override {}
+    void render_thread_begin(PyThreadState*, std::string_view, microsecond_t, uintptr_t,
+                             unsigned long) override {}
+
+    // ------------------------------------------------------------------------
+    void frame_kernel(const std::string& scope) override
+    {
+        kernel_frames.push_back(scope);
+        push_frame(kernel_frames.back());
+    }
+
+    // ------------------------------------------------------------------------
+    // The garbage collector and idle threads show as leaf frames of their own.
+    void render_gc() override
+    {
+        push_frame(":GC:");
+    }
+
+    void render_idle() override
+    {
+        push_frame(":IDLE:");
+    }
+
+    // ------------------------------------------------------------------------
+    void render_task_begin(std::string task_name, bool) override
+    {
+        task = std::move(task_name);
+    }
+
+    // ------------------------------------------------------------------------
+    void render_stack_begin(long long, long long, const std::string& name) override
+    {
+        thread = name;
+        frames.clear();
+        kernel_frames.clear();
+        stack_key = 0;
+    }
+
+    void render_frame(Frame& frame) override;
+
+    void render_cpu_time(uint64_t cpu_time) override
+    {
+        metric = cpu_time;
+    }
+
+    // ------------------------------------------------------------------------
+    void render_stack_end(MetricType metric_type, uint64_t delta) override
+    {
+        Key key = {task.empty() ? thread : thread + ";" + task, stack_key};
+        task.clear();
+
+        auto value = static_cast<int64_t>(metric_type == MetricType::Time && cpu ? metric : delta);
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        auto& collisions = stacks[std::move(key)];
+
+        auto folded = std::find_if(collisions.begin(), collisions.end(),
+                                   [](auto& item) { return same_frames(item.frames); });
+        if (folded == collisions.end())
+        {
+            folded = collisions.emplace(collisions.end());
+            for (auto& name : frames)
+            {
+                if (!folded->frames.empty())
+                    folded->frames.push_back(';');
+                folded->frames.append(name);
+            }
+        }
+
+        folded->metric += value;
+    }
+
+    bool is_valid() override
+    {
+        return true;
+    }
+};
+
+class Renderer
+{
+private:
+    std::shared_ptr<RendererInterface> default_renderer = std::make_shared<MojoRenderer>();
+    std::weak_ptr<RendererInterface> currentRenderer;
+
+    std::shared_ptr<RendererInterface> getActiveRenderer()
+    {
+        if (auto renderer = currentRenderer.lock())
+        {
+            if (renderer->is_valid())
+            {
+                return renderer;
+            }
+        }
+        return default_renderer;
+    }
+
+    Renderer() = default;
+    ~Renderer() = default;
+
+public:
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    static Renderer& get()
+    {
+        static Renderer instance;
+        return instance;
+    }
+
+    void set_renderer(std::shared_ptr<RendererInterface> renderer)
+    {
+        currentRenderer = renderer;
+    }
+
+    // The renderer to use for the events of a whole sample. Resolving it once
+    // spares the lookup of the current renderer on every event.
+    std::shared_ptr<RendererInterface> active()
+    {
+        return getActiveRenderer();
+    }
+
+    // The renderer to use when no other renderer has been set, or the one that
+    // has been set is no longer valid.
+    void set_default_renderer(std::shared_ptr<RendererInterface> renderer)
+    {
+        default_renderer = renderer;
+    }
+
+    void header()
+    {
+        getActiveRenderer()->header();
+    }
+
+    void metadata(const std::string& label, const std::string& value)
+    {
+        getActiveRenderer()->metadata(label, value);
+    }
+
+    void string(mojo_ref_t key, const std::string& value)
+    {
+        getActiveRenderer()->string(key, value);
+    }
+
+    void frame(mojo_ref_t key, mojo_ref_t filename, mojo_ref_t name, mojo_int_t line,
+               mojo_int_t line_end, mojo_int_t column, mojo_int_t column_end)
+    {
+        getActiveRenderer()->frame(key, filename, name, line, line_end, column, column_end);
+    }
+
+    void frame_ref(mojo_ref_t key)
+    {
+        getActiveRenderer()->frame_ref(key);
+    }
+
+    void frame_kernel(const std::string& scope)
+    {
+        getActiveRenderer()->frame_kernel(scope);
+    }
+
+    void string(mojo_ref_t key, const char* value)
+    {
+        getActiveRenderer()->string(key, value);
+    }
+
+    void string_ref(mojo_ref_t key)
+    {
+        getActiveRenderer()->string_ref(key);
+    }
+
+    void render_message(std::string_view msg)
+    {
+        getActiveRenderer()->render_message(msg);
+    }
+
+    [[nodiscard]] Result<void> open()
+    {
+        return getActiveRenderer()->open();
+    }
+
+    void close()
+    {
+        getActiveRenderer()->close();
+    }
+
+    void render_thread_begin(PyThreadState* tstate, std::string_view name, microsecond_t cpu_time,
+                             uintptr_t thread_id, unsigned long native_id)
+    {
+        getActiveRenderer()->render_thread_begin(tstate, name, cpu_time, thread_id, native_id);
+    }
+
+    void render_task_begin(std::string task_name, bool on_cpu)
+    {
+        getActiveRenderer()->render_task_begin(task_name, on_cpu);
     }
 
-    void render_frame(Frame& frame)
+    void render_stack_begin(long long pid, long long iid, const std::string& thread_name)
     {
-        getActiveRenderer()->render_frame(frame);
+        getActiveRenderer()->render_stack_begin(pid, iid, thread_name);
     }
 
     void render_cpu_time(uint64_t cpu_time)
@@ -486,4 +1814,24 @@ public:
     {
         getActiveRenderer()->render_stack_end(metric_type, delta);
     }
+
+    bool begin_batch()
+    {
+        return getActiveRenderer()->begin_batch();
+    }
+
+    void end_batch()
+    {
+        getActiveRenderer()->end_batch();
+    }
+
+    void forget()
+    {
+        getActiveRenderer()->forget();
+    }
+
+    size_t footprint()
+    {
+        return getActiveRenderer()->footprint();
+    }
 };
@@ -17,15 +17,36 @@
 
 inline std::mutex sigprof_handler_lock;
 
+// The handler runs in the thread that receives the signal, but it unwinds on
+// behalf of the sampling thread, into its stacks and with its frame cache.
+inline FrameStack* sigprof_python_stack = nullptr;
+inline FrameStack* sigprof_native_stack = nullptr;
+inline LRUCache<uintptr_t, Frame>* sigprof_frame_cache = nullptr;
+inline StackChunk* sigprof_stack_chunk = nullptr;
+inline std::vector<FrameSite>* sigprof_frame_sites = nullptr;
+#if defined PL_LINUX
+inline VmReader* sigprof_vm_reader = nullptr;
+#endif
+
 // ----------------------------------------------------------------------------
 inline void sigprof_handler([[maybe_unused]] int signum)
 {
+    auto* previous_frame_cache = frame_cache;
+    frame_cache = sigprof_frame_cache;
+
+#if defined PL_LINUX
+    VmReader::Borrow borrow(sigprof_vm_reader);
+#endif
+
 #ifndef UNWIND_NATIVE_DISABLE
-    unwind_native_stack();
+    unwind_native_stack(*sigprof_native_stack);
 #endif  // UNWIND_NATIVE_DISABLE
-    unwind_python_stack(current_tstate);
+    unwind_python_stack(current_tstate, *sigprof_python_stack, sigprof_stack_chunk,
+                        *sigprof_frame_sites);
     // NOTE: Native stacks for tasks is non-trivial, so we skip it for now.
 
+    frame_cache = previous_frame_cache;
+
     sigprof_handler_lock.unlock();
 }
 
@@ -31,6 +31,13 @@ public:
     inline void* resolve(void* frame_addr);
     inline bool is_valid() const;
 
+    // Stop resolving addresses, e.g. after a failed update, but keep the
+    // memory for the next update.
+    void invalidate()
+    {
+        origin = NULL;
+    }
+
 private:
     void* origin = NULL;
     std::vector<char> data;
@@ -78,7 +85,7 @@ Result<void> StackChunk::update(_PyStackChunk* chunk_addr)
         auto update_success = previous->update(reinterpret_cast<_PyStackChunk*>(chunk.previous));
         if (!update_success)
         {
-            previous = nullptr;
+            previous->invalidate();
         }
     }
 
@@ -115,4 +122,4 @@ bool StackChunk::is_valid() const
 
 // ----------------------------------------------------------------------------
 
-inline std::unique_ptr<StackChunk> stack_chunk = nullptr;
+inline thread_local std::unique_ptr<StackChunk> stack_chunk = nullptr;
@@ -11,6 +11,7 @@
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #ifndef UNWIND_NATIVE_DISABLE
 #define UNW_LOCAL_ONLY
@@ -22,8 +23,13 @@
 #include <echion/mojo.h>
 #if PY_VERSION_HEX >= 0x030b0000
 #include "echion/stack_chunk.h"
+#else
+// Frames only live in stack chunks from Python 3.11 onwards.
+class StackChunk;
 #endif  // PY_VERSION_HEX >= 0x030b0000
 #include <echion/errors.h>
+#include <echion/footprint.h>
+#include <echion/trace.h>
 
 // ----------------------------------------------------------------------------
 
@@ -39,13 +45,22 @@ public:
         Key h = 0;
 
         for (auto it = this->begin(); it != this->end(); ++it)
-            h = rotl(h) ^ (*it).get().cache_key;
+            h = combine(h, (*it).get().cache_key);
 
         return h;
     }
 
     // ------------------------------------------------------------------------
-    void render()
+    // Combine the key of a stack with the key of the next frame.
+    static inline Key combine(Key key, Frame::Key frame_key)
+    {
+        return rotl(key) ^ frame_key;
+    }
+
+    // ------------------------------------------------------------------------
+    // Call f on each frame to render, from the root to the leaf.
+    template <typename F>
+    void inline visit(F f)
     {
         for (auto it = this->rbegin(); it != this->rend(); ++it)
         {
@@ -54,22 +69,27 @@ public:
                 // This is a shim frame so we skip it.
                 continue;
 #endif
-            Renderer::get().render_frame((*it).get());
+            f((*it).get());
         }
     }
 
+    // ------------------------------------------------------------------------
+    void render(RendererInterface& renderer)
+    {
+        renderer.render_stack(*this);
+    }
+
+    // ------------------------------------------------------------------------
+    // Deques allocate their elements in chunks of 512 bytes.
+    size_t footprint() const
+    {
+        return sizeof(FrameStack) + ((this->size() * sizeof(Frame::Ref)) / 512 + 1) * 512;
+    }
+
     // ------------------------------------------------------------------------
     void render_where()
     {
-        for (auto it = this->rbegin(); it != this->rend(); ++it)
-        {
-#if PY_VERSION_HEX >= 0x030c0000
-            if ((*it).get().is_entry)
-                // This is a shim frame so we skip it.
-                continue;
-#endif
-            WhereRenderer::get().render_frame((*it).get());
-        }
+        visit([](Frame& frame) { WhereRenderer::get().render_frame(frame); });
     }
 
 private:
@@ -82,13 +102,14 @@ private:
 
 // ----------------------------------------------------------------------------
 
-inline FrameStack python_stack;
-inline FrameStack native_stack;
-inline FrameStack interleaved_stack;
+// Each sampling thread unwinds into stacks of its own.
+inline thread_local FrameStack python_stack;
+inline thread_local FrameStack native_stack;
+inline thread_local FrameStack interleaved_stack;
 
 // ----------------------------------------------------------------------------
 #ifndef UNWIND_NATIVE_DISABLE
-inline void unwind_native_stack()
+inline void unwind_native_stack(FrameStack& stack)
 {
     unw_cursor_t cursor;
     unw_context_t context;
@@ -96,9 +117,9 @@ inline void unwind_native_stack()
     unw_getcontext(&context);
     unw_init_local(&cursor, &context);
 
-    native_stack.clear();
+    stack.clear();
 
-    while (unw_step(&cursor) > 0 && native_stack.size() < max_frames)
+    while (unw_step(&cursor) > 0 && stack.size() < max_frames)
     {
         auto maybe_frame = Frame::get(cursor);
         if (!maybe_frame)
@@ -106,48 +127,166 @@ inline void unwind_native_stack()
             break;
         }
 
-        native_stack.push_back(*maybe_frame);
+        stack.push_back(*maybe_frame);
     }
 }
 #endif  // UNWIND_NATIVE_DISABLE
 
 // ----------------------------------------------------------------------------
-static size_t unwind_frame(PyObject* frame_addr, FrameStack& stack)
+// Follow the chain of frames and find where each of them is executing. A
+// cycle in the chain, e.g. because it changed while we were reading it, is
+// detected with Brent's algorithm, and we keep the frames up to the first one
+// that repeats. We only use the given buffer, so that the walk can run as a
+// batch of reads (see copy_memory_batch).
+struct FrameSite
 {
-    std::unordered_set<PyObject*> seen_frames;  // Used to detect cycles in the stack
-    int count = 0;
+    PyObject* addr;
+    Frame::Site site;
+};
 
+static size_t walk_frames(PyObject* frame_addr, FrameSite* sites, size_t size, size_t max_count,
+                          [[maybe_unused]] StackChunk* chunk)
+{
     PyObject* current_frame_addr = frame_addr;
-    while (current_frame_addr != NULL && stack.size() < max_frames)
-    {
-        if (seen_frames.find(current_frame_addr) != seen_frames.end())
-            break;
+    PyObject* tortoise = current_frame_addr;
+    size_t power = 1, lambda = 0;
+    size_t n = 0, count = 0;
 
-        seen_frames.insert(current_frame_addr);
+    while (current_frame_addr != NULL && n < size && count < max_count)
+    {
+        auto& entry = sites[n];
+        entry.addr = current_frame_addr;
 
 #if PY_VERSION_HEX >= 0x030b0000
-        auto maybe_frame =
-            Frame::read(reinterpret_cast<_PyInterpreterFrame*>(current_frame_addr),
-                        reinterpret_cast<_PyInterpreterFrame**>(&current_frame_addr));
+        auto maybe_site =
+            Frame::locate(reinterpret_cast<_PyInterpreterFrame*>(current_frame_addr),
+                          reinterpret_cast<_PyInterpreterFrame**>(&current_frame_addr), chunk);
 #else
-        auto maybe_frame = Frame::read(current_frame_addr, &current_frame_addr);
+        auto maybe_site = Frame::locate(current_frame_addr, &current_frame_addr);
 #endif
-        if (!maybe_frame)
+        if (!maybe_site)
         {
             break;
         }
 
-        if (maybe_frame->get().name == StringTable::C_FRAME) {
-            continue;
+        entry.site = *maybe_site;
+        n++;
+
+        if (entry.site.code != NULL)
+            count++;
+
+        if (current_frame_addr == tortoise)
+        {
+            // The frame that we are about to visit is the one we visited
+            // lambda + 1 steps ago, which gives us the length of the cycle.
+            // We drop the frames from the first that is a repeat onwards.
+            lambda++;
+            for (size_t i = 0; i + lambda < n; i++)
+            {
+                if (sites[i].addr == sites[i + lambda].addr)
+                {
+                    n = i + lambda;
+                    break;
+                }
+            }
+            break;
+        }
+
+        if (++lambda == power)
+        {
+            tortoise = current_frame_addr;
+            power <<= 1;
+            lambda = 0;
+        }
+    }
+
+    return n;
+}
+
+// ----------------------------------------------------------------------------
+// Frames are resolved against the given stack chunk, if any, rather than read
+// one by one. The sites are only a buffer, which we never grow here, since the
+// SIGPROF handler lends us those of the sampling thread.
+static size_t unwind_frame(PyObject* frame_addr, FrameStack& stack, StackChunk* chunk,
+                           std::vector<FrameSite>& sites)
+{
+    if (stack.size() >= max_frames)
+        return 0;
+
+    size_t max_count = max_frames - stack.size();
+
+    // We first find where each frame is executing, which is all the reading
+    // from the frames that we need, and only then look the frames up. With
+    // the memcpy backend, the fault handler is then armed once for the whole
+    // chain. If that faults, we walk the chain again with the handler armed
+    // on every read, to keep the frames before the faulty one.
+    size_t n = 0;
+    auto walk = [&]() {
+        n = walk_frames(frame_addr, sites.data(), sites.size(), max_count, chunk);
+    };
+    if (!copy_memory_batch(walk))
+    {
+        walk();
+    }
+
+    int count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        auto& site = sites[i].site;
+        if (site.code == NULL)
+            continue;  // C frame
+
+        auto maybe_frame = Frame::get(site);
+        if (!maybe_frame)
+        {
+            break;
         }
 
         stack.push_back(*maybe_frame);
         count++;
+
+        // We cannot trust what comes after a frame we could not read.
+        if (&maybe_frame->get() == &INVALID_FRAME)
+            break;
     }
 
     return count;
 }
 
+// ----------------------------------------------------------------------------
+// The stack chunk of the calling thread, which only sampling threads have.
+static inline StackChunk* own_stack_chunk()
+{
+#if PY_VERSION_HEX >= 0x030b0000
+    if (stack_chunk == nullptr)
+        stack_chunk = std::make_unique<StackChunk>();
+
+    return stack_chunk.get();
+#else
+    return nullptr;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// The buffer of frame sites of the calling thread, which only sampling threads
+// have. It is reused across unwinds, and makes room for some C frames besides
+// the Python frames that we can take.
+inline thread_local std::vector<FrameSite> frame_sites;
+
+static inline std::vector<FrameSite>& own_frame_sites()
+{
+    if (frame_sites.size() < 2 * max_frames)
+        frame_sites.resize(2 * max_frames);
+
+    return frame_sites;
+}
+
+// ----------------------------------------------------------------------------
+inline size_t unwind_frame(PyObject* frame_addr, FrameStack& stack)
+{
+    return unwind_frame(frame_addr, stack, own_stack_chunk(), own_frame_sites());
+}
+
 // ----------------------------------------------------------------------------
 static size_t unwind_frame_unsafe(PyObject* frame, FrameStack& stack)
 {
@@ -193,18 +332,21 @@ static size_t unwind_frame_unsafe(PyObject* frame, FrameStack& stack)
 }
 
 // ----------------------------------------------------------------------------
-static void unwind_python_stack(PyThreadState* tstate, FrameStack& stack)
+// The chunk and the sites are those of the sampling thread, which the SIGPROF
+// handler lends to the sampled thread, so we must neither allocate nor free
+// them here.
+static void unwind_python_stack(PyThreadState* tstate, FrameStack& stack,
+                                [[maybe_unused]] StackChunk* chunk, std::vector<FrameSite>& sites)
 {
     stack.clear();
 #if PY_VERSION_HEX >= 0x030b0000
-    if (stack_chunk == nullptr)
     {
-        stack_chunk = std::make_unique<StackChunk>();
-    }
+        TraceScope trace(Tracer::STACK_CHUNK);
 
-    if (!stack_chunk->update(reinterpret_cast<_PyStackChunk*>(tstate->datastack_chunk)))
-    {
-        stack_chunk = nullptr;
+        if (!chunk->update(reinterpret_cast<_PyStackChunk*>(tstate->datastack_chunk)))
+        {
+            chunk->invalidate();
+        }
     }
 #endif
 
@@ -221,22 +363,18 @@ static void unwind_python_stack(PyThreadState* tstate, FrameStack& stack)
 #else  // Python < 3.11
     PyObject* frame_addr = (PyObject*)tstate->frame;
 #endif
-    unwind_frame(frame_addr, stack);
+    unwind_frame(frame_addr, stack, chunk, sites);
 }
 
 // ----------------------------------------------------------------------------
-static void unwind_python_stack_unsafe(PyThreadState* tstate, FrameStack& stack)
+inline void unwind_python_stack_unsafe(PyThreadState* tstate, FrameStack& stack)
 {
     stack.clear();
 #if PY_VERSION_HEX >= 0x030b0000
-    if (stack_chunk == nullptr)
+    auto* chunk = own_stack_chunk();
+    if (!chunk->update(reinterpret_cast<_PyStackChunk*>(tstate->datastack_chunk)))
     {
-        stack_chunk = std::make_unique<StackChunk>();
-    }
-
-    if (!stack_chunk->update(reinterpret_cast<_PyStackChunk*>(tstate->datastack_chunk)))
-    {
-        stack_chunk = nullptr;
+        chunk->invalidate();
     }
 #endif
 
@@ -251,9 +389,9 @@ static void unwind_python_stack_unsafe(PyThreadState* tstate, FrameStack& stack)
 }
 
 // ----------------------------------------------------------------------------
-static void unwind_python_stack(PyThreadState* tstate)
+inline void unwind_python_stack(PyThreadState* tstate)
 {
-    unwind_python_stack(tstate, python_stack);
+    unwind_python_stack(tstate, python_stack, own_stack_chunk(), own_frame_sites());
 }
 
 // ----------------------------------------------------------------------------
@@ -274,8 +412,8 @@ static Result<void> interleave_stacks(FrameStack& python_stack)
             return ErrorKind::LookupError;
         }
 
-        const auto& name = maybe_name->get();
-        if (name.find("PyEval_EvalFrameDefault") != std::string::npos)
+        auto name = *maybe_name;
+        if (name.find("PyEval_EvalFrameDefault") != std::string_view::npos)
         {
             if (p == python_stack.rend())
             {
@@ -320,7 +458,7 @@ static Result<void> interleave_stacks(FrameStack& python_stack)
 }
 
 // ----------------------------------------------------------------------------
-static Result<void> interleave_stacks()
+inline Result<void> interleave_stacks()
 {
     return interleave_stacks(python_stack);
 }
@@ -352,7 +490,9 @@ public:
         auto stack_entry = table.find(stack_key);
         if (stack_entry == table.end())
         {
-            table.emplace(stack_key, std::move(stack));
+            auto entry = std::make_unique<Entry>(*stack);
+            stacks_size += entry->footprint();
+            table.emplace(stack_key, std::move(entry));
         }
         else
         {
@@ -363,11 +503,47 @@ public:
     }
 
     // ------------------------------------------------------------------------
-    FrameStack& retrieve(FrameStack::Key stack_key)
+    // The stack might be missing if it has been pruned while it was being
+    // stored.
+    [[nodiscard]] Result<std::reference_wrapper<FrameStack>> retrieve(FrameStack::Key stack_key)
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        auto stack_entry = table.find(stack_key);
+        if (stack_entry == table.end())
+            return ErrorKind::LookupError;
+
+        return std::ref(stack_entry->second->stack);
+    }
+
+    // ------------------------------------------------------------------------
+    // Drop all the stacks that are not referenced by the given keys.
+    template <typename S>
+    void retain(const S& keys)
     {
         std::lock_guard<std::mutex> lock(this->lock);
 
-        return *table.find(stack_key)->second;
+        for (auto it = table.begin(); it != table.end();)
+        {
+            if (keys.find(it->first) == keys.end())
+            {
+                stacks_size -= it->second->footprint();
+                it = table.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        table.rehash(0);
+    }
+
+    // ------------------------------------------------------------------------
+    size_t footprint()
+    {
+        std::lock_guard<std::mutex> lock(this->lock);
+
+        return hash_footprint(table) + stacks_size;
     }
 
     // ------------------------------------------------------------------------
@@ -376,10 +552,35 @@ public:
         std::lock_guard<std::mutex> lock(this->lock);
 
         table.clear();
+        stacks_size = 0;
     }
 
 private:
-    std::unordered_map<FrameStack::Key, std::unique_ptr<FrameStack>> table;
+    // Stacks keep copies of their frames, as the frame cache might evict the
+    // originals while the stacks are still in the table.
+    class Entry
+    {
+    public:
+        std::deque<Frame> frames;
+        FrameStack stack;
+
+        Entry(const FrameStack& source)
+        {
+            for (auto& frame : source)
+            {
+                frames.push_back(frame.get());
+                stack.push_back(std::ref(frames.back()));
+            }
+        }
+
+        size_t footprint() const
+        {
+            return sizeof(Entry) + frames.size() * sizeof(Frame) + stack.footprint();
+        }
+    };
+
+    std::unordered_map<FrameStack::Key, std::unique_ptr<Entry>> table;
+    size_t stacks_size = 0;
     std::mutex lock;
 };
 
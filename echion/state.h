@@ -29,10 +29,14 @@ inline std::thread* sampler_thread = nullptr;
 
 inline int running = 0;
 
+// The process that is running the sampler on a thread of the caller, and
+// whether it has yet to tear it down. This lets stop wait for the teardown to
+// complete before the process moves on to its own finalization.
+inline pid_t sampler_pid = 0;
+inline bool sampler_done = true;
+inline std::condition_variable sampler_cv;
+inline std::mutex sampler_lock;
+
 inline std::thread* where_thread = nullptr;
 inline std::condition_variable where_cv;
 inline std::mutex where_lock;
-
-inline PyObject* asyncio_current_tasks = NULL;
-inline PyObject* asyncio_scheduled_tasks = NULL;  // WeakSet
-inline PyObject* asyncio_eager_tasks = NULL;      // set
@@ -8,8 +8,15 @@
 #include <Python.h>
 #include <unicodeobject.h>
 
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #ifndef UNWIND_NATIVE_DISABLE
 #include <cxxabi.h>
@@ -18,11 +25,13 @@
 #endif  // UNWIND_NATIVE_DISABLE
 
 
+#include <echion/cache.h>
 #include <echion/long.h>
 #include <echion/render.h>
 #include <echion/vm.h>
 
 constexpr ssize_t MAX_STRING_SIZE = 1 << 20; // 1 MiB
+constexpr size_t MAX_STRING_TABLE_SIZE = 64 << 20; // 64 MiB
 
 // ----------------------------------------------------------------------------
 static std::unique_ptr<unsigned char[]> pybytes_to_bytes_and_size(PyObject* bytes_addr,
@@ -44,6 +53,24 @@ static std::unique_ptr<unsigned char[]> pybytes_to_bytes_and_size(PyObject* byte
     return data;
 }
 
+// ----------------------------------------------------------------------------
+// Like pybytes_to_bytes_and_size, but the bytes are only valid until the next
+// read of the calling thread (see copy_memory_view).
+inline const unsigned char* pybytes_view(PyObject* bytes_addr, Py_ssize_t* size)
+{
+    PyBytesObject bytes;
+
+    if (copy_type(bytes_addr, bytes))
+        return nullptr;
+
+    *size = bytes.ob_base.ob_size;
+    if (*size < 0 || *size > MAX_STRING_SIZE)
+        return nullptr;
+
+    return static_cast<const unsigned char*>(
+        copy_view(reinterpret_cast<char*>(bytes_addr) + offsetof(PyBytesObject, ob_sval), *size));
+}
+
 // ----------------------------------------------------------------------------
 static Result<std::string> pyunicode_to_utf8(PyObject* str_addr)
 {
@@ -73,57 +100,128 @@ static Result<std::string> pyunicode_to_utf8(PyObject* str_addr)
 }
 
 // ----------------------------------------------------------------------------
+// Append-only storage for the strings of the string table. Strings are copied
+// into large blocks, prefixed by their size, and are never moved, so
+// references to them remain valid until the arena is dropped as a whole.
+class StringArena
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    const char* store(std::string_view value)
+    {
+        size_t record_size = sizeof(size_t) + value.size() + 1;
+        char* dest = nullptr;
 
-class StringTable : public std::unordered_map<uintptr_t, std::string>
+        if (record_size > BLOCK_SIZE / 4)
+        {
+            // Large strings get a block of their own, so that we don't waste
+            // the space left in the current one.
+            dest = blocks.emplace_front(std::make_unique<char[]>(record_size)).get();
+            allocated += record_size;
+        }
+        else
+        {
+            // Keep the size prefixes aligned.
+            used = (used + alignof(size_t) - 1) & ~(alignof(size_t) - 1);
+            if (block == nullptr || used + record_size > BLOCK_SIZE)
+            {
+                block = blocks.emplace_back(std::make_unique<char[]>(BLOCK_SIZE)).get();
+                allocated += BLOCK_SIZE;
+                used = 0;
+            }
+
+            dest = block + used;
+            used += record_size;
+        }
+
+        *reinterpret_cast<size_t*>(dest) = value.size();
+        std::memcpy(dest + sizeof(size_t), value.data(), value.size());
+        dest[sizeof(size_t) + value.size()] = '\0';
+
+        return dest;
+    }
+
+    static inline std::string_view view(const char* record)
+    {
+        return std::string_view(record + sizeof(size_t), *reinterpret_cast<const size_t*>(record));
+    }
+
+    inline size_t size() const
+    {
+        return allocated;
+    }
+
+private:
+    std::deque<std::unique_ptr<char[]>> blocks;
+    char* block = nullptr;  // The block that we are filling
+    size_t used = 0;
+    size_t allocated = 0;
+};
+
+// ----------------------------------------------------------------------------
+// Maps string keys (usually the address of the string object) to the strings
+// that we have read from the target. The table is append-only: lookups are
+// lock-free, while insertions are serialised by a lock. New strings are
+// rendered before they are published, so that anyone who finds a key can refer
+// to it in the output.
+//
+// The address of a string object can be reused once the object is freed, so
+// strings that we read from the target are read again on their first hit in
+// every cache epoch (see cache.h) and replaced if they have changed. Once the
+// table grows beyond MAX_STRING_TABLE_SIZE we drop all the strings and start a
+// new generation. Anything that holds on to string keys (e.g. cached frames)
+// must check the generation to tell whether the keys are still valid.
+class StringTable
 {
 public:
     using Key = uintptr_t;
 
-
     static constexpr Key INVALID = 1;
     static constexpr Key UNKNOWN = 2;
     static constexpr Key C_FRAME = 3;
+    static constexpr Key GIL_HELD = 4;
+    static constexpr Key GIL_WAIT = 5;
 
     // Python string object
     [[nodiscard]] inline Result<Key> key(PyObject* s)
     {
-        const std::lock_guard<std::mutex> lock(table_lock);
-
         auto k = reinterpret_cast<Key>(s);
+        auto epoch = cache_epoch.load(std::memory_order_relaxed);
 
-        if (this->find(k) == this->end())
-        {
-#if PY_VERSION_HEX >= 0x030c0000
-            // The task name might hold a PyLong for deferred task name formatting.
-            std::string str = "Task-";
+        const auto* entry = find(k);
+        if (entry != nullptr && entry->epoch.load(std::memory_order_relaxed) == epoch)
+            return Result<Key>(k);
 
-            auto maybe_long = pylong_to_llong(s);
-            if (maybe_long)
-            {
-                str += std::to_string(*maybe_long);
-            }
-            else
-            {
-                auto maybe_unicode = pyunicode_to_utf8(s);
-                if (!maybe_unicode)
-                {
-                    return ErrorKind::PyUnicodeError;
-                }
+#if PY_VERSION_HEX >= 0x030c0000
+        // The task name might hold a PyLong for deferred task name formatting.
+        std::string str = "Task-";
 
-                str = *maybe_unicode;
-            }
-#else
+        auto maybe_long = pylong_to_llong(s);
+        if (maybe_long)
+        {
+            str += std::to_string(*maybe_long);
+        }
+        else
+        {
             auto maybe_unicode = pyunicode_to_utf8(s);
             if (!maybe_unicode)
             {
                 return ErrorKind::PyUnicodeError;
             }
 
-            std::string str = std::move(*maybe_unicode);
-#endif
-            this->emplace(k, str);
-            Renderer::get().string(k, str);
+            str = *maybe_unicode;
         }
+#else
+        auto maybe_unicode = pyunicode_to_utf8(s);
+        if (!maybe_unicode)
+        {
+            return ErrorKind::PyUnicodeError;
+        }
+
+        std::string str = std::move(*maybe_unicode);
+#endif
+        validate(entry, k, str, epoch);
 
         return Result<Key>(k);
     };
@@ -131,40 +229,47 @@ public:
     // Python string object
     [[nodiscard]] inline Key key_unsafe(PyObject* s)
     {
-        const std::lock_guard<std::mutex> lock(table_lock);
-
         auto k = reinterpret_cast<Key>(s);
+        auto epoch = cache_epoch.load(std::memory_order_relaxed);
+
+        const auto* entry = find(k);
+        if (entry != nullptr && entry->epoch.load(std::memory_order_relaxed) == epoch)
+            return k;
 
-        if (this->find(k) == this->end())
-        {
 #if PY_VERSION_HEX >= 0x030c0000
-            // The task name might hold a PyLong for deferred task name formatting.
-            auto str = (PyLong_CheckExact(s)) ? "Task-" + std::to_string(PyLong_AsLong(s))
-                                              : std::string(PyUnicode_AsUTF8(s));
+        // The task name might hold a PyLong for deferred task name formatting.
+        auto str = (PyLong_CheckExact(s)) ? "Task-" + std::to_string(PyLong_AsLong(s))
+                                          : std::string(PyUnicode_AsUTF8(s));
 #else
-            auto str = std::string(PyUnicode_AsUTF8(s));
+        auto str = std::string(PyUnicode_AsUTF8(s));
 #endif
-            this->emplace(k, str);
-            Renderer::get().string(k, str);
-        }
+        validate(entry, k, str, epoch);
 
         return k;
     };
 
+    // Static string, like the name of a pseudo-frame, by address
+    [[nodiscard]] inline Key key(const char* s)
+    {
+        auto k = reinterpret_cast<Key>(s);
+
+        if (find(k) == nullptr)
+            insert(k, s);
+
+        return k;
+    }
+
 #ifndef UNWIND_NATIVE_DISABLE
     // Native filename by program counter
     [[nodiscard]] inline Key key(unw_word_t pc)
     {
-        const std::lock_guard<std::mutex> lock(table_lock);
-
         auto k = static_cast<Key>(pc);
 
-        if (this->find(k) == this->end())
+        if (find(k) == nullptr)
         {
             char buffer[32] = {0};
             std::snprintf(buffer, 32, "native@%p", reinterpret_cast<void*>(k));
-            this->emplace(k, buffer);
-            Renderer::get().string(k, buffer);
+            insert(k, buffer);
         }
 
         return k;
@@ -173,15 +278,13 @@ public:
     // Native scope name by unwinding cursor
     [[nodiscard]] inline Result<Key> key(unw_cursor_t& cursor)
     {
-        const std::lock_guard<std::mutex> lock(table_lock);
-
         unw_proc_info_t pi;
         if ((unw_get_proc_info(&cursor, &pi)))
             return ErrorKind::UnwindError;
 
         auto k = reinterpret_cast<Key>(pi.start_ip);
 
-        if (this->find(k) == this->end())
+        if (find(k) == nullptr)
         {
             unw_word_t offset;  // Ignored. All the information is in the PC anyway.
             char sym[256];
@@ -200,8 +303,7 @@ public:
                     name = demangled;
             }
 
-            this->emplace(k, name);
-            Renderer::get().string(k, name);
+            insert(k, name);
 
             if (demangled)
                 std::free(demangled);
@@ -211,26 +313,255 @@ public:
     }
 #endif  // UNWIND_NATIVE_DISABLE
 
-    [[nodiscard]] inline Result<std::reference_wrapper<const std::string>> lookup(Key key) const
+    [[nodiscard]] inline Result<std::string_view> lookup(Key key) const
     {
-        const std::lock_guard<std::mutex> lock(table_lock);
-
-        const auto it = this->find(key);
-        if (it == this->cend())
+        const auto* entry = find(key);
+        if (entry == nullptr)
             return ErrorKind::LookupError;
 
-        return std::ref(it->second);
+        return StringArena::view(entry->value.load(std::memory_order_acquire));
     };
 
-    StringTable() : std::unordered_map<uintptr_t, std::string>()
+    // Changes whenever the string with the given key is replaced, or 0 if
+    // there is no such string.
+    [[nodiscard]] inline uintptr_t version(Key key) const
     {
-        this->emplace(0, "");
-        this->emplace(INVALID, "<invalid>");
-        this->emplace(UNKNOWN, "<unknown>");
+        const auto* entry = find(key);
+        if (entry == nullptr)
+            return 0;
+
+        return reinterpret_cast<uintptr_t>(entry->value.load(std::memory_order_acquire));
+    }
+
+    [[nodiscard]] inline uint64_t generation() const
+    {
+        return current_generation.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] size_t footprint()
+    {
+        const std::lock_guard<std::mutex> lock(write_lock);
+
+        size_t size = arena->size() + current->size();
+        for (auto& retired_table : retired)
+            size += retired_table->size();
+        for (auto& retired_arena : retired_arenas)
+            size += retired_arena->size();
+
+        return size;
+    }
+
+    // Drop all the strings.
+    void clear()
+    {
+        const std::lock_guard<std::mutex> lock(write_lock);
+
+        reset();
+    }
+
+    StringTable()
+        : current(std::make_unique<Table>(INITIAL_CAPACITY)),
+          arena(std::make_unique<StringArena>())
+    {
+        table.store(current.get(), std::memory_order_release);
+
+        add_defaults();
     };
 
 private:
-    mutable std::mutex table_lock;
+    static constexpr Key EMPTY = ~static_cast<Key>(0);
+    static constexpr size_t INITIAL_CAPACITY = 1 << 12;
+
+    class Entry
+    {
+    public:
+        // Published last, once the rest of the entry is set.
+        std::atomic<Key> key = EMPTY;
+        // The size-prefixed string in the arena. This changes when the string
+        // object at the key address is replaced by a different one.
+        std::atomic<const char*> value = nullptr;
+        // The cache epoch in which we last checked the string.
+        mutable std::atomic<uint32_t> epoch = 0;
+    };
+
+    // Open-addressing hash table with linear probing. Entries are never
+    // removed, and once a key is set it never changes.
+    class Table
+    {
+    public:
+        size_t mask;
+        size_t count = 0;
+        std::unique_ptr<Entry[]> entries;
+
+        Table(size_t capacity) : mask(capacity - 1), entries(std::make_unique<Entry[]>(capacity))
+        {
+        }
+
+        static inline size_t hash(Key key)
+        {
+            return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 16);
+        }
+
+        inline Entry* find(Key key) const
+        {
+            for (size_t i = hash(key) & mask, n = 0; n <= mask; i = (i + 1) & mask, n++)
+            {
+                auto k = entries[i].key.load(std::memory_order_acquire);
+                if (k == key)
+                    return &entries[i];
+                if (k == EMPTY)
+                    return nullptr;
+            }
+
+            return nullptr;
+        }
+
+        // Only called with the write lock held.
+        inline void insert(Key key, const char* value, uint32_t epoch)
+        {
+            size_t i = hash(key) & mask;
+            while (entries[i].key.load(std::memory_order_relaxed) != EMPTY)
+                i = (i + 1) & mask;
+
+            auto& entry = entries[i];
+            entry.value.store(value, std::memory_order_relaxed);
+            entry.epoch.store(epoch, std::memory_order_relaxed);
+            entry.key.store(key, std::memory_order_release);
+
+            count++;
+        }
+
+        inline size_t size() const
+        {
+            return (mask + 1) * sizeof(Entry);
+        }
+    };
+
+    std::atomic<Table*> table = nullptr;
+    std::atomic<uint64_t> current_generation = 0;
+
+    // These are only accessed with the write lock held.
+    std::mutex write_lock;
+    std::unique_ptr<Table> current;
+    std::unique_ptr<StringArena> arena;
+    std::vector<std::unique_ptr<Table>> retired;
+    std::vector<std::unique_ptr<StringArena>> retired_arenas;
+
+    inline const Entry* find(Key key) const
+    {
+        return table.load(std::memory_order_acquire)->find(key);
+    }
+
+    // Check a string that we have read again against the one we have, if any.
+    inline void validate(const Entry* entry, Key key, std::string_view value, uint32_t epoch)
+    {
+        if (entry != nullptr &&
+            StringArena::view(entry->value.load(std::memory_order_acquire)) == value)
+        {
+            entry->epoch.store(epoch, std::memory_order_relaxed);
+            return;
+        }
+
+        insert(key, value);
+    }
+
+    inline void insert(Key key, std::string_view value)
+    {
+        const std::lock_guard<std::mutex> lock(write_lock);
+
+        insert_locked(key, value, true);
+    }
+
+    // Only called with the write lock held, or on construction.
+    inline void insert_locked(Key key, std::string_view value, bool render)
+    {
+        auto epoch = cache_epoch.load(std::memory_order_relaxed);
+
+        // Someone else might have added the same string in the meantime.
+        auto* entry = current->find(key);
+        if (entry != nullptr &&
+            StringArena::view(entry->value.load(std::memory_order_relaxed)) == value)
+        {
+            entry->epoch.store(epoch, std::memory_order_relaxed);
+            return;
+        }
+
+        if (arena->size() + current->size() > MAX_STRING_TABLE_SIZE)
+        {
+            reset();
+            entry = nullptr;
+        }
+
+        if (render)
+            Renderer::get().string(key, std::string(value));
+
+        auto stored = arena->store(value);
+
+        if (entry != nullptr)
+        {
+            // The address has been reused for a different string.
+            entry->value.store(stored, std::memory_order_release);
+            entry->epoch.store(epoch, std::memory_order_relaxed);
+            return;
+        }
+
+        // Keep the load factor below 1/2. Lookups might still be running on
+        // the old table, so we retire it rather than freeing it.
+        if ((current->count + 1) * 2 > current->mask + 1)
+        {
+            auto grown = std::make_unique<Table>((current->mask + 1) * 2);
+            for (size_t i = 0; i <= current->mask; i++)
+            {
+                auto& old_entry = current->entries[i];
+                auto k = old_entry.key.load(std::memory_order_relaxed);
+                if (k != EMPTY)
+                    grown->insert(k, old_entry.value.load(std::memory_order_relaxed),
+                                  old_entry.epoch.load(std::memory_order_relaxed));
+            }
+
+            grown->insert(key, stored, epoch);
+
+            table.store(grown.get(), std::memory_order_release);
+            retired.push_back(std::move(current));
+            current = std::move(grown);
+
+            return;
+        }
+
+        current->insert(key, stored, epoch);
+    }
+
+    // Start a new generation. Lookups that are still running on the current
+    // table remain valid until the next reset, when we free its memory.
+    inline void reset()
+    {
+        retired.clear();
+        retired_arenas.clear();
+
+        retired.push_back(std::move(current));
+        retired_arenas.push_back(std::move(arena));
+
+        current = std::make_unique<Table>(INITIAL_CAPACITY);
+        arena = std::make_unique<StringArena>();
+        table.store(current.get(), std::memory_order_release);
+
+        // Anything that the renderer keeps refers to the strings that we drop.
+        Renderer::get().forget();
+        add_defaults(true);
+
+        current_generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // The default strings are rendered when the output is opened, and again
+    // with every new generation, since the renderer forgets them too.
+    inline void add_defaults(bool render = false)
+    {
+        insert_locked(0, "", render);
+        insert_locked(INVALID, "<invalid>", render);
+        insert_locked(UNKNOWN, "<unknown>", render);
+        insert_locked(GIL_HELD, ":GIL held:", render);
+        insert_locked(GIL_WAIT, ":GIL wait:", render);
+    }
 };
 
 // We make this a reference to a heap-allocated object so that we can avoid
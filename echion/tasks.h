@@ -32,10 +32,12 @@
 #include <echion/config.h>
 #include <echion/errors.h>
 #include <echion/frame.h>
+#include <echion/interp.h>
 #include <echion/mirrors.h>
 #include <echion/stacks.h>
 #include <echion/state.h>
 #include <echion/strings.h>
+#include <echion/tick_reads.h>
 #include <echion/timing.h>
 
 #include <echion/cpython/tasks.h>
@@ -100,7 +102,7 @@ inline Result<GenInfo::Ptr> GenInfo::create(PyObject* gen_addr)
     }
 
     PyGenObject gen;
-    if (copy_type(gen_addr, gen))
+    if (copy_type_tick(gen_addr, gen))
     {
         recursion_depth--;
         return ErrorKind::GenInfoError;
@@ -138,7 +140,7 @@ inline Result<GenInfo::Ptr> GenInfo::create(PyObject* gen_addr)
 #endif
 
     PyFrameObject f;
-    if (copy_type(frame, f))
+    if (copy_type_tick(frame, f))
     {
         recursion_depth--;
         return ErrorKind::GenInfoError;
@@ -205,9 +207,6 @@ public:
     inline size_t unwind(FrameStack&, size_t& upper_python_stack_size);
 };
 
-inline std::unordered_map<PyObject*, PyObject*> task_link_map;
-inline std::mutex task_link_map_lock;
-
 // ----------------------------------------------------------------------------
 inline Result<TaskInfo::Ptr> TaskInfo::create(TaskObj* task_addr)
 {
@@ -221,7 +220,7 @@ inline Result<TaskInfo::Ptr> TaskInfo::create(TaskObj* task_addr)
     }
 
     TaskObj task;
-    if (copy_type(task_addr, task))
+    if (copy_type_tick(task_addr, task))
     {
         recursion_depth--;
         return ErrorKind::TaskInfoError;
@@ -262,12 +261,12 @@ inline Result<TaskInfo::Ptr> TaskInfo::create(TaskObj* task_addr)
 // ----------------------------------------------------------------------------
 inline Result<TaskInfo::Ptr> TaskInfo::current(PyObject* loop)
 {
-    if (loop == NULL)
+    if (loop == NULL || current_interp == nullptr)
     {
         return ErrorKind::TaskInfoError;
     }
 
-    auto maybe_current_tasks_dict = MirrorDict::create(asyncio_current_tasks);
+    auto maybe_current_tasks_dict = MirrorDict::create(current_interp->asyncio_current_tasks);
     if (!maybe_current_tasks_dict)
     {
         return ErrorKind::TaskInfoError;
@@ -288,10 +287,10 @@ inline Result<TaskInfo::Ptr> TaskInfo::current(PyObject* loop)
 [[nodiscard]] inline Result<std::vector<TaskInfo::Ptr>> get_all_tasks(PyObject* loop)
 {
     std::vector<TaskInfo::Ptr> tasks;
-    if (loop == NULL)
+    if (loop == NULL || current_interp == nullptr)
         return tasks;
 
-    auto maybe_scheduled_tasks_set = MirrorSet::create(asyncio_scheduled_tasks);
+    auto maybe_scheduled_tasks_set = MirrorSet::create(current_interp->asyncio_scheduled_tasks);
     if (!maybe_scheduled_tasks_set)
     {
         return ErrorKind::TaskInfoError;
@@ -308,7 +307,7 @@ inline Result<TaskInfo::Ptr> TaskInfo::current(PyObject* loop)
     for (auto task_wr_addr : scheduled_tasks)
     {
         PyWeakReference task_wr;
-        if (copy_type(task_wr_addr, task_wr))
+        if (copy_type_tick(task_wr_addr, task_wr))
             continue;
 
         auto maybe_task_info = TaskInfo::create(reinterpret_cast<TaskObj*>(task_wr.wr_object));
@@ -321,6 +320,7 @@ inline Result<TaskInfo::Ptr> TaskInfo::current(PyObject* loop)
         }
     }
 
+    PyObject* asyncio_eager_tasks = current_interp->asyncio_eager_tasks;
     if (asyncio_eager_tasks != NULL)
     {
         auto maybe_eager_tasks_set = MirrorSet::create(asyncio_eager_tasks);
@@ -356,7 +356,7 @@ inline Result<TaskInfo::Ptr> TaskInfo::current(PyObject* loop)
 
 // ----------------------------------------------------------------------------
 
-inline std::vector<std::unique_ptr<StackInfo>> current_tasks;
+inline thread_local std::vector<std::unique_ptr<StackInfo>> current_tasks;
 
 // ----------------------------------------------------------------------------
 
@@ -8,10 +8,14 @@
 #define Py_BUILD_CORE
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #if defined PL_LINUX
 #include <time.h>
@@ -23,16 +27,18 @@
 #include <echion/errors.h>
 #include <echion/greenlets.h>
 #include <echion/interp.h>
+#include <echion/kernel.h>
 #include <echion/render.h>
 #include <echion/signals.h>
 #include <echion/stacks.h>
 #include <echion/tasks.h>
 #include <echion/timing.h>
+#include <echion/trace.h>
 
-class ThreadInfo
+class ThreadInfo : public std::enable_shared_from_this<ThreadInfo>
 {
 public:
-    using Ptr = std::unique_ptr<ThreadInfo>;
+    using Ptr = std::shared_ptr<ThreadInfo>;
 
     uintptr_t thread_id;
     unsigned long native_id;
@@ -46,10 +52,18 @@ public:
 #endif
     microsecond_t cpu_time;
 
-    uintptr_t asyncio_loop = 0;
+#if defined PL_LINUX
+    // What the thread is doing in the kernel, as of the start of the tick.
+    KernelState kernel;
+#endif
+
+    // Set by the application threads while the sampler might be reading it.
+    std::atomic<uintptr_t> asyncio_loop = 0;
 
     [[nodiscard]] Result<void> update_cpu_time();
     bool is_running();
+    bool waits_for_gil(const InterpreterState&);
+    const char* blocking_call();
 
     [[nodiscard]] Result<void> sample(int64_t, PyThreadState*, microsecond_t);
     void unwind(PyThreadState*);
@@ -179,18 +193,306 @@ inline bool ThreadInfo::is_running()
 }
 
 // ----------------------------------------------------------------------------
+inline bool ThreadInfo::waits_for_gil(const InterpreterState& interp)
+{
+#if defined PL_LINUX
+    auto gil_addr = interp.gil_addr.load();
+
+    return gil_addr != 0 && kernel.waits_on(gil_addr, InterpreterState::GIL_SIZE);
+#else
+    // We cannot tell what threads are blocked on.
+    (void)interp;
+    return false;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+inline const char* ThreadInfo::blocking_call()
+{
+#if defined PL_LINUX
+    return kernel.blocking_call();
+#else
+    return nullptr;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+// The registry of the tracked threads, indexed by thread_id. The sampler, and
+// anything else that only needs to look threads up, reads an immutable
+// snapshot of the registry without taking any locks. Writers, that is
+// track_thread/untrack_thread, serialise among themselves, publish a modified
+// copy of the current snapshot and retire the old one. Retired snapshots are
+// reclaimed lazily, on a later update or sampler tick, once all the readers
+// that might still be looking at them are gone (RCU-style). Writers therefore
+// never wait for the readers, e.g. for the sampler to finish its tick.
+class ThreadRegistry
+{
+public:
+    class Snapshot
+    {
+    public:
+        std::unordered_map<uintptr_t, ThreadInfo::Ptr> threads;
+
+        // The number of tracked threads named "MainThread". This is maintained
+        // by the writers so that the sampler doesn't have to scan the threads.
+        size_t main_threads = 0;
+
+        ThreadInfo* find(uintptr_t thread_id) const
+        {
+            auto entry = threads.find(thread_id);
+            return entry != threads.end() ? entry->second.get() : nullptr;
+        }
+
+        bool main_thread_tracked() const
+        {
+            return main_threads > 0;
+        }
+
+    private:
+        friend class ThreadRegistry;
+
+        void track(uintptr_t thread_id, ThreadInfo::Ptr thread_info)
+        {
+            untrack(thread_id);
+
+            main_threads += thread_info->name == "MainThread";
+            threads.emplace(thread_id, std::move(thread_info));
+        }
+
+        void untrack(uintptr_t thread_id)
+        {
+            auto entry = threads.find(thread_id);
+            if (entry == threads.end())
+                return;
+
+            main_threads -= entry->second->name == "MainThread";
+            threads.erase(entry);
+        }
+    };
+
+    // ------------------------------------------------------------------------
+    // A read-side critical section. The snapshot it refers to, and the thread
+    // info objects it holds, are guaranteed to stay alive for as long as the
+    // guard does. Guards delay the reclamation of the snapshots that were
+    // retired while they were held, so they should not be held for longer than
+    // needed.
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(ThreadRegistry& registry) : registry(registry)
+        {
+            slot = registry.enter();
+            snapshot = registry.current.load(std::memory_order_acquire);
+        }
+
+        ~ReadGuard()
+        {
+            registry.exit(slot);
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        const Snapshot* operator->() const
+        {
+            return snapshot;
+        }
+
+    private:
+        ThreadRegistry& registry;
+        const Snapshot* snapshot;
+        unsigned int slot;
+    };
+
+    // ------------------------------------------------------------------------
+    ReadGuard read()
+    {
+        return ReadGuard(*this);
+    }
+
+    // ------------------------------------------------------------------------
+    void track(uintptr_t thread_id, ThreadInfo::Ptr thread_info)
+    {
+        update([&](Snapshot& snapshot) { snapshot.track(thread_id, std::move(thread_info)); });
+    }
+
+    // ------------------------------------------------------------------------
+    // Track the given thread as the main thread, unless it is already tracked
+    // or we are already tracking a main thread. Returns whether the thread
+    // ended up being tracked.
+    bool track_main_thread(uintptr_t thread_id, ThreadInfo::Ptr thread_info)
+    {
+        bool tracked = false;
+
+        update([&](Snapshot& snapshot) {
+            if (snapshot.find(thread_id) != nullptr)
+            {
+                tracked = true;
+                return;
+            }
+
+            if (snapshot.main_thread_tracked())
+                return;
+
+            snapshot.track(thread_id, std::move(thread_info));
+            tracked = true;
+        });
+
+        return tracked;
+    }
+
+    // ------------------------------------------------------------------------
+    void untrack(uintptr_t thread_id)
+    {
+        update([&](Snapshot& snapshot) { snapshot.untrack(thread_id); });
+    }
+
+    // ------------------------------------------------------------------------
+    void clear()
+    {
+        update([](Snapshot& snapshot) {
+            snapshot.threads.clear();
+            snapshot.main_threads = 0;
+        });
+    }
+
+    // ------------------------------------------------------------------------
+    // Free the retired snapshots that no reader can refer to any longer. This
+    // is called by the sampler on every tick, outside of any read guard, so
+    // that snapshots do not pile up between updates. It never waits for a
+    // writer.
+    void reclaim()
+    {
+        std::unique_lock<std::mutex> guard(write_lock, std::try_to_lock);
+        if (!guard.owns_lock())
+            return;
+
+        reclaim_locked();
+    }
+
+private:
+    std::atomic<Snapshot*> current = new Snapshot();
+    std::mutex write_lock;
+
+    // Readers register with the counter of the epoch they started in. A
+    // snapshot that is retired in an epoch can be reclaimed once the readers of
+    // that epoch have drained. Only two epochs can have readers at any time, so
+    // we only move on to the next epoch once the readers of the previous one
+    // have drained.
+    std::atomic<unsigned int> epoch = 0;
+    std::atomic<unsigned int> readers[2] = {0, 0};
+
+    // The snapshots that have been replaced, with the epoch they were retired
+    // in. Protected by the write lock.
+    std::vector<std::pair<Snapshot*, unsigned int>> retired;
+
+    // ------------------------------------------------------------------------
+    unsigned int enter()
+    {
+        for (;;)
+        {
+            auto e = epoch.load();
+            readers[e & 1].fetch_add(1);
+            if (epoch.load() == e)
+                return e & 1;
+
+            // A writer moved to the next epoch in the meantime, so we retry
+            // to make sure that we are accounted for in the right one.
+            readers[e & 1].fetch_sub(1);
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    void exit(unsigned int slot)
+    {
+        readers[slot].fetch_sub(1, std::memory_order_release);
+    }
+
+    // ------------------------------------------------------------------------
+    template <typename F>
+    void update(F mutate)
+    {
+        const std::lock_guard<std::mutex> guard(write_lock);
+
+        auto* previous = current.load();
+        auto* next = new Snapshot(*previous);
+
+        mutate(*next);
+
+        current.store(next);
+
+        // Readers of the current epoch might still hold the previous snapshot.
+        retired.emplace_back(previous, epoch.load());
+
+        reclaim_locked();
+    }
+
+    // ------------------------------------------------------------------------
+    void reclaim_locked()
+    {
+        auto e = epoch.load();
+
+        // The readers of the previous epoch, if any, are still around.
+        if (readers[(e + 1) & 1].load() != 0)
+            return;
+
+        // No reader can refer to the snapshots retired before the current
+        // epoch any longer.
+        auto end = std::remove_if(retired.begin(), retired.end(), [e](auto& entry) {
+            if (entry.second == e)
+                return false;
+
+            delete entry.first;
+            return true;
+        });
+        retired.erase(end, retired.end());
+
+        // New readers register with the next epoch, so that the snapshots
+        // retired in this one can be reclaimed once its readers have drained.
+        if (!retired.empty())
+            epoch.store(e + 1);
+    }
+};
 
 // We make this a reference to a heap-allocated object so that we can avoid
 // the destruction on exit. We are in charge of cleaning up the object. Note
 // that the object will leak, but this is not a problem.
-inline std::unordered_map<uintptr_t, ThreadInfo::Ptr>& thread_info_map =
-    *(new std::unordered_map<uintptr_t, ThreadInfo::Ptr>());  // indexed by thread_id
+inline ThreadRegistry& thread_registry = *(new ThreadRegistry());
+
+// ----------------------------------------------------------------------------
+// Read what all the tracked threads are doing in the kernel. This is done once
+// per tick, before the threads are sampled.
+static void update_kernel_states()
+{
+#if defined PL_LINUX
+    TraceScope trace(Tracer::KERNEL);
 
-inline std::mutex thread_info_map_lock;
+    // We would only see ourselves reading our own state.
+    auto self = static_cast<unsigned long>(syscall(SYS_gettid));
+
+    auto threads = thread_registry.read();
+    for (auto& entry : threads->threads)
+    {
+        auto& thread = entry.second;
+        if (thread->native_id == self)
+        {
+            thread->kernel.syscall_nr = -1;
+            continue;
+        }
+
+        // The thread might have exited, in which case we cannot tell what it
+        // is doing and the update leaves it marked as not blocked.
+        thread->kernel.update(thread->native_id);
+    }
+#endif
+}
 
 // ----------------------------------------------------------------------------
 inline void ThreadInfo::unwind(PyThreadState* tstate)
 {
+    TraceScope trace(Tracer::UNWIND, native_id);
+
     if (native)
     {
         // Lock on the signal handler. Will get unlocked once the handler is
@@ -200,6 +502,14 @@ inline void ThreadInfo::unwind(PyThreadState* tstate)
         // Pass the current thread state to the signal handler. This is needed
         // to unwind the Python stack from within it.
         current_tstate = tstate;
+        sigprof_python_stack = &python_stack;
+        sigprof_native_stack = &native_stack;
+        sigprof_frame_cache = frame_cache;
+        sigprof_stack_chunk = own_stack_chunk();
+        sigprof_frame_sites = &own_frame_sites();
+#if defined PL_LINUX
+        sigprof_vm_reader = safe_copy == vmreader_safe_copy ? VmReader::get_instance() : nullptr;
+#endif
 
         // Send a signal to the thread to unwind its native stack.
 #if defined PL_DARWIN
@@ -218,6 +528,8 @@ inline void ThreadInfo::unwind(PyThreadState* tstate)
         unwind_python_stack(tstate);
         if (asyncio_loop)
         {
+            TraceScope trace_tasks(Tracer::TASKS, native_id);
+
             auto unwind_tasks_success = unwind_tasks();
             if (!unwind_tasks_success)
             {
@@ -228,6 +540,7 @@ inline void ThreadInfo::unwind(PyThreadState* tstate)
         // We make the assumption that gevent and asyncio are not mixed
         // together to keep the logic here simple. We can always revisit this
         // should there be a substantial demand for it.
+        TraceScope trace_greenlets(Tracer::GREENLETS, native_id);
         unwind_greenlets(tstate, native_id);
     }
 }
@@ -239,9 +552,18 @@ inline Result<void> ThreadInfo::unwind_tasks()
     std::unordered_set<PyObject*> parent_tasks;
     std::unordered_map<PyObject*, TaskInfo::Ref> waitee_map;  // Indexed by task origin
     std::unordered_map<PyObject*, TaskInfo::Ref> origin_map;  // Indexed by task origin
-    static std::unordered_set<PyObject*> previous_task_objects;
 
-    auto maybe_all_tasks = get_all_tasks(reinterpret_cast<PyObject*>(asyncio_loop));
+    if (current_interp == nullptr)
+    {
+        return ErrorKind::TaskInfoError;
+    }
+
+    // The task links and the tasks seen on the previous pass are tracked
+    // by the interpreter that owns the tasks.
+    auto& task_link_map = current_interp->task_link_map;
+    auto& previous_task_objects = current_interp->previous_task_objects;
+
+    auto maybe_all_tasks = get_all_tasks(reinterpret_cast<PyObject*>(asyncio_loop.load()));
     if (!maybe_all_tasks)
     {
         return ErrorKind::TaskInfoError;
@@ -249,7 +571,7 @@ inline Result<void> ThreadInfo::unwind_tasks()
 
     auto all_tasks = std::move(*maybe_all_tasks);
     {
-        std::lock_guard<std::mutex> lock(task_link_map_lock);
+        std::lock_guard<std::mutex> lock(current_interp->task_link_map_lock);
 
         // Clean up the task_link_map. Remove entries associated to tasks that
         // no longer exist.
@@ -358,7 +680,7 @@ inline Result<void> ThreadInfo::unwind_tasks()
 
             {
                 // Check for, e.g., gather links
-                std::lock_guard<std::mutex> lock(task_link_map_lock);
+                std::lock_guard<std::mutex> lock(current_interp->task_link_map_lock);
 
                 if (task_link_map.find(task_origin) != task_link_map.end() &&
                     origin_map.find(task_link_map[task_origin]) != origin_map.end())
@@ -418,7 +740,7 @@ inline void ThreadInfo::unwind_greenlets(PyThreadState* tstate, unsigned long na
         if (parent_greenlets.find(greenlet_id) != parent_greenlets.end())
             continue;
 
-        auto frame = greenlet->frame;
+        auto frame = greenlet->frame.load();
         if (frame == FRAME_NOT_SET)
         {
             // The greenlet has not been started yet or has finished
@@ -463,7 +785,7 @@ inline void ThreadInfo::unwind_greenlets(PyThreadState* tstate, unsigned long na
             if (parent_greenlet == greenlet_info_map.end())
                 break;
 
-            auto parent_frame = parent_greenlet->second->frame;
+            auto parent_frame = parent_greenlet->second->frame.load();
             if (parent_frame == FRAME_NOT_SET || parent_frame == Py_None)
                 break;
 
@@ -480,8 +802,47 @@ inline void ThreadInfo::unwind_greenlets(PyThreadState* tstate, unsigned long na
 // ----------------------------------------------------------------------------
 inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, microsecond_t delta)
 {
-    Renderer::get().render_thread_begin(tstate, name, delta, thread_id, native_id);
+    TraceScope trace(Tracer::SAMPLE, native_id);
+
+    // The thread that holds the GIL is the one that runs the garbage
+    // collector, and the one that keeps those that wait for the GIL waiting.
+    bool holds_gil = false;
+    bool waiting_for_gil = false;
+    if (current_interp != nullptr)
+    {
+        holds_gil = current_interp->gil_holder == thread_id;
+        waiting_for_gil =
+            gil_mode != GilMode::NONE && !holds_gil && this->waits_for_gil(*current_interp);
+    }
+
+    bool in_gc = gc && holds_gil && current_interp->gc_collecting;
+
+    if (gil_mode == GilMode::WAIT)
+    {
+        // We only sample the GIL holder, for as long as the other threads have
+        // been waiting for it.
+        if (!holds_gil)
+            return Result<void>::ok();
+
+        size_t waiters = 0;
+        {
+            auto threads = thread_registry.read();
+            for (auto& entry : threads->threads)
+                waiters += entry.second->waits_for_gil(*current_interp);
+        }
+
+        if (waiters == 0)
+            return Result<void>::ok();
 
+        delta *= waiters;
+    }
+
+    // Resolve the renderer once for the whole sample
+    auto renderer = Renderer::get().active();
+
+    renderer->render_thread_begin(tstate, name, delta, thread_id, native_id);
+
+    bool is_idle = false;
     if (cpu)
     {
         microsecond_t previous_cpu_time = cpu_time;
@@ -497,11 +858,40 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
             return Result<void>::ok();
         }
 
-        Renderer::get().render_cpu_time(running ? cpu_time - previous_cpu_time : 0);
+        renderer->render_cpu_time(running ? cpu_time - previous_cpu_time : 0);
+    }
+    else if (idle)
+    {
+        // Threads are idle if they have not used any CPU time since they were
+        // last sampled. There is no such thing in CPU time mode, where we only
+        // sample the threads that are running.
+        microsecond_t previous_cpu_time = cpu_time;
+        if (update_cpu_time())
+            is_idle = cpu_time == previous_cpu_time;
     }
 
+    // In wall time mode, tell what the threads that are not running are
+    // blocked on.
+    const char* blocked_in = (blocking && !cpu) ? blocking_call() : nullptr;
+
     this->unwind(tstate);
 
+    TraceScope trace_render(Tracer::RENDER, native_id);
+
+    auto render_stack_end = [&]() {
+        if (gil_mode == GilMode::TAG && (holds_gil || waiting_for_gil))
+            renderer->render_frame(
+                Frame::get(holds_gil ? StringTable::GIL_HELD : StringTable::GIL_WAIT));
+        if (blocked_in != nullptr)
+            renderer->render_frame(Frame::get(string_table.key(blocked_in)));
+        if (in_gc)
+            renderer->render_gc();
+        if (is_idle)
+            renderer->render_idle();
+
+        renderer->render_stack_end(MetricType::Time, delta);
+    };
+
     // Render in this order of priority
     // 1. asyncio Tasks stacks (if any)
     // 2. Greenlets stacks (if any)
@@ -516,9 +906,9 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
                 return ErrorKind::ThreadInfoError;
             }
 
-            const auto& task_name = maybe_task_name->get();
-            Renderer::get().render_task_begin(task_name, task_stack_info->on_cpu);
-            Renderer::get().render_stack_begin(pid, iid, name);
+            auto task_name = *maybe_task_name;
+            renderer->render_task_begin(std::string(task_name), task_stack_info->on_cpu);
+            renderer->render_stack_begin(pid, iid, name);
             if (native)
             {
                 // NOTE: These stacks might be non-sensical, especially with
@@ -528,12 +918,12 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
                     return ErrorKind::ThreadInfoError;
                 }
 
-                interleaved_stack.render();
+                interleaved_stack.render(*renderer);
             }
             else
-                task_stack_info->stack.render();
+                task_stack_info->stack.render(*renderer);
 
-            Renderer::get().render_stack_end(MetricType::Time, delta);
+            render_stack_end();
         }
 
         current_tasks.clear();
@@ -547,9 +937,9 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
                 return ErrorKind::ThreadInfoError;
             }
 
-            const auto& task_name = maybe_task_name->get();
-            Renderer::get().render_task_begin(task_name, greenlet_stack->on_cpu);
-            Renderer::get().render_stack_begin(pid, iid, name);
+            auto task_name = *maybe_task_name;
+            renderer->render_task_begin(std::string(task_name), greenlet_stack->on_cpu);
+            renderer->render_stack_begin(pid, iid, name);
 
             auto& stack = greenlet_stack->stack;
             if (native)
@@ -561,12 +951,12 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
                     return ErrorKind::ThreadInfoError;
                 }
 
-                interleaved_stack.render();
+                interleaved_stack.render(*renderer);
             }
             else
-                stack.render();
+                stack.render(*renderer);
 
-            Renderer::get().render_stack_end(MetricType::Time, delta);
+            render_stack_end();
         }
 
         current_greenlets.clear();
@@ -578,7 +968,7 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
         if (current_greenlets.empty())
         {
             // Print the PID and thread name
-            Renderer::get().render_stack_begin(pid, iid, name);
+            renderer->render_stack_begin(pid, iid, name);
             // Print the stack
             if (native)
             {
@@ -587,12 +977,12 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
                     return ErrorKind::ThreadInfoError;
                 }
 
-                interleaved_stack.render();
+                interleaved_stack.render(*renderer);
             }
             else
-                python_stack.render();
+                python_stack.render(*renderer);
 
-            Renderer::get().render_stack_end(MetricType::Time, delta);
+            render_stack_end();
         }
     }
 
@@ -600,83 +990,165 @@ inline Result<void> ThreadInfo::sample(int64_t iid, PyThreadState* tstate, micro
 }
 
 // ----------------------------------------------------------------------------
-static void for_each_thread(InterpreterInfo& interp,
-                            std::function<void(PyThreadState*, ThreadInfo&)> callback)
+// All the PyThreadState fields that we need to sample a thread lie within this
+// prefix of the structure, so we copy just this much of it, in a single read.
+#if PY_VERSION_HEX >= 0x030b0000
+constexpr size_t THREAD_STATE_COPY_SIZE =
+    offsetof(PyThreadState, datastack_chunk) + sizeof(PyThreadState::datastack_chunk);
+#else
+constexpr size_t THREAD_STATE_COPY_SIZE =
+    offsetof(PyThreadState, thread_id) + sizeof(PyThreadState::thread_id);
+#endif
+
+static_assert(offsetof(PyThreadState, next) < THREAD_STATE_COPY_SIZE, "next not copied");
+static_assert(offsetof(PyThreadState, thread_id) < THREAD_STATE_COPY_SIZE,
+              "thread_id not copied");
+#if PY_VERSION_HEX >= 0x030d0000
+static_assert(offsetof(PyThreadState, current_frame) < THREAD_STATE_COPY_SIZE,
+              "current_frame not copied");
+#elif PY_VERSION_HEX >= 0x030b0000
+static_assert(offsetof(PyThreadState, cframe) < THREAD_STATE_COPY_SIZE, "cframe not copied");
+#else
+static_assert(offsetof(PyThreadState, frame) < THREAD_STATE_COPY_SIZE, "frame not copied");
+#endif
+#if PY_VERSION_HEX >= 0x030b0000
+static_assert(offsetof(PyThreadState, native_thread_id) < THREAD_STATE_COPY_SIZE,
+              "native_thread_id not copied");
+#endif
+
+// Upper bound on the number of thread states we follow in a single walk, in
+// case we read a corrupted list.
+const constexpr size_t MAX_THREADS = 1 << 16;
+
+struct ThreadStateCopy
+{
+    PyThreadState* addr;
+    PyThreadState tstate;
+};
+
+// ----------------------------------------------------------------------------
+// Collect copies of all the thread states of the given interpreter. The list
+// can change while we walk it, so we guard against cycles with Brent's
+// algorithm, which costs nothing on the common, acyclic, path. On the rare
+// occasion that we do find a cycle, we drop the duplicates that we collected
+// before detecting it.
+static void collect_thread_states(InterpreterInfo& interp, std::vector<ThreadStateCopy>& states)
 {
-    std::unordered_set<PyThreadState*> threads;
-    std::unordered_set<PyThreadState*> seen_threads;
+    TraceScope trace(Tracer::THREAD_STATES);
 
-    threads.clear();
-    seen_threads.clear();
+    states.clear();
 
-    // Start from the thread list head
-    threads.insert(static_cast<PyThreadState*>(interp.tstate_head));
+    auto tstate_addr = static_cast<PyThreadState*>(interp.tstate_head);
+    PyThreadState* tortoise = tstate_addr;
+    size_t power = 1, lambda = 0;
+    bool cycle = false;
 
-    while (!threads.empty())
+    while (tstate_addr != NULL && states.size() < MAX_THREADS)
     {
-        // Pop the next thread
-        PyThreadState* tstate_addr = *threads.begin();
-        threads.erase(threads.begin());
-
-        // Mark the thread as seen
-        seen_threads.insert(tstate_addr);
+        states.emplace_back();
+        auto& entry = states.back();
 
         // Since threads can be created and destroyed at any time, we make
         // a copy of the structure before trying to read its fields.
-        PyThreadState tstate;
-        if (copy_type(tstate_addr, tstate))
-            // We failed to copy the thread so we skip it.
-            continue;
+        entry.addr = tstate_addr;
+        if (copy_generic(tstate_addr, &entry.tstate, THREAD_STATE_COPY_SIZE))
+        {
+            // We failed to copy the thread so we cannot go any further.
+            states.pop_back();
+            break;
+        }
 
-        // Enqueue the unseen threads that we can reach from this thread.
-        if (tstate.next != NULL && seen_threads.find(tstate.next) == seen_threads.end())
-            threads.insert(tstate.next);
-        if (tstate.prev != NULL && seen_threads.find(tstate.prev) == seen_threads.end())
-            threads.insert(tstate.prev);
+        tstate_addr = entry.tstate.next;
+        if (tstate_addr == tortoise)
+        {
+            cycle = true;
+            break;
+        }
 
+        if (++lambda == power)
         {
-            const std::lock_guard<std::mutex> guard(thread_info_map_lock);
+            tortoise = tstate_addr;
+            power <<= 1;
+            lambda = 0;
+        }
+    }
+
+    if (cycle || states.size() == MAX_THREADS)
+    {
+        std::stable_sort(states.begin(), states.end(),
+                         [](const ThreadStateCopy& a, const ThreadStateCopy& b) {
+                             return a.addr < b.addr;
+                         });
+        states.erase(std::unique(states.begin(), states.end(),
+                                 [](const ThreadStateCopy& a, const ThreadStateCopy& b) {
+                                     return a.addr == b.addr;
+                                 }),
+                     states.end());
+    }
+}
 
-            if (thread_info_map.find(tstate.thread_id) == thread_info_map.end())
+// ----------------------------------------------------------------------------
+template <typename F>
+static void for_each_thread(InterpreterInfo& interp, F callback)
+{
+    // Reused across calls to avoid allocating on every sample. Each thread
+    // that walks the thread list gets its own buffer.
+    static thread_local std::vector<ThreadStateCopy> states = []() {
+        std::vector<ThreadStateCopy> v;
+        v.reserve(256);
+        return v;
+    }();
+
+    collect_thread_states(interp, states);
+
+    for (auto& entry : states)
+    {
+        auto& tstate = entry.tstate;
+
+        {
+            auto threads = thread_registry.read();
+
+            if (auto* thread_info = threads->find(tstate.thread_id))
             {
-                // If the threading module was not imported in the target then
-                // we mistakenly take the hypno thread as the main thread. We
-                // assume that any missing thread is the actual main thread,
-                // provided we don't already have a thread with the name
-                // "MainThread". Note that this can also happen on shutdown, so
-                // we need to avoid doing anything in that case.
+                // Call back with the thread state and thread info.
+                callback(&tstate, *thread_info);
+                continue;
+            }
+
+            if (threads->main_thread_tracked())
+                continue;
+        }
+
+        // If the threading module was not imported in the target then we
+        // mistakenly take the hypno thread as the main thread. We assume that
+        // any missing thread is the actual main thread, provided we don't
+        // already have a thread with the name "MainThread". Note that this can
+        // also happen on shutdown, so we need to avoid doing anything in that
+        // case. We must be outside of the read-side critical section to track
+        // the thread.
 #if PY_VERSION_HEX >= 0x030b0000
-                auto native_id = tstate.native_thread_id;
+        auto native_id = tstate.native_thread_id;
 #else
-                auto native_id = getpid();
+        auto native_id = getpid();
 #endif
-                bool main_thread_tracked = false;
-                for (auto& kv : thread_info_map)
-                {
-                    if (kv.second->name == "MainThread")
-                    {
-                        main_thread_tracked = true;
-                        break;
-                    }
-                }
-                if (main_thread_tracked)
-                    continue;
+        auto maybe_thread_info = ThreadInfo::create(tstate.thread_id, native_id, "MainThread");
+        if (!maybe_thread_info)
+        {
+            // We failed to create the thread info object so we skip it.
+            // We'll likely try again later with the valid thread
+            // information.
+            continue;
+        }
 
-                auto maybe_thread_info =
-                    ThreadInfo::create(tstate.thread_id, native_id, "MainThread");
-                if (!maybe_thread_info)
-                {
-                    // We failed to create the thread info object so we skip it.
-                    // We'll likely try again later with the valid thread
-                    // information.
-                    continue;
-                }
+        if (!thread_registry.track_main_thread(tstate.thread_id, std::move(*maybe_thread_info)))
+            continue;
 
-                thread_info_map.emplace(tstate.thread_id, std::move(*maybe_thread_info));
-            }
+        {
+            auto threads = thread_registry.read();
 
-            // Call back with the thread state and thread info.
-            callback(&tstate, *thread_info_map.find(tstate.thread_id)->second);
+            if (auto* thread_info = threads->find(tstate.thread_id))
+                // Call back with the thread state and thread info.
+                callback(&tstate, *thread_info);
         }
     }
 }
@@ -0,0 +1,129 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <echion/vm.h>
+
+// ----------------------------------------------------------------------------
+// Remembers the memory that a sampler thread reads within a tick, so that the
+// objects that many stacks share are copied once per tick, e.g. the tasks that
+// many others are waiting on, the set of the scheduled tasks that is read for
+// every thread that runs an event loop, or the code objects that we read on a
+// frame cache miss. The reads are only cached within a TickReadScope, which
+// starts from an empty cache, so we never return data older than the tick.
+class TickReadCache
+{
+public:
+    // ------------------------------------------------------------------------
+    // Copy the given range, from the cache if we have read it already in the
+    // current tick. Returns 0 on success, like copy_memory. Failed reads are
+    // not cached, as they are rare and might succeed on retry.
+    int copy(const void* addr, size_t len, void* dest)
+    {
+        Key key = {reinterpret_cast<uintptr_t>(addr), len};
+
+        auto entry = entries.find(key);
+        if (entry != entries.end())
+        {
+            std::memcpy(dest, data.data() + entry->second, len);
+            return 0;
+        }
+
+        if (copy_generic(addr, dest, len))
+            return -1;
+
+        if (data.size() + len <= MAX_SIZE)
+        {
+            entries.emplace(key, data.size());
+            data.insert(data.end(), static_cast<char*>(dest), static_cast<char*>(dest) + len);
+        }
+
+        return 0;
+    }
+
+    // ------------------------------------------------------------------------
+    void clear()
+    {
+        entries.clear();
+
+        // Do not hold on to the memory of an unusually large tick.
+        if (data.capacity() > MAX_SIZE / 4)
+            data = std::vector<char>();
+        else
+            data.clear();
+    }
+
+private:
+    // The most data that we keep for a single tick.
+    static constexpr size_t MAX_SIZE = 1 << 20;
+
+    struct Key
+    {
+        uintptr_t addr;
+        size_t len;
+
+        bool operator==(const Key& other) const
+        {
+            return addr == other.addr && len == other.len;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<uintptr_t>()(key.addr) ^ (key.len << 1);
+        }
+    };
+
+    std::unordered_map<Key, size_t, KeyHash> entries;  // Offsets into data
+    std::vector<char> data;
+};
+
+// The cache of the current thread, while it is within a TickReadScope. This is
+// a plain pointer so that reading it is safe from signal handlers, which run
+// on the sampled threads and never have a cache.
+inline thread_local TickReadCache* tick_reads = nullptr;
+
+// ----------------------------------------------------------------------------
+// Caches the reads of the current thread for the duration of the scope.
+class TickReadScope
+{
+public:
+    TickReadScope()
+    {
+        static thread_local TickReadCache cache;
+
+        cache.clear();
+        tick_reads = &cache;
+    }
+
+    ~TickReadScope()
+    {
+        tick_reads = nullptr;
+    }
+
+    TickReadScope(const TickReadScope&) = delete;
+    TickReadScope& operator=(const TickReadScope&) = delete;
+};
+
+// ----------------------------------------------------------------------------
+inline int copy_memory_tick(const void* addr, size_t len, void* dest)
+{
+    if (tick_reads == nullptr)
+        return copy_generic(addr, dest, len);
+
+    return tick_reads->copy(addr, len, dest);
+}
+
+#define copy_type_tick(addr, dest) (copy_memory_tick(addr, sizeof(dest), &dest))
+
+#define copy_generic_tick(addr, dest, size) \
+    (copy_memory_tick(reinterpret_cast<const void*>(addr), size, reinterpret_cast<void*>(dest)))
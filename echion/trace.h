@@ -0,0 +1,187 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+// Records where the sampler spends its time. When enabled, every sampler tick
+// records a span for each of its phases in a fixed ring buffer, which keeps
+// the most recent spans and can be dumped as Chrome trace-event JSON, e.g. to
+// be opened with Perfetto. Spans nest by time, so a tick contains the spans of
+// the threads it samples, which in turn contain their unwind and render spans.
+class Tracer
+{
+public:
+    enum Phase : uint8_t
+    {
+        TICK,
+        INTERPRETERS,
+        THREAD_STATES,
+        KERNEL,
+        SAMPLE,
+        STACK_CHUNK,
+        UNWIND,
+        TASKS,
+        GREENLETS,
+        RENDER,
+        PHASE_COUNT,
+    };
+
+    struct Span
+    {
+        uint64_t start;  // ns
+        uint64_t end;    // ns
+        uint64_t arg;    // The native ID of the sampled thread, if any
+        uint32_t tid;    // The tracing thread
+        Phase phase;
+    };
+
+    // ------------------------------------------------------------------------
+    // Start recording in a ring buffer of the given number of spans, or stop
+    // recording if the size is 0.
+    void reset(size_t size)
+    {
+        enabled = false;
+
+        spans = size ? std::make_unique<Span[]>(size) : nullptr;
+        capacity = size;
+        next = 0;
+
+        enabled = size > 0;
+    }
+
+    // ------------------------------------------------------------------------
+    static inline uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // ------------------------------------------------------------------------
+    void inline record(Phase phase, uint64_t start, uint64_t end, uint64_t arg)
+    {
+        auto& span = spans[next.fetch_add(1, std::memory_order_relaxed) % capacity];
+
+        span.start = start;
+        span.end = end;
+        span.arg = arg;
+        span.tid = thread_index();
+        span.phase = phase;
+    }
+
+    // ------------------------------------------------------------------------
+    // Write the recorded spans as Chrome trace-event JSON. Spans that are
+    // being recorded while we dump might come out garbled.
+    bool dump(const std::string& path)
+    {
+        if (spans == nullptr)
+            return false;
+
+        std::ofstream output(path);
+        if (!output.is_open())
+            return false;
+
+        static const char* names[PHASE_COUNT] = {
+            "tick",        "interpreters", "thread_states", "kernel",    "sample",
+            "stack_chunk", "unwind",       "tasks",         "greenlets", "render",
+        };
+
+        size_t recorded = next.load();
+        auto count = std::min(recorded, capacity);
+        auto first = recorded - count;
+        auto pid = getpid();
+
+        // Trace event timestamps are in microseconds.
+        auto micros = [](uint64_t ns) {
+            auto fraction = std::to_string(1000 + ns % 1000);
+            return std::to_string(ns / 1000) + "." + fraction.substr(1);
+        };
+
+        output << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        const char* separator = "\n";
+        for (size_t i = 0; i < count; i++)
+        {
+            auto span = spans[(first + i) % capacity];
+            if (span.phase >= PHASE_COUNT || span.end < span.start)
+                continue;
+
+            output << separator << "{\"name\":\"" << names[span.phase]
+                   << "\",\"cat\":\"echion\",\"ph\":\"X\",\"pid\":" << pid
+                   << ",\"tid\":" << span.tid << ",\"ts\":" << micros(span.start)
+                   << ",\"dur\":" << micros(span.end - span.start);
+            if (span.arg)
+                output << ",\"args\":{\"thread\":" << span.arg << "}";
+            output << "}";
+            separator = ",\n";
+        }
+        output << "\n]}\n";
+
+        return output.good();
+    }
+
+    bool enabled = false;
+
+private:
+    std::unique_ptr<Span[]> spans = nullptr;
+    size_t capacity = 0;
+    std::atomic<size_t> next = 0;
+
+    // ------------------------------------------------------------------------
+    // A small, stable number for each thread that records spans.
+    static uint32_t thread_index()
+    {
+        static std::atomic<uint32_t> count = 0;
+        static thread_local uint32_t index = ++count;
+
+        return index;
+    }
+};
+
+// We make this a reference to a heap-allocated object so that we can avoid
+// the destruction on exit.
+inline Tracer& tracer = *(new Tracer());
+
+// ----------------------------------------------------------------------------
+// Records a span for the scope, when tracing is enabled.
+class TraceScope
+{
+public:
+    TraceScope(Tracer::Phase phase, uint64_t arg = 0)
+        : phase(phase), arg(arg), start(tracer.enabled ? Tracer::now() : 0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        end();
+    }
+
+    // End the span before the end of the scope.
+    void end()
+    {
+        if (start && tracer.enabled)
+            tracer.record(phase, start, Tracer::now(), arg);
+
+        start = 0;
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    Tracer::Phase phase;
+    uint64_t arg;
+    uint64_t start;
+};
@@ -8,7 +8,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <echion/danger.h>
 
@@ -30,6 +32,7 @@ ssize_t process_vm_readv(pid_t, const struct iovec*, unsigned long liovcnt,
 #define copy_type(addr, dest) (copy_memory(pid, addr, sizeof(dest), &dest))
 #define copy_type_p(addr, dest) (copy_memory(pid, addr, sizeof(*dest), dest))
 #define copy_generic(addr, dest, size) (copy_memory(pid, reinterpret_cast<const void*>(addr), size, reinterpret_cast<void*>(dest)))
+#define copy_view(addr, size) (copy_memory_view(pid, reinterpret_cast<const void*>(addr), size))
 
 #elif defined PL_DARWIN
 #include <mach/mach.h>
@@ -44,6 +47,7 @@ typedef mach_port_t proc_ref_t;
 #define copy_type_p(addr, dest) (copy_memory(mach_task_self(), addr, sizeof(*dest), dest))
 #define copy_generic(addr, dest, size) \
     (copy_memory(mach_task_self(), (void*)(addr), size, (void*)(dest)))
+#define copy_view(addr, size) (copy_memory_view(mach_task_self(), (void*)(addr), size))
 
 inline kern_return_t (*safe_copy)(vm_map_read_t, mach_vm_address_t, mach_vm_size_t, mach_vm_address_t, mach_vm_size_t*) = mach_vm_read_overwrite;
 
@@ -76,12 +80,22 @@ inline bool failed_safe_copy = false;
 inline ssize_t (*safe_copy)(pid_t, const struct iovec*, unsigned long, const struct iovec*,
                             unsigned long, unsigned long) = process_vm_readv;
 
+// Reads memory by writing it to a file in a temporary file system, which we
+// have mapped in memory. The kernel checks the addresses for us, like with
+// process_vm_readv. Each thread has a reader of its own, since all the reads go
+// to the start of the file.
 class VmReader
 {
     void* buffer{nullptr};
     size_t sz{0};
     int fd{-1};
-    inline static VmReader* instance{nullptr};  // Prevents having to set this in implementation
+    inline static thread_local std::unique_ptr<VmReader> instance{nullptr};
+    inline static thread_local bool failed{false};
+
+    // The reader that a signal handler borrows from the sampling thread, if
+    // any (see Borrow).
+    inline static thread_local VmReader* borrowed{nullptr};
+    inline static thread_local bool borrowing{false};
 
     VmReader(size_t _sz, void* _buffer, int _fd) : buffer(_buffer), sz{_sz}, fd{_fd} {}
 
@@ -115,8 +129,8 @@ class VmReader
                 continue;
             }
 
-            // Map the file
-            ret = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            // Map the file. We see what we write to it through the mapping.
+            ret = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
             if (ret == MAP_FAILED)
             {
                 ret = nullptr;
@@ -135,62 +149,107 @@ class VmReader
         return buffer != nullptr;
     }
 
+    // Make sure that the buffer can take the given number of bytes.
+    bool reserve(size_t size)
+    {
+        if (size <= sz)
+            return true;
+
+        if (ftruncate(fd, size) == -1)
+            return false;
+
+        void* tmp = mremap(buffer, sz, size, MREMAP_MAYMOVE);
+        if (tmp == MAP_FAILED)
+            return false;
+
+        buffer = tmp;  // no need to munmap
+        sz = size;
+
+        return true;
+    }
+
 public:
+    // Lends a reader to a signal handler, which must not create one of its
+    // own. Without a reader, the reads of the handler fail.
+    class Borrow
+    {
+    public:
+        explicit Borrow(VmReader* reader)
+        {
+            borrowed = reader;
+            borrowing = true;
+        }
+
+        ~Borrow()
+        {
+            borrowing = false;
+            borrowed = nullptr;
+        }
+    };
+
     static VmReader* get_instance()
     {
-        if (instance == nullptr)
+        if (borrowing)
+            return borrowed;
+
+        if (instance == nullptr && !failed)
         {
-            instance = VmReader::create(1024 * 1024);  // A megabyte?
-            if (!instance)
+            instance.reset(VmReader::create(1024 * 1024));  // A megabyte?
+            if (!instance->is_valid())
             {
                 std::cerr << "Failed to initialize VmReader with buffer size " << instance->sz
                           << std::endl;
+                instance = nullptr;
+                failed = true;
                 return nullptr;
             }
         }
 
-        return instance;
+        return instance.get();
     }
 
+    // Read the remote chunks of memory one after the other into the buffer,
+    // and then spread them over the local ones, like process_vm_readv does.
     ssize_t safe_copy(pid_t pid, const struct iovec* local_iov, unsigned long liovcnt,
                       const struct iovec* remote_iov, unsigned long riovcnt, unsigned long flags)
     {
         (void)pid;
         (void)flags;
-        if (liovcnt != 1 || riovcnt != 1)
-        {
-            // Unsupported
-            return 0;
-        }
 
-        // Check to see if we need to resize the buffer
-        if (remote_iov[0].iov_len > sz)
-        {
-            if (ftruncate(fd, remote_iov[0].iov_len) == -1)
-            {
-                return 0;
-            }
-            else
-            {
-                void* tmp = mremap(buffer, sz, remote_iov[0].iov_len, MREMAP_MAYMOVE);
-                if (tmp == MAP_FAILED)
-                {
-                    return 0;
-                }
-                buffer = tmp;  // no need to munmap
-                sz = remote_iov[0].iov_len;
-            }
-        }
+        size_t total = 0;
+        for (unsigned long i = 0; i < riovcnt; i++)
+            total += remote_iov[i].iov_len;
+
+        if (!reserve(total))
+            return -1;
 
         ssize_t ret = pwritev(fd, remote_iov, riovcnt, 0);
-        if (ret == -1)
-        {
+        if (ret <= 0)
             return ret;
+
+        // Copy the data from the buffer to the local chunks
+        size_t offset = 0;
+        for (unsigned long i = 0; i < liovcnt && offset < static_cast<size_t>(ret); i++)
+        {
+            size_t n = std::min(local_iov[i].iov_len, static_cast<size_t>(ret) - offset);
+            std::memcpy(local_iov[i].iov_base, static_cast<char*>(buffer) + offset, n);
+            offset += n;
         }
 
-        // Copy the data from the buffer to the remote process
-        std::memcpy(local_iov[0].iov_base, buffer, local_iov[0].iov_len);
-        return ret;
+        return offset;
+    }
+
+    // Read a chunk of remote memory into the buffer and return it, sparing
+    // the copy to a local buffer. The view is valid until the next read.
+    const void* view(const void* addr, size_t len)
+    {
+        if (!reserve(len))
+            return nullptr;
+
+        if (pwrite(fd, addr, len, 0) != static_cast<ssize_t>(len))
+            return nullptr;
+
+        return buffer;
     }
 
     ~VmReader()
@@ -203,7 +262,6 @@ public:
         {
             close(fd);
         }
-        instance = nullptr;
     }
 };
 
@@ -326,6 +384,17 @@ static inline int copy_memory(proc_ref_t proc_ref, const void* addr, ssize_t len
         return result;
     }
 
+    // Within a batch of reads the fault handler is already armed, so we can
+    // read the memory directly, unless we know that it would fault.
+    if (auto* faulted = t_fault_batch)
+    {
+        if (faulted->contain(addr, len))
+            return -1;
+
+        memcpy(buf, addr, len);
+        return 0;
+    }
+
 #if defined PL_LINUX
     struct iovec local[1];
     struct iovec remote[1];
@@ -349,6 +418,55 @@ static inline int copy_memory(proc_ref_t proc_ref, const void* addr, ssize_t len
     return len != result;
 }
 
+/**
+ * Read a chunk of memory and return a view of it, which is only valid until
+ * the next read of the calling thread. The VmReader backend returns a view of
+ * its own buffer, which spares a copy, and any other backend reads into a
+ * buffer of the calling thread.
+ *
+ * @return  the view, or NULL on failure.
+ */
+static inline const void* copy_memory_view(proc_ref_t proc_ref, const void* addr, ssize_t len)
+{
+    if (len < 0 || reinterpret_cast<uintptr_t>(addr) < 4096)
+        return NULL;
+
+#if defined PL_LINUX
+    if (safe_copy == vmreader_safe_copy)
+    {
+        auto reader = VmReader::get_instance();
+        return reader != nullptr ? reader->view(addr, len) : NULL;
+    }
+#endif
+
+    static thread_local std::vector<char> scratch(4096);
+    if (static_cast<size_t>(len) > scratch.size())
+        scratch.resize(len);
+
+    return copy_memory(proc_ref, addr, len, scratch.data()) ? NULL : scratch.data();
+}
+
+/**
+ * Run a batch of reads with copy_memory.
+ *
+ * Only the memcpy backend can fault on a read, and it arms its fault handler
+ * just once for the whole batch, so the reads must follow the rules of
+ * safe_memcpy_batch. With any other backend the reads simply run.
+ *
+ * @return  whether the reads completed without a fault.
+ */
+template <typename F>
+inline bool copy_memory_batch(F&& reads)
+{
+    if (safe_copy != safe_memcpy_wrapper)
+    {
+        reads();
+        return true;
+    }
+
+    return safe_memcpy_batch(reads);
+}
+
 inline pid_t pid = 0;
 
 inline void _set_pid(pid_t _pid)
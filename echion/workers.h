@@ -0,0 +1,169 @@
+// This file is part of "echion" which is released under MIT.
+//
+// Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+#pragma once
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <echion/interp.h>
+#include <echion/render.h>
+#include <echion/threads.h>
+#include <echion/tick_reads.h>
+#include <echion/timing.h>
+
+// ----------------------------------------------------------------------------
+// A thread to sample in the current tick.
+class SampleJob
+{
+public:
+    InterpreterState::Ptr interp;
+    int64_t iid;
+    ThreadInfo::Ptr thread;
+    PyThreadState tstate;
+
+    SampleJob(InterpreterState::Ptr interp, int64_t iid, ThreadInfo::Ptr thread,
+              PyThreadState* tstate)
+        : interp(std::move(interp)), iid(iid), thread(std::move(thread))
+    {
+        // We only have a copy of the fields we need from the thread state.
+        std::memcpy(&this->tstate, tstate, THREAD_STATE_COPY_SIZE);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// A pool of sampler workers that share the threads to sample within the same
+// tick. The thread that calls sample takes part as the first worker, so a pool
+// of N workers runs N - 1 threads of its own. Each worker unwinds with its own
+// frame cache shard and renders into its own batch.
+class SamplerWorkers
+{
+public:
+    SamplerWorkers(size_t n) : n(n)
+    {
+        for (size_t i = 1; i < n; i++)
+            threads.emplace_back([this, i]() { run(i); });
+    }
+
+    ~SamplerWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            stopping = true;
+        }
+        start_cv.notify_all();
+
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    SamplerWorkers(const SamplerWorkers&) = delete;
+    SamplerWorkers& operator=(const SamplerWorkers&) = delete;
+
+    // Sample all the given threads and wait for the workers to be done.
+    void sample(std::vector<SampleJob>& jobs, microsecond_t delta)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            this->jobs = &jobs;
+            this->delta = delta;
+            next_job = 0;
+            pending = n;
+            tick++;
+        }
+        start_cv.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> guard(lock);
+        done_cv.wait(guard, [this]() { return pending == 0; });
+        this->jobs = nullptr;
+    }
+
+private:
+    size_t n;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    uint64_t tick = 0;
+    size_t pending = 0;
+    bool stopping = false;
+
+    std::vector<SampleJob>* jobs = nullptr;
+    microsecond_t delta = 0;
+    std::atomic<size_t> next_job = 0;
+
+    // Serialises the workers when the renderer does not support batches.
+    std::mutex render_lock;
+
+    // ------------------------------------------------------------------------
+    void run(size_t index)
+    {
+        uint64_t last_tick = 0;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                start_cv.wait(guard, [&]() { return stopping || tick != last_tick; });
+
+                if (stopping)
+                    return;
+
+                last_tick = tick;
+            }
+
+            work(index);
+        }
+    }
+
+    // ------------------------------------------------------------------------
+    void work(size_t index)
+    {
+        auto renderer = Renderer::get().active();
+        bool batch = renderer->begin_batch();
+
+        TickReadScope reads;
+
+        // Workers pick the next job as they become free, so that the threads
+        // with the deepest stacks do not hold back the others.
+        for (size_t i = next_job++; i < jobs->size(); i = next_job++)
+        {
+            auto& job = (*jobs)[i];
+
+            InterpreterScope scope(job.interp, index);
+
+            std::unique_lock<std::mutex> render_guard(render_lock, std::defer_lock);
+            if (!batch)
+                render_guard.lock();
+
+            auto sample_success = job.thread->sample(job.iid, &job.tstate, delta);
+            if (!sample_success)
+            {
+                // Silently skip sampling this thread
+            }
+        }
+
+        if (batch)
+            renderer->end_batch();
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            if (--pending == 0)
+                done_cv.notify_one();
+        }
+    }
+};
@@ -39,7 +39,30 @@ echionmodule = Extension(
     define_macros=[(f"PL_{PLATFORM.upper()}", None)],
     extra_compile_args=["-std=c++17", "-Wall", "-Wextra"] + CFLAGS + COLORS,
     extra_link_args=LDADD.get(PLATFORM, []),
-    libraries=["unwind", "lzma"] if (PLATFORM != "darwin" and not DISABLE_NATIVE) else []
+    libraries=(["unwind", "lzma"] if (PLATFORM != "darwin" and not DISABLE_NATIVE) else [])
+    + ["z"],
+)
+
+# The microbenchmarks of the sampling hot path (see benchmarks/micro.py)
+benchmarks = (
+    [
+        Extension(
+            "benchmarks._micro",
+            sources=[
+                "benchmarks/micro.cc",
+                "echion/frame.cc",
+                "echion/render.cc",
+                "echion/danger.cc",
+            ],
+            include_dirs=echionmodule.include_dirs,
+            define_macros=echionmodule.define_macros,
+            extra_compile_args=["-O2"] + echionmodule.extra_compile_args,
+            extra_link_args=echionmodule.extra_link_args,
+            libraries=echionmodule.libraries,
+        )
+    ]
+    if os.environ.get("ECHION_BUILD_BENCHMARKS")
+    else []
 )
 
 setup(
@@ -51,9 +74,9 @@ setup(
     .replace(
         'src="art/', 'src="https://raw.githubusercontent.com/P403n1x87/echion/main/art/'
     ),
-    ext_modules=[echionmodule],
+    ext_modules=[echionmodule] + benchmarks,
     entry_points={
         "console_scripts": ["echion=echion.__main__:main"],
     },
-    packages=find_packages(exclude=["tests"]),
+    packages=find_packages(exclude=["tests", "benchmarks"]),
 )
@@ -0,0 +1,38 @@
+import socket
+import threading
+from time import sleep
+
+
+def sleeper():
+    sleep(1)
+
+
+def reader(sock):
+    sock.recv(1)
+
+
+def waiter(lock):
+    lock.acquire()
+
+
+if __name__ == "__main__":
+    lock = threading.Lock()
+    lock.acquire()
+
+    a, b = socket.socketpair()
+
+    threads = [
+        threading.Thread(target=sleeper, name="Sleeper"),
+        threading.Thread(target=reader, args=(a,), name="Reader"),
+        threading.Thread(target=waiter, args=(lock,), name="Waiter"),
+    ]
+    for thread in threads:
+        thread.start()
+
+    sleep(1)
+
+    b.send(b"x")
+    lock.release()
+
+    for thread in threads:
+        thread.join()
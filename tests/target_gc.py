@@ -0,0 +1,37 @@
+import gc
+import threading
+from time import monotonic as time
+from time import sleep
+
+
+class Node:
+    def __init__(self):
+        self.other = self
+
+
+def make_garbage():
+    return [Node() for _ in range(100000)]
+
+
+def collect_garbage():
+    gc.collect()
+
+
+def idle():
+    sleep(1.5)
+
+
+def main():
+    end = time() + 1
+    while time() < end:
+        make_garbage()
+        collect_garbage()
+
+
+if __name__ == "__main__":
+    gc.disable()
+
+    thread = threading.Thread(target=idle, name="SecondaryThread")
+    thread.start()
+    main()
+    thread.join()
@@ -0,0 +1,17 @@
+import threading
+from time import monotonic as time
+
+
+def spin():
+    end = time() + 1
+    i = 0
+    while time() < end:
+        i += 1
+
+
+if __name__ == "__main__":
+    threads = [threading.Thread(target=spin, name=f"Spinner-{i}") for i in range(2)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
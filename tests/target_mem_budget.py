@@ -0,0 +1,23 @@
+# This file is part of "echion" which is released under MIT.
+#
+# Copyright (c) 2023 Gabriele N. Tornetta <phoenix1987@gmail.com>.
+
+from time import monotonic as time
+
+
+def make(n):
+    # Each function allocates from a stack of its own.
+    ns = {}
+    exec(f"def alloc_{n}():\n    return [str(i) for i in range(50)]\n", ns)
+    return ns[f"alloc_{n}"]
+
+
+if __name__ == "__main__":
+    functions = [make(n) for n in range(3_000)]
+
+    kept = []
+    end = time() + 1
+    while time() < end:
+        for f in functions:
+            kept.append(f())
+        del kept[:-1_000]
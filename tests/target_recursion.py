@@ -0,0 +1,18 @@
+from time import sleep
+
+
+def f(n):
+    if n > 1:
+        return f(n - 1)
+
+    sleep(1)
+
+
+def main():
+    # Recursions whose depths differ by a multiple of 64
+    f(2)
+    f(130)
+
+
+if __name__ == "__main__":
+    main()
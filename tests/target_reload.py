@@ -0,0 +1,17 @@
+import gc
+from time import monotonic as time
+
+
+def run(n):
+    # Compile a new function on every iteration and drop it once done, so that
+    # the memory of its code object and of its name is reused by the next one.
+    ns = {}
+    exec(f"def fn_{n}(end, time):\n    while time() < end:\n        pass\n", ns)
+    ns[f"fn_{n}"](time() + 0.3, time)
+    del ns
+    gc.collect()
+
+
+if __name__ == "__main__":
+    for n in range(8):
+        run(n)
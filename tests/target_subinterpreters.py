@@ -0,0 +1,49 @@
+from threading import Thread
+
+try:
+    import _interpreters as interpreters
+except ImportError:
+    import _xxsubinterpreters as interpreters
+
+
+CODE = """
+from time import monotonic as time
+
+
+def sub_leaf(end):
+    while time() < end:
+        pass
+
+
+def sub_main():
+    sub_leaf(time() + 1)
+
+
+sub_main()
+"""
+
+
+def worker(interp_id):
+    interpreters.run_string(interp_id, CODE)
+
+
+def main_leaf(end):
+    from time import monotonic as time
+
+    while time() < end:
+        pass
+
+
+if __name__ == "__main__":
+    from time import monotonic as time
+
+    interp_id = interpreters.create()
+
+    t = Thread(target=worker, args=(interp_id,), name="Worker")
+    t.start()
+
+    main_leaf(time() + 1)
+
+    t.join()
+
+    interpreters.destroy(interp_id)
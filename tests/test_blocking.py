@@ -0,0 +1,45 @@
+import sys
+import typing as t
+
+import pytest
+
+from tests.utils import PROFILES
+from tests.utils import run_echion
+
+
+@pytest.mark.skipif(sys.platform != "linux", reason="Blocking calls are only reported on Linux")
+def test_blocking():
+    output_file = PROFILES / "test_blocking.txt"
+
+    result = run_echion(
+        "--blocking",
+        "--output-format",
+        "collapsed",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target_blocking",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    leaves: t.Dict[t.Tuple[str, str], int] = {}
+    for line in output_file.read_text().splitlines():
+        stack, _, value = line.rpartition(" ")
+        frames = stack.split(";")
+        key = (frames[0], frames[-1])
+        leaves[key] = leaves.get(key, 0) + int(value)
+
+    def total(thread: str, *calls: str) -> int:
+        return sum(leaves.get((thread, f":{call}:"), 0) for call in calls)
+
+    # Each thread is blocked in a different kind of system call. Sleeps are
+    # implemented with different calls across versions and platforms.
+    assert total("Sleeper", "clock_nanosleep", "nanosleep", "select", "pselect6") >= 0.5e6
+    assert total("Reader", "recvfrom", "read", "poll", "ppoll") >= 0.5e6
+    assert total("Waiter", "futex") >= 0.5e6
+
+    # The sampler is running while it reads what the other threads are doing.
+    assert not any(
+        thread == "echion.core.sampler" and leaf.startswith(":") for thread, leaf in leaves
+    )
@@ -0,0 +1,70 @@
+import sys
+import typing as t
+
+from tests.utils import PROFILES
+from tests.utils import run_echion
+
+
+def test_collapsed():
+    output_file = PROFILES / "test_collapsed.txt"
+
+    result = run_echion(
+        "--output-format",
+        "collapsed",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    stacks: t.Dict[t.Tuple[str, ...], int] = {}
+    for line in output_file.read_text().splitlines():
+        stack, _, value = line.rpartition(" ")
+        frames = tuple(stack.split(";"))
+
+        # Each distinct stack is folded into a single line, even when its
+        # frames were sampled at different lines.
+        assert frames not in stacks, stack
+        stacks[frames] = int(value)
+
+    def query(thread: str, frames: t.Tuple[str, ...]) -> int:
+        return sum(
+            v
+            for stack, v in stacks.items()
+            for i in range(1, len(stack) - len(frames) + 1)
+            if stack[0] == thread and stack[i : i + len(frames)] == frames
+        )
+
+    assert query("MainThread", ("main", "bar")) >= 2.5e6
+    assert query("SecondaryThread", ("main", "bar", "foo", "cpu_sleep")) >= 0.8e6
+
+
+def test_collapsed_recursion():
+    output_file = PROFILES / "test_collapsed_recursion.txt"
+
+    result = run_echion(
+        "--output-format",
+        "collapsed",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target_recursion",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    depths: t.Dict[int, int] = {}
+    for line in output_file.read_text().splitlines():
+        stack, _, value = line.rpartition(" ")
+        frames = stack.split(";")
+        if not frames[0] == "MainThread" or "main" not in frames:
+            continue
+
+        depth = frames.count("f")
+        depths[depth] = depths.get(depth, 0) + int(value)
+
+    # Recursions of different depths are kept apart.
+    assert depths.get(2, 0) >= 0.8e6, depths
+    assert depths.get(130, 0) >= 0.8e6, depths
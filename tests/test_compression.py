@@ -0,0 +1,49 @@
+import gzip
+import sys
+import zlib
+
+from austin.format.mojo import MojoFile
+
+from tests.utils import PROFILES
+from tests.utils import DataSummary
+from tests.utils import run_echion
+
+
+def test_compression():
+    output_file = PROFILES / "test_compression.mojo.gz"
+
+    result = run_echion(
+        "--output-compression",
+        "gzip",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    compressed = output_file.read_bytes()
+    data = gzip.decompress(compressed)
+
+    mojo_file = output_file.with_suffix("")
+    mojo_file.write_bytes(data)
+
+    m = MojoFile(mojo_file.open(mode="rb"))
+    m.unwind()
+
+    summary = DataSummary(m)
+    assert summary.query("0:MainThread", ("main", "bar")) is not None
+
+    # A truncated file can still be decompressed up to its last complete frame.
+    truncated = compressed[: len(compressed) * 3 // 4]
+    recovered = b""
+    while truncated:
+        frame = zlib.decompressobj(16 + zlib.MAX_WBITS)
+        chunk = frame.decompress(truncated)
+        if not frame.eof:
+            break
+        recovered += chunk
+        truncated = frame.unused_data
+
+    assert recovered and data.startswith(recovered)
@@ -0,0 +1,52 @@
+import sys
+import typing as t
+from subprocess import CalledProcessError
+
+import pytest
+
+from tests.utils import PROFILES
+from tests.utils import run_echion
+
+
+def test_gc_idle():
+    output_file = PROFILES / "test_gc_idle.txt"
+
+    result = run_echion(
+        "--gc",
+        "--idle",
+        "--output-format",
+        "collapsed",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target_gc",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    stacks: t.Dict[t.Tuple[str, ...], int] = {}
+    for line in output_file.read_text().splitlines():
+        stack, _, value = line.rpartition(" ")
+        frames = tuple(stack.split(";"))
+        stacks[frames] = stacks.get(frames, 0) + int(value)
+
+    def total(predicate: t.Callable[[t.Tuple[str, ...]], bool]) -> int:
+        return sum(v for stack, v in stacks.items() if predicate(stack))
+
+    # The collections show up as a leaf frame of the thread that runs them.
+    assert total(lambda s: s[0] == "MainThread" and s[-2:] == ("collect_garbage", ":GC:")) > 0
+    assert total(lambda s: s[0] != "MainThread" and ":GC:" in s) == 0
+
+    # The thread that sleeps is idle, and the one that runs is not.
+    assert total(lambda s: s[0] == "SecondaryThread" and s[-2:] == ("idle", ":IDLE:")) >= 1e6
+    assert total(lambda s: s[0] == "MainThread" and "make_garbage" in s and ":IDLE:" in s) < total(
+        lambda s: s[0] == "MainThread" and "make_garbage" in s
+    ) / 2
+
+
+def test_idle_cpu():
+    # CPU time mode only samples the threads that are running.
+    with pytest.raises(CalledProcessError) as e:
+        run_echion("--cpu", "--idle", sys.executable, "-m", "tests.target_gc")
+
+    assert b"wall time mode" in e.value.stderr
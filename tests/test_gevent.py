@@ -71,3 +71,67 @@ def test_gevent():
         )
         is not None
     )
+
+
+def test_greenlet_tracer():
+    from greenlet import getcurrent, gettrace, greenlet, settrace
+
+    import echion.core as echion
+
+    tracked = []
+    events = []
+
+    def track(g):
+        tracked.append(id(g))
+        echion.track_greenlet(id(g), type(g).__qualname__, False)
+
+    def original_tracer(event, args):
+        events.append((event, *map(id, args)))
+
+    def child():
+        main.switch()
+
+    main = getcurrent()
+    g = greenlet(child)
+
+    previous_tracer = gettrace()
+    echion.init_greenlets(track, original_tracer)
+    settrace(echion.greenlet_tracer)
+    try:
+        g.switch()
+        g.switch()
+    finally:
+        settrace(previous_tracer)
+        echion.init_greenlets(None, None)
+
+    for t in tracked:
+        echion.untrack_greenlet(t)
+
+    # Each greenlet is tracked the first time it is seen by the tracer, and
+    # the tracer we replaced still sees every switch.
+    assert sorted(tracked) == sorted((id(main), id(g)))
+    assert events == [
+        ("switch", id(main), id(g)),
+        ("switch", id(g), id(main)),
+        ("switch", id(main), id(g)),
+        ("switch", id(g), id(main)),
+    ]
+
+
+def test_greenlet_untrack_from_finalizer():
+    import echion.core as echion
+
+    class Frame:
+        def __del__(self):
+            # This runs when echion drops the greenlet info, and must not
+            # deadlock on the greenlet map lock.
+            echion.untrack_greenlet(2)
+
+    echion.track_greenlet(2, "other", False)
+    echion.track_greenlet(1, "finalized", Frame())
+    echion.untrack_greenlet(1)
+
+    echion.track_greenlet(2, "other", False)
+    echion.track_greenlet(1, "finalized", Frame())
+    echion.track_greenlet(1, "finalized", False)
+    echion.untrack_greenlet(1)
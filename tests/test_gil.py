@@ -0,0 +1,64 @@
+import sys
+import typing as t
+
+import pytest
+
+from tests.utils import PROFILES
+from tests.utils import run_echion
+
+
+def run_gil(mode: str) -> t.Dict[t.Tuple[str, ...], int]:
+    output_file = PROFILES / f"test_gil_{mode}.txt"
+
+    result = run_echion(
+        "--gil",
+        mode,
+        "--output-format",
+        "collapsed",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target_gil",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    stacks: t.Dict[t.Tuple[str, ...], int] = {}
+    for line in output_file.read_text().splitlines():
+        stack, _, value = line.rpartition(" ")
+        frames = tuple(stack.split(";"))
+        stacks[frames] = stacks.get(frames, 0) + int(value)
+
+    return stacks
+
+
+@pytest.mark.skipif(sys.platform != "linux", reason="GIL waiters are only detected on Linux")
+def test_gil_tag():
+    stacks = run_gil("tag")
+
+    def total(leaf: str) -> int:
+        return sum(
+            v
+            for stack, v in stacks.items()
+            if stack[0].startswith("Spinner-") and stack[-2:] == ("spin", leaf)
+        )
+
+    # The spinning threads take turns at holding the GIL, while the other
+    # waits for it.
+    assert total(":GIL held:") >= 0.5e6
+    assert total(":GIL wait:") >= 0.2e6
+
+    # The sampler never holds the GIL while sampling.
+    assert not any(
+        ":GIL held:" in stack for stack in stacks if stack[0] == "echion.core.sampler"
+    )
+
+
+@pytest.mark.skipif(sys.platform != "linux", reason="GIL waiters are only detected on Linux")
+def test_gil_wait():
+    stacks = run_gil("wait")
+
+    # Only the GIL holder is sampled, while another thread waits for it.
+    assert sum(v for stack, v in stacks.items() if stack[0].startswith("Spinner-")) >= 0.3e6
+    assert not any(stack[0] == "echion.core.sampler" for stack in stacks)
+    assert not any(":GIL held:" in stack or ":GIL wait:" in stack for stack in stacks)
@@ -22,3 +22,20 @@ def test_memory():
     assert (
         summary.query("0:MainThread", (("<module>", 25), ("leak", 21))) is not None
     ), summary.threads["0:MainThread"]
+
+
+@retry_on_valueerror()
+def test_memory_budget():
+    result, data = run_target("target_mem_budget", "-m", "--memory-budget", "1")
+    assert result.returncode == 0, result.stderr.decode()
+
+    assert data is not None
+    md = data.metadata
+    assert md["mode"] == "memory"
+
+    # The stacks alone take more than the budget, so we must have evicted
+    # something and reported it.
+    assert "eviction" in md
+
+    # The evictions brought our own footprint back within budget.
+    assert 0 < int(md["footprint"]) <= 1 << 20
@@ -0,0 +1,103 @@
+import gzip
+import sys
+import typing as t
+
+from tests.utils import PROFILES
+from tests.utils import run_echion
+
+
+def fields(data: bytes) -> t.Iterator[t.Tuple[int, t.Union[int, bytes]]]:
+    # Just enough of the protobuf wire format to read a pprof profile.
+    def varint(i: int) -> t.Tuple[int, int]:
+        value = shift = 0
+        while True:
+            byte = data[i]
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            i += 1
+            if byte < 0x80:
+                return value, i
+
+    i = 0
+    while i < len(data):
+        key, i = varint(i)
+        if key & 7 == 0:
+            value, i = varint(i)
+            yield key >> 3, value
+        else:
+            size, i = varint(i)
+            yield key >> 3, data[i : i + size]
+            i += size
+
+
+def decode_packed(data: bytes) -> t.List[int]:
+    values = []
+    value = shift = 0
+    for byte in data:
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            values.append(value)
+            value = shift = 0
+    return values
+
+
+def test_pprof():
+    output_file = PROFILES / "test_pprof.pb.gz"
+
+    result = run_echion(
+        "--output-format",
+        "pprof",
+        "-o",
+        str(output_file),
+        sys.executable,
+        "-m",
+        "tests.target",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    profile = list(fields(gzip.decompress(output_file.read_bytes())))
+
+    strings = [v.decode() for f, v in profile if f == 6]
+    assert strings[0] == ""
+
+    sample_types = [dict(fields(v)) for f, v in profile if f == 1]
+    assert [strings[_[1]] for _ in sample_types] == ["samples", "wall"]
+
+    functions = {}
+    for f, v in profile:
+        if f == 5:
+            function = dict(fields(v))
+            functions[function[1]] = strings[function[2]]
+
+    locations = {}
+    for f, v in profile:
+        if f == 4:
+            location = dict(fields(v))
+            locations[location[1]] = functions[dict(fields(location[4]))[1]]
+
+    stacks: t.Dict[t.Tuple[str, t.Tuple[str, ...]], int] = {}
+    for f, v in profile:
+        if f != 2:
+            continue
+
+        sample = list(fields(v))
+        ids = decode_packed(next(v for n, v in sample if n == 1))
+        values = decode_packed(next(v for n, v in sample if n == 2))
+        thread = strings[dict(fields(next(v for n, v in sample if n == 3)))[2]]
+
+        # The locations go from the leaf to the root.
+        stack = tuple(locations[_] for _ in reversed(ids))
+        stacks[(thread, stack)] = stacks.get((thread, stack), 0) + values[1]
+
+    def query(thread: str, frames: t.Tuple[str, ...]) -> int:
+        return sum(
+            v
+            for (name, stack), v in stacks.items()
+            for i in range(len(stack) - len(frames) + 1)
+            if name == thread and stack[i : i + len(frames)] == frames
+        )
+
+    assert query("MainThread", ("main", "bar")) >= 2.5e6
+    assert query("SecondaryThread", ("main", "bar", "foo", "cpu_sleep")) >= 0.8e6
+
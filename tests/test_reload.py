@@ -0,0 +1,16 @@
+from tests.utils import DataSummary
+from tests.utils import run_target
+from tests.utils import retry_on_valueerror
+
+
+@retry_on_valueerror()
+def test_reload():
+    result, data = run_target("target_reload")
+    assert result.returncode == 0 and data, result.stderr.decode()
+
+    summary = DataSummary(data)
+
+    # Code objects and names are allocated at the addresses of the ones that
+    # have been freed. Each function must still be reported with its own name.
+    for n in range(8):
+        assert summary.query("0:MainThread", ("run", f"fn_{n}")) is not None, n
@@ -0,0 +1,41 @@
+import sys
+
+from austin.format.mojo import MojoFile
+
+from tests.utils import PROFILES
+from tests.utils import DataSummary
+from tests.utils import run_echion
+
+
+def test_rotation():
+    for chunk in PROFILES.glob("test_rotation.*.mojo"):
+        chunk.unlink()
+
+    result = run_echion(
+        "--rotate-interval",
+        "1",
+        "-o",
+        str(PROFILES / "test_rotation.mojo"),
+        sys.executable,
+        "-m",
+        "tests.target",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    chunks = sorted(PROFILES.glob("test_rotation.*.mojo"))
+    assert len(chunks) >= 2, chunks
+
+    # Each chunk can be decoded on its own.
+    total = 0
+    for chunk in chunks:
+        m = MojoFile(chunk.open(mode="rb"))
+        m.unwind()
+
+        assert m.metadata["mode"] == "wall"
+
+        summary = DataSummary(m)
+        assert "0:MainThread" in summary.threads
+        total += summary.total_metric
+
+    # Together, the chunks cover the whole run of the target threads.
+    assert total >= 2 * 3e6
@@ -0,0 +1,161 @@
+import gzip
+import socket
+import sys
+import tempfile
+import typing as t
+import zlib
+from pathlib import Path
+from threading import Thread
+from threading import Timer
+from time import monotonic
+
+from austin.format.mojo import MojoFile
+
+from tests.utils import PROFILES
+from tests.utils import DataSummary
+from tests.utils import run_echion
+
+
+class Collector(Thread):
+    def __init__(self, path: Path) -> None:
+        super().__init__(daemon=True)
+
+        self.server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.server.bind(str(path))
+        self.server.listen()
+
+        self.streams: t.List[bytes] = []
+        # When the first and the last data of each stream were received
+        self.times: t.List[t.Tuple[float, float]] = []
+
+    def run(self) -> None:
+        while True:
+            try:
+                connection, _ = self.server.accept()
+            except OSError:
+                return
+
+            data = bytearray()
+            first = None
+            with connection:
+                while chunk := connection.recv(1 << 16):
+                    first = first or monotonic()
+                    data += chunk
+            self.streams.append(bytes(data))
+            self.times.append((first or monotonic(), monotonic()))
+
+
+def test_stream():
+    with tempfile.TemporaryDirectory() as tmp:
+        path = Path(tmp) / "collector.sock"
+
+        collector = Collector(path)
+        collector.start()
+
+        result = run_echion("-o", f"unix://{path}", sys.executable, "-m", "tests.target")
+        assert result.returncode == 0, result.stderr.decode()
+
+        collector.server.close()
+        collector.join(timeout=5)
+
+    assert len(collector.streams) == 1
+
+    output_file = PROFILES / "test_stream.mojo"
+    output_file.write_bytes(collector.streams[0])
+
+    m = MojoFile(output_file.open(mode="rb"))
+    m.unwind()
+
+    assert m.metadata["stream"].startswith("sent=")
+
+    summary = DataSummary(m)
+    assert summary.query("0:MainThread", ("main", "bar")) is not None
+    assert summary.query("0:SecondaryThread", ("main", "bar", "foo", "cpu_sleep")) is not None
+
+
+def test_stream_late_collector():
+    with tempfile.TemporaryDirectory() as tmp:
+        path = Path(tmp) / "collector.sock"
+
+        # The collector starts listening after echion has started sampling.
+        collectors: t.List[Collector] = []
+
+        def start_collector() -> None:
+            collectors.append(Collector(path))
+            collectors[0].start()
+
+        timer = Timer(0.5, start_collector)
+        timer.start()
+
+        result = run_echion("-o", f"unix://{path}", sys.executable, "-m", "tests.target")
+        assert result.returncode == 0, result.stderr.decode()
+
+        timer.join()
+        (collector,) = collectors
+        collector.server.close()
+        collector.join(timeout=5)
+
+    assert len(collector.streams) == 1
+
+    output_file = PROFILES / "test_stream_late_collector.mojo"
+    output_file.write_bytes(collector.streams[0])
+
+    m = MojoFile(output_file.open(mode="rb"))
+    m.unwind()
+
+    # The stream starts over when the collector connects, and what was
+    # collected before then is lost.
+    stats = dict(_.split("=") for _ in m.metadata["stream"].split(","))
+    assert int(stats["reconnects"]) == 1
+    assert int(stats["dropped"]) > 0
+
+    summary = DataSummary(m)
+    assert summary.query("0:SecondaryThread", ("main", "bar", "foo", "cpu_sleep")) is not None
+
+
+def test_stream_compression():
+    with tempfile.TemporaryDirectory() as tmp:
+        path = Path(tmp) / "collector.sock"
+
+        collector = Collector(path)
+        collector.start()
+
+        result = run_echion(
+            "--output-compression",
+            "gzip",
+            "-o",
+            f"unix://{path}",
+            sys.executable,
+            "-m",
+            "tests.target",
+        )
+        assert result.returncode == 0, result.stderr.decode()
+
+        collector.server.close()
+        collector.join(timeout=5)
+
+    assert len(collector.streams) == 1
+
+    # The compressed data is streamed while sampling, which takes about 3
+    # seconds, in frames that are cut short when it is time to send.
+    first, last = collector.times[0]
+    assert last - first > 1
+
+    frames = 0
+    data = collector.streams[0]
+    while data:
+        frame = zlib.decompressobj(16 + zlib.MAX_WBITS)
+        frame.decompress(data)
+        assert frame.eof
+        frames += 1
+        data = frame.unused_data
+    assert frames >= 10
+
+    output_file = PROFILES / "test_stream_compression.mojo"
+    output_file.write_bytes(gzip.decompress(collector.streams[0]))
+
+    m = MojoFile(output_file.open(mode="rb"))
+    m.unwind()
+
+    summary = DataSummary(m)
+    assert summary.query("0:SecondaryThread", ("main", "bar", "foo", "cpu_sleep")) is not None
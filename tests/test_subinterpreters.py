@@ -0,0 +1,36 @@
+import pytest
+
+from tests.utils import PY, DataSummary, run_target
+
+
+pytestmark = pytest.mark.skipif(PY < (3, 12), reason="Requires per-interpreter GIL")
+
+
+def test_subinterpreters():
+    result, data = run_target("target_subinterpreters")
+    assert result.returncode == 0, result.stderr.decode()
+
+    assert data is not None
+    summary = DataSummary(data)
+
+    summary.assert_substack("0:MainThread", ("<module>", "main_leaf"), lambda v: v >= 0.5e6)
+
+    # Depending on the Python version, the sub-interpreter code is attributed
+    # to either the worker thread or the thread that created the interpreter.
+    sub_metric = max(
+        summary.query(thread, ("<module>", "sub_main", "sub_leaf")) or 0
+        for thread in summary.threads
+        if thread.startswith("1:")
+    )
+    assert sub_metric >= 0.5e6, summary.threads.keys()
+
+
+def test_subinterpreters_filter():
+    result, data = run_target("target_subinterpreters", "--interpreters", "1")
+    assert result.returncode == 0, result.stderr.decode()
+
+    assert data is not None
+    summary = DataSummary(data)
+
+    assert summary.threads
+    assert all(_.startswith("1:") for _ in summary.threads), summary.threads
@@ -0,0 +1,49 @@
+import json
+import sys
+
+from tests.utils import PROFILES
+from tests.utils import run_echion
+
+
+def test_trace():
+    trace_file = PROFILES / "test_trace.json"
+
+    result = run_echion(
+        "--trace",
+        str(trace_file),
+        "--trace-size",
+        "4096",
+        "-o",
+        str(PROFILES / "test_trace.mojo"),
+        sys.executable,
+        "-m",
+        "tests.target",
+    )
+    assert result.returncode == 0, result.stderr.decode()
+
+    events = json.loads(trace_file.read_text())["traceEvents"]
+
+    # We only keep the most recent spans.
+    assert 0 < len(events) <= 4096
+
+    for event in events:
+        assert event["ph"] == "X"
+        assert event["dur"] >= 0
+
+    phases = {event["name"] for event in events}
+    assert {"tick", "interpreters", "thread_states", "sample", "unwind", "render"} <= phases
+    if sys.version_info >= (3, 11):
+        assert "stack_chunk" in phases
+
+    # Each sample is attributed to the thread that it is taken from.
+    assert all("thread" in event["args"] for event in events if event["name"] == "sample")
+
+    # The samples of a tick happen within it.
+    ticks = [event for event in events if event["name"] == "tick"]
+    samples = [event for event in events if event["name"] == "sample"]
+    assert any(
+        tick["ts"] <= sample["ts"]
+        and sample["ts"] + sample["dur"] <= tick["ts"] + tick["dur"]
+        for sample in samples
+        for tick in ticks
+    )
@@ -135,6 +135,32 @@ def test_wall_time(stealth):
             )
 
 
+@retry_on_valueerror()
+def test_wall_time_workers():
+    result, data = run_target("target", "--workers", "2")
+    assert result.returncode == 0, result.stderr.decode()
+
+    assert data is not None
+    md = data.metadata
+    assert md["mode"] == "wall"
+
+    summary = DataSummary(data)
+
+    assert summary.nthreads == 3, summary.threads
+
+    # Test line numbers
+    assert summary.query("0:MainThread", (("main", 22), ("bar", 17))) is not None
+    assert summary.query("0:SecondaryThread", (("bar", 18), ("foo", 13))) is not None
+
+    # Each thread is sampled by either worker, but we should still get all the
+    # samples for both
+    for thread in ("0:MainThread", "0:SecondaryThread"):
+        summary.assert_substack(thread, ("main", "bar"), lambda v: v >= 0.95e6)
+        summary.assert_substack(
+            thread, ("main", "bar", "foo", "cpu_sleep"), lambda v: v >= 4.5e5
+        )
+
+
 @retry_on_valueerror()
 @stealth
 @pytest.mark.xfail